@@ -0,0 +1,509 @@
+#include "block_file.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <algorithm>
+
+#include "task_queue.h"
+#include "logger.h"
+
+// ͬһļôblockں̨Ŷ, writeҪ
+#define MAX_PENDING_BLOCKS 8
+
+using namespace std;
+using boost::shared_ptr;
+
+static const char BLOCK_MAGIC[4] = { 'F', 'W', 'B', 'K' };
+static const char INDEXED_BLOCK_MAGIC[4] = { 'F', 'W', 'B', 'I' };
+static const char INDEX_MAGIC[4] = { 'F', 'W', 'I', 'X' };
+static const unsigned INDEX_HEADER_SIZE = 16;
+// ƫindexed headerλ, дļʱ
+static const unsigned OFFSET_POSITION = 36;
+
+// blockһϢʱֲ
+static bool lastTimeLess(const BlockIndexEntry& entry, long long timestamp) {
+	return entry.lastTime < timestamp;
+}
+
+/*
+ * ں̨ѹһblock, ɺ󽻻ظBlockFile˳д.
+ */
+class CompressBlockTask: public Task {
+public:
+	CompressBlockTask(BlockFile* block_file, unsigned long block_seq, block_codec_t block_codec, int block_level, const string& data, const BlockIndexEntry* block_entry) :
+		blockFile(block_file), seq(block_seq), codec(block_codec), level(block_level), raw(data), indexed(block_entry != NULL) {
+		if (block_entry) {
+			entry = *block_entry;
+		}
+	}
+
+	void run() {
+		string block;
+		bool success = BlockFile::compressBlock(codec, level, raw, indexed ? &entry : NULL, block);
+		// BlockFilecloseʱblock, ָһЧ
+		blockFile->blockCompressed(seq, block, success);
+	}
+
+private:
+	BlockFile* blockFile;
+	unsigned long seq;
+	block_codec_t codec;
+	int level;
+	string raw;
+	bool indexed;
+	BlockIndexEntry entry;
+};
+
+BlockFile::BlockFile(shared_ptr<FileInterface> underlying, const std::string& name, block_codec_t block_codec, int compress_level, unsigned long block_size, bool is_indexed,
+		TaskQueue* compress_queue, unsigned long max_block_age) :
+	FileInterface(name, false), file(underlying), codec(block_codec), level(compress_level), blockSize(block_size), indexed(is_indexed), compressQueue(compress_queue),
+			maxBlockAge(max_block_age), writeOffset(0), nextSeq(0), nextWriteSeq(0), writeError(false), readPos(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&blockWrittenCond, NULL);
+}
+
+BlockFile::~BlockFile() {
+	waitForBlocks();
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&blockWrittenCond);
+}
+
+bool BlockFile::parseCodec(const std::string& name, block_codec_t& _return) {
+	if (0 == name.compare("none")) {
+		_return = CODEC_NONE;
+	} else if (0 == name.compare("zlib")) {
+		_return = CODEC_ZLIB;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool BlockFile::compressBlock(block_codec_t codec, int level, const std::string& raw, const BlockIndexEntry* entry, std::string& _return) {
+	string data;
+	if (codec == CODEC_ZLIB) {
+		uLongf length = compressBound(raw.length());
+		data.resize(length);
+		if (Z_OK != compress2((Bytef*) &data[0], &length, (const Bytef*) raw.data(), raw.length(), level)) {
+			LOG_OPER("ERROR: zlib failed to compress block of <%lu> bytes", (unsigned long) raw.length());
+			return false;
+		}
+		data.resize(length);
+	} else {
+		data = raw;
+	}
+
+	char header[INDEXED_HEADER_SIZE];
+	unsigned header_size = entry ? INDEXED_HEADER_SIZE : HEADER_SIZE;
+	memset(header, 0, header_size);
+	memcpy(header, entry ? INDEXED_BLOCK_MAGIC : BLOCK_MAGIC, 4);
+	header[4] = (char) codec;
+	serializeBlockUInt(data.length(), header + 8);
+	serializeBlockUInt(raw.length(), header + 12);
+	if (entry) {
+		serializeBlockUInt(entry->records, header + 16);
+		serializeBlockULong(entry->firstTime, header + 20);
+		serializeBlockULong(entry->lastTime, header + 28);
+	}
+
+	_return.reserve(header_size + data.length());
+	_return.assign(header, header_size);
+	_return += data;
+	return true;
+}
+
+bool BlockFile::readIndex(const std::string& filename, std::vector<BlockIndexEntry>& _return) {
+	_return.clear();
+	ifstream in(filename.c_str(), ios_base::in | ios_base::binary);
+	if (!in.good()) {
+		return false;
+	}
+	in.seekg(0, ios_base::end);
+	long long size = in.tellg();
+	if (size < (long long) (INDEX_HEADER_SIZE + INDEX_TRAILER_SIZE)) {
+		return false;
+	}
+
+	char trailer[INDEX_TRAILER_SIZE];
+	in.seekg(size - INDEX_TRAILER_SIZE);
+	in.read(trailer, INDEX_TRAILER_SIZE);
+	if (!in.good() || 0 != memcmp(trailer + 12, INDEX_MAGIC, 4)) {
+		return false;
+	}
+	unsigned long long index_offset = unserializeBlockULong(trailer);
+	unsigned count = unserializeBlockUInt(trailer + 8);
+	if (index_offset + INDEX_HEADER_SIZE + (unsigned long long) count * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE != (unsigned long long) size) {
+		LOG_OPER("WARNING: inconsistent block index in file <%s>", filename.c_str());
+		return false;
+	}
+
+	string data(INDEX_HEADER_SIZE + count * INDEX_ENTRY_SIZE, '\0');
+	in.seekg(index_offset);
+	in.read(&data[0], data.length());
+	if (!in.good() || 0 != memcmp(data.data(), INDEX_MAGIC, 4) || unserializeBlockUInt(data.data() + 4) != count) {
+		LOG_OPER("WARNING: bad block index in file <%s>", filename.c_str());
+		return false;
+	}
+
+	_return.resize(count);
+	for (unsigned i = 0; i < count; ++i) {
+		parseIndexEntry(data.data() + INDEX_HEADER_SIZE + i * INDEX_ENTRY_SIZE, _return[i]);
+	}
+	return true;
+}
+
+void BlockFile::parseIndexEntry(const char* buffer, BlockIndexEntry& _return) {
+	_return.offset = unserializeBlockULong(buffer);
+	_return.firstTime = unserializeBlockULong(buffer + 8);
+	_return.lastTime = unserializeBlockULong(buffer + 16);
+	_return.records = unserializeBlockUInt(buffer + 24);
+	_return.rawLength = unserializeBlockUInt(buffer + 28);
+}
+
+void BlockFile::serializeBlockUInt(unsigned data, char* buffer) {
+	for (int i = 0; i < 4; ++i) {
+		buffer[i] = (unsigned char) ((data >> (8 * i)) & 0xFF);
+	}
+}
+
+unsigned BlockFile::unserializeBlockUInt(const char* buffer) {
+	unsigned retval = 0;
+	for (int i = 0; i < 4; ++i) {
+		retval |= (unsigned char) buffer[i] << (8 * i);
+	}
+	return retval;
+}
+
+void BlockFile::serializeBlockULong(unsigned long long data, char* buffer) {
+	for (int i = 0; i < 8; ++i) {
+		buffer[i] = (unsigned char) ((data >> (8 * i)) & 0xFF);
+	}
+}
+
+unsigned long long BlockFile::unserializeBlockULong(const char* buffer) {
+	unsigned long long retval = 0;
+	for (int i = 0; i < 8; ++i) {
+		retval |= (unsigned long long) (unsigned char) buffer[i] << (8 * i);
+	}
+	return retval;
+}
+
+bool BlockFile::openRead() {
+	if (inFile.is_open()) {
+		return false;
+	}
+	inFile.open(filename.c_str(), ios_base::in | ios_base::binary);
+	readBuffer.clear();
+	readPos = 0;
+	return inFile.good();
+}
+
+bool BlockFile::openWrite() {
+	writeError = false;
+	if (!file->openWrite()) {
+		return false;
+	}
+	writeOffset = file->fileSize();
+	if (indexed && !loadIndex()) {
+		index.clear();
+	}
+	return true;
+}
+
+bool BlockFile::openTruncate() {
+	writeError = false;
+	writeOffset = 0;
+	index.clear();
+	return file->openTruncate();
+}
+
+// ׷дļʱ, ϴcloseʱд, µеblock.
+// ϴûcloseĻ, ֮ǰblockͲ, ֻ˳.
+bool BlockFile::loadIndex() {
+	if (writeOffset == 0) {
+		index.clear();
+		return true;
+	}
+	return readIndex(filename, index);
+}
+
+bool BlockFile::isOpen() {
+	return inFile.is_open() || file->isOpen();
+}
+
+void BlockFile::close() {
+	if (inFile.is_open()) {
+		inFile.close();
+	}
+
+	// ʣ²һblockҲҪдȥ
+	if (!pendingData.empty()) {
+		submitBlock();
+	}
+	waitForBlocks();
+
+	pthread_mutex_lock(&mutex);
+	if (indexed && file->isOpen() && !index.empty()) {
+		writeIndex();
+	}
+	index.clear();
+	file->close();
+	pthread_mutex_unlock(&mutex);
+}
+
+void BlockFile::writeIndex() {
+	string data(INDEX_HEADER_SIZE + index.size() * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE, '\0');
+	char* buffer = &data[0];
+	memcpy(buffer, INDEX_MAGIC, 4);
+	serializeBlockUInt(index.size(), buffer + 4);
+	buffer += INDEX_HEADER_SIZE;
+	for (vector<BlockIndexEntry>::const_iterator iter = index.begin(); iter != index.end(); ++iter) {
+		serializeBlockULong(iter->offset, buffer);
+		serializeBlockULong(iter->firstTime, buffer + 8);
+		serializeBlockULong(iter->lastTime, buffer + 16);
+		serializeBlockUInt(iter->records, buffer + 24);
+		serializeBlockUInt(iter->rawLength, buffer + 28);
+		buffer += INDEX_ENTRY_SIZE;
+	}
+	serializeBlockULong(writeOffset, buffer);
+	serializeBlockUInt(index.size(), buffer + 8);
+	memcpy(buffer + 12, INDEX_MAGIC, 4);
+
+	if (file->write(data)) {
+		writeOffset += data.length();
+	} else {
+		LOG_OPER("ERROR: failed to write block index to file <%s>", filename.c_str());
+	}
+}
+
+bool BlockFile::write(const std::string& data) {
+	return writeRecords(data, 0);
+}
+
+bool BlockFile::writeRecords(const std::string& data, unsigned long num_records) {
+	pthread_mutex_lock(&mutex);
+	bool error = writeError;
+	pthread_mutex_unlock(&mutex);
+	if (error) {
+		return false;
+	}
+
+	time_t now = time(NULL);
+	if (pendingData.empty()) {
+		pendingEntry.firstTime = now;
+	}
+	pendingEntry.lastTime = now;
+	pendingEntry.records += num_records;
+	pendingData += data;
+	if (pendingData.length() >= blockSize) {
+		submitBlock();
+	}
+	return true;
+}
+
+// pendingDataΪһblockύѹ
+void BlockFile::submitBlock() {
+	string raw;
+	raw.swap(pendingData);
+	BlockIndexEntry entry = pendingEntry;
+	pendingEntry = BlockIndexEntry();
+
+	pthread_mutex_lock(&mutex);
+	// ̨ѹ̫͵һ, ڴռ޵
+	while (nextSeq - nextWriteSeq >= MAX_PENDING_BLOCKS) {
+		pthread_cond_wait(&blockWrittenCond, &mutex);
+	}
+	unsigned long seq = nextSeq++;
+	pthread_mutex_unlock(&mutex);
+
+	if (compressQueue) {
+		compressQueue->addTask(shared_ptr<Task> (new CompressBlockTask(this, seq, codec, level, raw, indexed ? &entry : NULL)));
+	} else {
+		string block;
+		bool success = compressBlock(codec, level, raw, indexed ? &entry : NULL, block);
+		blockCompressed(seq, block, success);
+	}
+}
+
+void BlockFile::blockCompressed(unsigned long seq, const std::string& block, bool success) {
+	pthread_mutex_lock(&mutex);
+	if (success) {
+		readyBlocks[seq] = block;
+	} else {
+		// ѹʧܵblockλ, ֤blockܰ˳д
+		writeError = true;
+		readyBlocks[seq] = string();
+	}
+	writeReadyBlocks();
+	pthread_cond_broadcast(&blockWrittenCond);
+	pthread_mutex_unlock(&mutex);
+}
+
+void BlockFile::writeReadyBlocks() {
+	map<unsigned long, string>::iterator iter;
+	while ((iter = readyBlocks.find(nextWriteSeq)) != readyBlocks.end()) {
+		string& block = iter->second;
+		if (!block.empty()) {
+			if (indexed) {
+				serializeBlockULong(writeOffset, &block[OFFSET_POSITION]);
+			}
+			if (file->write(block)) {
+				if (indexed) {
+					BlockIndexEntry entry;
+					entry.offset = writeOffset;
+					entry.records = unserializeBlockUInt(block.data() + 16);
+					entry.firstTime = unserializeBlockULong(block.data() + 20);
+					entry.lastTime = unserializeBlockULong(block.data() + 28);
+					entry.rawLength = unserializeBlockUInt(block.data() + 12);
+					index.push_back(entry);
+				}
+				writeOffset += block.length();
+			} else {
+				LOG_OPER("ERROR: failed to write compressed block to file <%s>", filename.c_str());
+				writeError = true;
+			}
+		}
+		readyBlocks.erase(iter);
+		++nextWriteSeq;
+	}
+}
+
+void BlockFile::waitForBlocks() {
+	pthread_mutex_lock(&mutex);
+	while (nextWriteSeq != nextSeq) {
+		pthread_cond_wait(&blockWrittenCond, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+// writeһֻдļ߳
+void BlockFile::flush() {
+	if (maxBlockAge && !pendingData.empty() && time(NULL) - pendingEntry.firstTime >= (long long) maxBlockAge) {
+		submitBlock();
+		waitForBlocks();
+	}
+
+	pthread_mutex_lock(&mutex);
+	file->flush();
+	pthread_mutex_unlock(&mutex);
+}
+
+unsigned long BlockFile::fileSize() {
+	pthread_mutex_lock(&mutex);
+	unsigned long size = file->fileSize();
+	pthread_mutex_unlock(&mutex);
+	return size;
+}
+
+bool BlockFile::seekToTime(time_t timestamp) {
+	vector<BlockIndexEntry> entries;
+	if (!inFile.is_open() || !readIndex(filename, entries)) {
+		return false;
+	}
+
+	vector<BlockIndexEntry>::iterator iter = lower_bound(entries.begin(), entries.end(), (long long) timestamp, lastTimeLess);
+	inFile.clear();
+	if (iter == entries.end()) {
+		// timestamp, ֱĩβ
+		inFile.seekg(0, ios_base::end);
+	} else {
+		inFile.seekg(iter->offset);
+	}
+	readBuffer.clear();
+	readPos = 0;
+	return inFile.good();
+}
+
+// ѹһblock, ļblockʱfalse
+bool BlockFile::readBlock(std::string& _return) {
+	char header[INDEXED_HEADER_SIZE];
+	inFile.read(header, HEADER_SIZE);
+	if (!inFile.good()) {
+		return false;
+	}
+	// мblock(׷д֮ǰǴcloseд)ֱ
+	while (0 == memcmp(header, INDEX_MAGIC, 4)) {
+		unsigned count = unserializeBlockUInt(header + 4);
+		inFile.seekg((long long) count * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE, ios_base::cur);
+		inFile.read(header, HEADER_SIZE);
+		if (!inFile.good()) {
+			return false;
+		}
+	}
+	if (0 == memcmp(header, INDEXED_BLOCK_MAGIC, 4)) {
+		inFile.read(header + HEADER_SIZE, INDEXED_HEADER_SIZE - HEADER_SIZE);
+		if (!inFile.good()) {
+			LOG_OPER("WARNING: truncated block at the end of file <%s>", filename.c_str());
+			return false;
+		}
+	} else if (0 != memcmp(header, BLOCK_MAGIC, 4)) {
+		LOG_OPER("ERROR: bad block header in file <%s> at offset <%ld>", filename.c_str(), (long) inFile.tellg() - HEADER_SIZE);
+		return false;
+	}
+	block_codec_t block_codec = (block_codec_t) header[4];
+	unsigned data_length = unserializeBlockUInt(header + 8);
+	unsigned raw_length = unserializeBlockUInt(header + 12);
+
+	string data(data_length, '\0');
+	if (data_length) {
+		inFile.read(&data[0], data_length);
+		if (!inFile.good()) {
+			LOG_OPER("WARNING: truncated block at the end of file <%s>", filename.c_str());
+			return false;
+		}
+	}
+
+	if (block_codec == CODEC_ZLIB) {
+		_return.resize(raw_length);
+		uLongf length = raw_length;
+		if (Z_OK != uncompress((Bytef*) &_return[0], &length, (const Bytef*) data.data(), data_length) || length != raw_length) {
+			LOG_OPER("ERROR: failed to uncompress block in file <%s>", filename.c_str());
+			return false;
+		}
+	} else {
+		_return.swap(data);
+	}
+	return true;
+}
+
+bool BlockFile::readNext(std::string& _return) {
+	while (true) {
+		string::size_type newline = readBuffer.find('\n', readPos);
+		if (newline != string::npos) {
+			_return.assign(readBuffer, readPos, newline - readPos);
+			readPos = newline + 1;
+			return true;
+		}
+
+		string block;
+		if (!readBlock(block)) {
+			return false;
+		}
+		readBuffer.erase(0, readPos);
+		readPos = 0;
+		readBuffer += block;
+	}
+}
+
+void BlockFile::deleteFile() {
+	file->deleteFile();
+}
+
+void BlockFile::listImpl(const std::string& path, std::vector<std::string>& _return) {
+	file->listImpl(path, _return);
+}
+
+std::string BlockFile::getFrame(unsigned data_size) {
+	return file->getFrame(data_size);
+}
+
+std::string BlockFile::getFrame(const std::string& data, const std::string& suffix) {
+	return file->getFrame(data, suffix);
+}
+
+bool BlockFile::preallocate(unsigned long size) {
+	return file->preallocate(size);
+}
@@ -0,0 +1,143 @@
+#ifndef FORWARDER_BLOCK_FILE_H
+#define FORWARDER_BLOCK_FILE_H
+
+#include <map>
+#include <vector>
+#include <fstream>
+#include <pthread.h>
+#include <time.h>
+
+#include "file.h"
+
+class TaskQueue;
+
+enum block_codec_t {
+	CODEC_NONE = 0, CODEC_ZLIB = 1
+};
+
+/*
+ * ʽһblock, дblock header, Ҳдļĩβ.
+ */
+class BlockIndexEntry {
+public:
+	BlockIndexEntry() :
+		offset(0), firstTime(0), lastTime(0), records(0), rawLength(0) {
+	}
+
+	unsigned long long offset;
+	long long firstTime;
+	long long lastTime;
+	unsigned records;
+	unsigned rawLength;
+};
+
+/*
+ * ֿѹļ, һFileInterfaceװ.
+ *
+ * ļʽΪһblock:
+ *   [block header][ѹ][block header][ѹ]...
+ * block headerΪ16ֽ(little endian):
+ *   magic(4) codec(1) reserved(3) ѹ󳤶(4) ԭʼ(4)
+ *
+ * ĸʽ(indexed)ʹһmagic, block headerΪ44ֽ:
+ *   magic(4) codec(1) reserved(3) ѹ󳤶(4) ԭʼ(4) Ϣ(4) һʱ(8) һʱ(8) blockļеƫ(8)
+ * closeʱļĩβдһblock:
+ *   magic(4) Ŀ(4) reserved(8) Ŀ * [ƫ(8) һʱ(8) һʱ(8) Ϣ(4) ԭʼ(4)] blockƫ(8) Ŀ(4) magic(4)
+ * ʱȿļ16ֽ, ҵ, ʱֲһ߰blockָ߳ȥ.
+ * ʱϢдļʱ(). ˳ʱмblock(´׷д).
+ *
+ * blockֻwrite߽з, FileStoreÿwriteĶϢ, һblockϢ.
+ * ÿblockѹ, Բнѹ; ļضʱ, һblockᱻ, ǰĶܶ.
+ *
+ * ѹԽ̨TaskQueue, ѹblockύ˳дļ.
+ * block_sizeһȵcloseʱд; max_block_ageĻ, flushʱpendingData˳max_block_age,
+ * ͰΪһСblockдȥ, categoryһֱѹڴ.
+ */
+class BlockFile: public FileInterface {
+public:
+	BlockFile(boost::shared_ptr<FileInterface> file, const std::string& name, block_codec_t codec, int level, unsigned long block_size, bool indexed = false,
+			TaskQueue* compress_queue = NULL, unsigned long max_block_age = 0);
+	virtual ~BlockFile();
+
+	static const unsigned HEADER_SIZE = 16;
+	static const unsigned INDEXED_HEADER_SIZE = 44;
+	static const unsigned INDEX_ENTRY_SIZE = 32;
+	static const unsigned INDEX_TRAILER_SIZE = 16;
+
+	static bool parseCodec(const std::string& name, block_codec_t& _return);
+	// һѹblock(header + ). entryΪNULLʱɴheader, ƫдʱ
+	static bool compressBlock(block_codec_t codec, int level, const std::string& raw, const BlockIndexEntry* entry, std::string& _return);
+	// ļĩβ, ļû(ûclose߲indexedʽ)ʱfalse
+	static bool readIndex(const std::string& filename, std::vector<BlockIndexEntry>& _return);
+
+	bool openRead();
+	bool openWrite();
+	bool openTruncate();
+	bool isOpen();
+	void close();
+	bool write(const std::string& data);
+	bool writeRecords(const std::string& data, unsigned long num_records);
+	void flush();
+	unsigned long fileSize();
+	bool readNext(std::string& _return); // ؽѹһ
+	void deleteFile();
+	void listImpl(const std::string& path, std::vector<std::string>& _return);
+	std::string getFrame(unsigned data_size);
+	std::string getFrame(const std::string& data, const std::string& suffix);
+	bool preallocate(unsigned long size);
+
+	// openRead֮, һϢʱ䲻timestampĵһblock. ûʱfalse, λò
+	bool seekToTime(time_t timestamp);
+
+	// ̨ѹɺĻص, seq˳дļ
+	void blockCompressed(unsigned long seq, const std::string& block, bool success);
+
+protected:
+	static void serializeBlockUInt(unsigned data, char* buffer);
+	static unsigned unserializeBlockUInt(const char* buffer);
+	static void serializeBlockULong(unsigned long long data, char* buffer);
+	static unsigned long long unserializeBlockULong(const char* buffer);
+	static void parseIndexEntry(const char* buffer, BlockIndexEntry& _return);
+
+	bool loadIndex(); // ׷дļʱԭ
+	void writeIndex(); // ߱mutex
+
+	void submitBlock();
+	void writeReadyBlocks(); // ߱mutex
+	void waitForBlocks();
+	bool readBlock(std::string& _return);
+
+	boost::shared_ptr<FileInterface> file;
+	block_codec_t codec;
+	int level;
+	unsigned long blockSize;
+	bool indexed;
+	TaskQueue* compressQueue; // ΪNULLʱڵǰ߳ѹ
+	unsigned long maxBlockAge; // , 0ʾblockһֱȵclose
+
+	// д״̬
+	std::string pendingData; // ûдչһblock
+	BlockIndexEntry pendingEntry; // pendingDataϢʱ
+	unsigned long long writeOffset; // һblockļеƫ
+	std::vector<BlockIndexEntry> index; // Ѿдļblock, closeʱдļĩβ
+	unsigned long nextSeq; // һύblock
+	unsigned long nextWriteSeq; // һҪдļblock
+	std::map<unsigned long, std::string> readyBlocks; // Ѿѹ, ǰblockûд
+	bool writeError;
+
+	pthread_mutex_t mutex; // д״̬Ͷfileķ
+	pthread_cond_t blockWrittenCond;
+
+	// ״̬
+	std::ifstream inFile;
+	std::string readBuffer;
+	std::string::size_type readPos;
+
+private:
+	// ֵͿչ
+	BlockFile();
+	BlockFile(BlockFile& rhs);
+	BlockFile& operator=(BlockFile& rhs);
+};
+
+#endif // !defined FORWARDER_BLOCK_FILE_H
@@ -0,0 +1,196 @@
+#include "compactor.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <fstream>
+#include <vector>
+
+#include "block_file.h"
+#include "logger.h"
+
+// linux/ioprio.h
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+using namespace std;
+using boost::shared_ptr;
+
+Compactor g_compactor;
+
+/*
+ * CompactorĹִ߳һCompactJob.
+ */
+class CompactTask: public Task {
+public:
+	CompactTask(Compactor* compactor, const CompactJob& compact_job) :
+		owner(compactor), job(compact_job) {
+	}
+
+	void run() {
+		owner->compact(job);
+	}
+
+private:
+	Compactor* owner;
+	CompactJob job;
+};
+
+// ļʱ0, log
+static unsigned long statFileSize(const string& filename) {
+	struct stat st;
+	if (0 != stat(filename.c_str(), &st)) {
+		return 0;
+	}
+	return st.st_size;
+}
+
+// ѵǰ̵߳ioȼidle, ֻڴ̿ʱŶд
+static void setIdleIoPriority() {
+#ifdef SYS_ioprio_set
+	if (0 != syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)) {
+		LOG_OPER("WARNING: failed to set idle io priority for compactor thread");
+	}
+#endif
+}
+
+Compactor::Compactor() :
+	queue(1) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+Compactor::~Compactor() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void Compactor::addJob(const CompactJob& job) {
+	queue.addTask(shared_ptr<Task> (new CompactTask(this, job)));
+}
+
+void Compactor::setBytesPerSec(unsigned long bytes_per_sec) {
+	limiter.setRate(bytes_per_sec);
+}
+
+unsigned long Compactor::getSize() {
+	return queue.getSize();
+}
+
+void Compactor::compact(const CompactJob& job) {
+	setIdleIoPriority();
+
+	shared_ptr<FileInterface> source = FileInterface::createFileInterface(job.fsType, job.filename);
+	if (!source) {
+		LOG_OPER("[%s] Failed to create file <%s> of type <%s> for compaction", job.category.c_str(), job.filename.c_str(), job.fsType.c_str());
+		return;
+	}
+	unsigned long size = statFileSize(job.filename);
+	if (size == 0) {
+		source->deleteFile();
+		return;
+	}
+
+	string target = job.filename + ".fz";
+	bool merge = job.mergeSize && size < job.mergeSize;
+
+	pthread_mutex_lock(&mutex);
+	if (merge) {
+		map<string, pair<string, string> >::iterator iter = mergeTargets.find(job.category);
+		if (iter != mergeTargets.end() && 0 == iter->second.first.compare(job.baseFilename)) {
+			target = iter->second.second;
+		} else {
+			mergeTargets[job.category] = make_pair(job.baseFilename, target);
+		}
+	} else {
+		// ļǰĺϲ, Сļϲļȥ
+		mergeTargets.erase(job.category);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	unsigned long old_size = statFileSize(target);
+	if (!compressInto(job, target)) {
+		LOG_OPER("[%s] Failed to compact file <%s> into <%s>, keeping it", job.category.c_str(), job.filename.c_str(), target.c_str());
+		// дһblockȥ, Ժܽ׷
+		if (old_size) {
+			if (0 != truncate(target.c_str(), old_size)) {
+				LOG_OPER("[%s] Failed to truncate file <%s>", job.category.c_str(), target.c_str());
+			}
+		} else {
+			unlink(target.c_str());
+		}
+		pthread_mutex_lock(&mutex);
+		mergeTargets.erase(job.category);
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	source->deleteFile();
+
+	unsigned long new_size = statFileSize(target);
+	LOG_OPER("[%s] Compacted file <%s> of <%lu> bytes into <%s>, added <%lu> bytes", job.category.c_str(), job.filename.c_str(), size, target.c_str(),
+			new_size - old_size);
+
+	if (merge && new_size >= job.mergeSize) {
+		pthread_mutex_lock(&mutex);
+		mergeTargets.erase(job.category);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+bool Compactor::compressInto(const CompactJob& job, const string& target) {
+	ifstream in(job.filename.c_str(), ios_base::in | ios_base::binary);
+	if (!in.good()) {
+		return false;
+	}
+	shared_ptr<FileInterface> out = FileInterface::createFileInterface(job.fsType, target);
+	if (!out || !out->openWrite()) {
+		return false;
+	}
+
+	unsigned long block_size = job.blockSize ? job.blockSize : 65536;
+	vector<char> buffer(block_size);
+	string pending;
+	bool success = true;
+	while (success) {
+		in.read(&buffer[0], block_size);
+		unsigned long got = in.gcount();
+		bool eof = !in.good();
+		if (in.bad()) {
+			success = false;
+			break;
+		}
+		limiter.throttle(got);
+		pending.append(&buffer[0], got);
+		if (pending.empty()) {
+			break;
+		}
+
+		// һзз, ֤һblockﶼ
+		string::size_type cut = pending.length();
+		if (!eof) {
+			string::size_type newline = pending.rfind('\n');
+			if (newline != string::npos) {
+				cut = newline + 1;
+			}
+		}
+		string block;
+		if (!BlockFile::compressBlock(CODEC_ZLIB, job.level, pending.substr(0, cut), NULL, block)) {
+			success = false;
+			break;
+		}
+		pending.erase(0, cut);
+
+		limiter.throttle(block.length());
+		if (!out->write(block)) {
+			success = false;
+			break;
+		}
+		if (eof && pending.empty()) {
+			break;
+		}
+	}
+	out->flush();
+	out->close();
+	return success;
+}
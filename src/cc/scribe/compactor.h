@@ -0,0 +1,70 @@
+#ifndef FORWARDER_COMPACTOR_H
+#define FORWARDER_COMPACTOR_H
+
+#include <map>
+#include <string>
+#include <pthread.h>
+
+#include "task_queue.h"
+#include "rate_limiter.h"
+
+/*
+ * һѾرյļѹ.
+ */
+class CompactJob {
+public:
+	CompactJob() :
+		level(-1), blockSize(0), mergeSize(0) {
+	}
+
+	std::string fsType;
+	std::string filename; // Ѿرյļ, ѹfilename.fzɾ
+	std::string category; // ͬһcategoryСļŻϲ
+	std::string baseFilename; // ڲͬ(base_filenameͬ)ļϲ
+	int level;
+	unsigned long blockSize;
+	unsigned long mergeSize; // ССļϲͬһ.fz, ֱС. 0ʾϲ
+};
+
+/*
+ * ں̨ѹrotateļ.
+ *
+ * ѹļʽBlockFileһ(zlib), ļԭļ.fz.
+ * ͬһcategoryͬһСļ׷ӵͬһ.fzļ, ļõһļ, suffixǶԵ.
+ * blockֻڻзз(һblockûлзʱӲ).
+ *
+ * ֻһ߳, idleioȼ, дֽbytes_per_sec, дļ.
+ */
+class Compactor {
+public:
+	Compactor();
+	virtual ~Compactor();
+
+	void addJob(const CompactJob& job);
+
+	// дϼÿôֽ, 0ʾ
+	void setBytesPerSec(unsigned long bytes_per_sec);
+
+	// ֻ״̬鿴.
+	unsigned long getSize();
+
+	// ڹ߳е
+	void compact(const CompactJob& job);
+
+private:
+	bool compressInto(const CompactJob& job, const std::string& target);
+
+	TaskQueue queue;
+
+	pthread_mutex_t mutex; // mergeTargets, ʵֻй̻߳õ
+	std::map<std::string, std::pair<std::string, std::string> > mergeTargets; // category -> (base_filename, ںϲ.fzļ)
+	RateLimiter limiter;
+
+	// ֵ
+	Compactor(Compactor& rhs);
+	Compactor& operator=(Compactor& rhs);
+};
+
+extern Compactor g_compactor;
+
+#endif // !defined FORWARDER_COMPACTOR_H
@@ -1,13 +1,24 @@
 #include <stdexcept>
 #include <sstream>
+#include <algorithm>
+#include <set>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #include "logger.h"
 #include "forwarder_server.h"
 #include "conn_pool.h"
+#include "connector.h"
+#include "utils.h"
 
 using std::string;
 using std::ostringstream;
 using std::map;
+using std::max;
 using boost::shared_ptr;
 using namespace apache::thrift;
 using namespace apache::thrift::protocol;
@@ -15,6 +26,44 @@ using namespace apache::thrift::transport;
 using namespace apache::thrift::server;
 using namespace forwarder::thrift;
 
+static pthread_mutex_t batchIdMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t batchIdPrefix = 0;
+static uint32_t batchIdCounter = 0;
+
+const string& localSenderId() {
+	static string sender_id;
+	pthread_mutex_lock(&batchIdMutex);
+	if (sender_id.empty()) {
+		char hostname[256] = { 0 };
+		gethostname(hostname, sizeof(hostname) - 1);
+		ostringstream oss;
+		oss << hostname << ":" << getpid() << ":" << time(NULL);
+		sender_id = oss.str();
+	}
+	pthread_mutex_unlock(&batchIdMutex);
+	return sender_id;
+}
+
+int64_t newBatchId() {
+	pthread_mutex_lock(&batchIdMutex);
+	if (!batchIdPrefix) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		uint32_t seed = (uint32_t) (tv.tv_sec * 1000003 + tv.tv_usec) ^ ((uint32_t) getpid() << 16);
+		// ߵλ, ǰ׺һֱϼҲɸ
+		seed &= 0x3fffffff;
+		batchIdPrefix = (uint64_t) (seed ? seed : 1) << 32;
+	}
+	if (!++batchIdCounter) {
+		// 32λ˾ͻһǰ׺, ͬһǰ׺ظ, batchIdҪֵ, ȻDedupWindowϴ
+		batchIdPrefix += (uint64_t) 1 << 32;
+		batchIdCounter = 1;
+	}
+	int64_t batch_id = (int64_t) (batchIdPrefix | batchIdCounter);
+	pthread_mutex_unlock(&batchIdMutex);
+	return batch_id;
+}
+
 ConnPool::ConnPool() {
 	pthread_mutex_init(&mapMutex, NULL);
 }
@@ -33,12 +82,33 @@ string ConnPool::makeKey(const string& hostname, unsigned long port) {
 	return key;
 }
 
-bool ConnPool::open(const string& hostname, unsigned long port, int timeout) {
-	return openCommon(makeKey(hostname, port), shared_ptr<forwarderConn> (new forwarderConn(hostname, port, timeout)));
+bool ConnPool::open(const string& hostname, unsigned long port, int timeout, unsigned long window, unsigned long pool_size, bool least_loaded,
+		bool credit_flow) {
+	string key = makeKey(hostname, port);
+	pthread_mutex_lock(&mapMutex);
+	bool exists = connMap.find(key) != connMap.end();
+	pthread_mutex_unlock(&mapMutex);
+
+	std::vector<shared_ptr<forwarderConn> > conns;
+	for (unsigned long i = 0; !exists && i < max(pool_size, 1UL); ++i) {
+		conns.push_back(shared_ptr<forwarderConn> (new forwarderConn(hostname, port, timeout, window)));
+		conns.back()->setCreditFlow(credit_flow);
+	}
+	return openCommon(key, conns, least_loaded);
 }
 
-bool ConnPool::open(const string &service, const server_vector_t &servers, int timeout) {
-	return openCommon(service, shared_ptr<forwarderConn> (new forwarderConn(service, servers, timeout)));
+bool ConnPool::open(const string &service, const server_vector_t &servers, int timeout, unsigned long window, unsigned long pool_size, bool least_loaded,
+		bool least_latency, bool credit_flow) {
+	pthread_mutex_lock(&mapMutex);
+	bool exists = connMap.find(service) != connMap.end();
+	pthread_mutex_unlock(&mapMutex);
+
+	std::vector<shared_ptr<forwarderConn> > conns;
+	for (unsigned long i = 0; !exists && i < max(pool_size, 1UL); ++i) {
+		conns.push_back(shared_ptr<forwarderConn> (new forwarderConn(service, servers, timeout, window, least_latency)));
+		conns.back()->setCreditFlow(credit_flow);
+	}
+	return openCommon(service, conns, least_loaded);
 }
 
 void ConnPool::close(const string& hostname, unsigned long port) {
@@ -49,50 +119,71 @@ void ConnPool::close(const string &service) {
 	closeCommon(service);
 }
 
-bool ConnPool::send(const string& hostname, unsigned long port, shared_ptr<logentry_vector_t> messages) {
-	return sendCommon(makeKey(hostname, port), messages);
+send_result_t ConnPool::send(const string& hostname, unsigned long port, shared_ptr<logentry_vector_t> messages, int64_t batch_id, const string& sender_id) {
+	return sendCommon(makeKey(hostname, port), messages, batch_id, sender_id);
+}
+
+send_result_t ConnPool::send(const string &service, shared_ptr<logentry_vector_t> messages, int64_t batch_id, const string& sender_id) {
+	return sendCommon(service, messages, batch_id, sender_id);
+}
+
+send_result_t ConnPool::sendFrames(const string& hostname, unsigned long port, const LogFrameRegion& region, unsigned long& sent) {
+	return sendFramesCommon(makeKey(hostname, port), region, sent);
 }
 
-bool ConnPool::send(const string &service, shared_ptr<logentry_vector_t> messages) {
-	return sendCommon(service, messages);
+send_result_t ConnPool::sendFrames(const string &service, const LogFrameRegion& region, unsigned long& sent) {
+	return sendFramesCommon(service, region, sent);
 }
 
-bool ConnPool::openCommon(const string &key, shared_ptr<forwarderConn> conn) {
+bool ConnPool::openCommon(const string &key, const std::vector<shared_ptr<forwarderConn> >& conns, bool least_loaded) {
 	// lockʱҪע:
-	// mapMutexסжconnMapĶд.
-	// connectionϵlockдɾʱ.
-	// connectionϵlockȷصrefcountһ, refcountķʶҪmapMutex.
-	// ڳconnectionľֲ֮ǰȻmapMutex.
+	// mapMutexסжconnMapĶд, ԼConnGroupü͸.
+	// connectionϵlockдɾʱ. ʱmapMutexѡ, ſmapMutex֮,
+	// һӲᵲסĿ.
 
 	pthread_mutex_lock(&mapMutex);
 	conn_map_t::iterator iter = connMap.find(key);
 	if (iter != connMap.end()) {
-		(*iter).second->addRef();
+		++(*iter).second->refCount;
 		pthread_mutex_unlock(&mapMutex);
 		return true;
-	} else {
-		if (conn->open()) {
-			// ref count1ʼ,ﲻҪaddRef
-			connMap[key] = conn;
-			pthread_mutex_unlock(&mapMutex);
-			return true;
-		} else {
-			// conn object that failed to open is deleted
-			pthread_mutex_unlock(&mapMutex);
-			return false;
+	}
+
+	// ֻ´򿪳ɹ, һ򲻿ʧ
+	shared_ptr<ConnGroup> group(new ConnGroup(least_loaded));
+	for (unsigned long i = 0; i < conns.size(); ++i) {
+		if (conns[i]->open()) {
+			ostringstream oss;
+			oss << key << "#" << group->conns.size();
+			group->conns.push_back(conns[i]);
+			group->load.push_back(0);
+			group->names.push_back(oss.str());
 		}
 	}
+	if (group->conns.empty()) {
+		pthread_mutex_unlock(&mapMutex);
+		return false;
+	}
+	if (group->conns.size() < conns.size()) {
+		LOG_OPER("opened <%lu> of <%lu> connections to <%s>", (unsigned long) group->conns.size(), (unsigned long) conns.size(), key.c_str());
+	}
+	// ref count1ʼ
+	connMap[key] = group;
+	pthread_mutex_unlock(&mapMutex);
+	return true;
 }
 
 void ConnPool::closeCommon(const string &key) {
 	pthread_mutex_lock(&mapMutex);
 	conn_map_t::iterator iter = connMap.find(key);
 	if (iter != connMap.end()) {
-		(*iter).second->releaseRef();
-		if ((*iter).second->getRef() <= 0) {
-			(*iter).second->lock();
-			(*iter).second->close();
-			(*iter).second->unlock();
+		shared_ptr<ConnGroup> group = (*iter).second;
+		if (--group->refCount <= 0) {
+			for (unsigned long i = 0; i < group->conns.size(); ++i) {
+				group->conns[i]->lock();
+				group->conns[i]->close();
+				group->conns[i]->unlock();
+			}
 			connMap.erase(iter);
 		}
 	} else {
@@ -102,33 +193,187 @@ void ConnPool::closeCommon(const string &key) {
 	pthread_mutex_unlock(&mapMutex);
 }
 
-bool ConnPool::sendCommon(const string &key, shared_ptr<logentry_vector_t> messages) {
+void ConnPool::updateServers(const string &service, const server_vector_t &servers) {
 	pthread_mutex_lock(&mapMutex);
-	conn_map_t::iterator iter = connMap.find(key);
+	conn_map_t::iterator iter = connMap.find(service);
+	shared_ptr<ConnGroup> group;
 	if (iter != connMap.end()) {
-		(*iter).second->lock();
-		pthread_mutex_unlock(&mapMutex);
-		bool result = (*iter).second->send(messages);
-		(*iter).second->unlock();
-		return result;
-	} else {
+		group = (*iter).second;
+	}
+	pthread_mutex_unlock(&mapMutex);
+	if (!group) {
+		return;
+	}
+	updateConnServers(group->conns, servers);
+}
+
+void updateConnServers(const std::vector<shared_ptr<forwarderConn> >& conns, const server_vector_t& servers) {
+	if (conns.empty()) {
+		return;
+	}
+	// ȿÿ˭. ֮󻻵ʱӿѾԼ, ûйϵ
+	server_vector_t old_servers;
+	std::map<server_vector_t::value_type, std::vector<unsigned long> > by_peer;
+	for (unsigned long i = 0; i < conns.size(); ++i) {
+		string host;
+		int port = 0;
+		conns[i]->lock();
+		if (i == 0) {
+			old_servers = conns[i]->getServers();
+		}
+		bool connected = conns[i]->getPeer(host, port);
+		conns[i]->unlock();
+		if (connected) {
+			by_peer[std::make_pair(host, port)].push_back(i);
+		}
+	}
+
+	server_vector_t added;
+	for (server_vector_t::const_iterator iter = servers.begin(); iter != servers.end(); ++iter) {
+		if (std::find(old_servers.begin(), old_servers.end(), *iter) == old_servers.end()) {
+			added.push_back(*iter);
+		}
+	}
+
+	std::set<unsigned long> moving;
+	if (!added.empty() && !old_servers.empty()) {
+		double share = (double) conns.size() * added.size() / servers.size();
+		unsigned long count = (unsigned long) share;
+		if ((double) rand() / RAND_MAX < share - count) {
+			++count;
+		}
+		// ÿδĻgroupĳԱŲһ
+		while (moving.size() < count) {
+			std::vector<unsigned long>* busiest = NULL;
+			for (std::map<server_vector_t::value_type, std::vector<unsigned long> >::iterator iter = by_peer.begin(); iter != by_peer.end(); ++iter) {
+				if (std::find(servers.begin(), servers.end(), iter->first) == servers.end()) {
+					continue; // Ѿ, Ҫ
+				}
+				if (!iter->second.empty() && (!busiest || iter->second.size() > busiest->size())) {
+					busiest = &iter->second;
+				}
+			}
+			if (!busiest) {
+				break;
+			}
+			moving.insert(busiest->back());
+			busiest->pop_back();
+		}
+	}
+
+	// һһӵػ, ճ
+	for (unsigned long i = 0; i < conns.size(); ++i) {
+		conns[i]->lock();
+		conns[i]->updateServers(servers, moving.count(i) ? &added : NULL);
+		conns[i]->unlock();
+	}
+}
+
+bool ConnPool::acquireConn(const string &key, shared_ptr<ConnGroup>& group, unsigned long& index) {
+	pthread_mutex_lock(&mapMutex);
+	conn_map_t::iterator iter = connMap.find(key);
+	if (iter == connMap.end()) {
 		LOG_OPER("send failed. No connection pool entry for <%s>", key.c_str());
 		pthread_mutex_unlock(&mapMutex);
 		return false;
 	}
+	group = (*iter).second;
+	index = group->pick();
+	pthread_mutex_unlock(&mapMutex);
+	return true;
 }
 
-forwarderConn::forwarderConn(const string& hostname, unsigned long port, int timeout_) :
-	refCount(1), smcBased(false), remoteHost(hostname), remotePort(port), timeout(timeout_) {
+void ConnPool::releaseConn(shared_ptr<ConnGroup> group, unsigned long index, send_result_t result, unsigned long messages) {
+	pthread_mutex_lock(&mapMutex);
+	--group->load[index];
+	pthread_mutex_unlock(&mapMutex);
+
+	// ÿӵͳ
+	const string& name = group->names[index];
+	if (result == SEND_OK) {
+		g_Handler->incrementCounter("conn " + name + " sent", messages);
+	} else if (result == SEND_TRY_LATER) {
+		g_Handler->incrementCounter("conn " + name + " try later");
+	} else {
+		g_Handler->incrementCounter("conn " + name + " failed");
+	}
+}
+
+send_result_t ConnPool::sendCommon(const string &key, shared_ptr<logentry_vector_t> messages, int64_t batch_id, const string& sender_id) {
+	shared_ptr<ConnGroup> group;
+	unsigned long index = 0;
+	if (!acquireConn(key, group, index)) {
+		return SEND_FAILED;
+	}
+	// groupر֮ӶҲ, ͻʧ
+	shared_ptr<forwarderConn> conn = group->conns[index];
+	conn->lock();
+	send_result_t result = conn->send(messages, batch_id, sender_id);
+	conn->unlock();
+	releaseConn(group, index, result, messages->size());
+	return result;
+}
+
+send_result_t ConnPool::sendFramesCommon(const string &key, const LogFrameRegion& region, unsigned long& sent) {
+	shared_ptr<ConnGroup> group;
+	unsigned long index = 0;
+	if (!acquireConn(key, group, index)) {
+		return SEND_FAILED;
+	}
+	shared_ptr<forwarderConn> conn = group->conns[index];
+	conn->lock();
+	unsigned long first = sent;
+	send_result_t result = conn->sendFrames(region, sent);
+	conn->unlock();
+	unsigned long messages = 0;
+	for (unsigned long i = first; i < sent; ++i) {
+		messages += region.frameMessages[i];
+	}
+	releaseConn(group, index, result, messages);
+	return result;
+}
+
+// ں̨õĺ, ÷̶߳ڵ
+unsigned long ConnGroup::pick() {
+	unsigned long size = conns.size();
+	unsigned long best = next % size;
+	bool best_down = conns[best]->isReconnecting();
+	for (unsigned long i = 1; i < size && (leastLoaded || best_down); ++i) {
+		unsigned long j = (next + i) % size;
+		bool down = conns[j]->isReconnecting();
+		if (best_down && !down) {
+			best = j;
+			best_down = false;
+		} else if (leastLoaded && down == best_down && load[j] < load[best]) {
+			best = j;
+		}
+	}
+	next = best + 1;
+	++load[best];
+	return best;
+}
+
+forwarderConn::forwarderConn(const string& hostname, unsigned long port, int timeout_, unsigned long window_) :
+	refCount(1), smcBased(false), remoteHost(hostname), remotePort(port), timeout(timeout_), window(window_ ? window_ : 1),
+	leastLatency(false), nextRerouteCheck(0), creditFlow(false), credit(0), lastGrant(0), creditRefreshing(false), reconnecting(false), nextSeqid(0), connGeneration(0), reading(false),
+	connBroken(false) {
 		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&inflightCond, NULL);
 	}
 
-forwarderConn::forwarderConn(const string& service, const server_vector_t &servers, int timeout_) :
-	refCount(1), smcBased(true), smcService(service), serverList(servers), timeout(timeout_) {
+forwarderConn::forwarderConn(const string& service, const server_vector_t &servers, int timeout_, unsigned long window_, bool least_latency) :
+	refCount(1), smcBased(true), smcService(service), serverList(servers), timeout(timeout_), window(window_ ? window_ : 1),
+	leastLatency(least_latency), nextRerouteCheck(0), creditFlow(false), credit(0), lastGrant(0), creditRefreshing(false), reconnecting(false), nextSeqid(0), connGeneration(0),
+	reading(false), connBroken(false) {
 		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&inflightCond, NULL);
 	}
 
 forwarderConn::~forwarderConn() {
+	if (connecting) {
+		connecting->cancel();
+	}
+	pthread_cond_destroy(&inflightCond);
 	pthread_mutex_destroy(&mutex);
 }
 
@@ -144,6 +389,10 @@ unsigned forwarderConn::getRef() {
 	return refCount;
 }
 
+void forwarderConn::setCreditFlow(bool enabled) {
+	creditFlow = enabled;
+}
+
 void forwarderConn::lock() {
 	pthread_mutex_lock(&mutex);
 }
@@ -154,29 +403,22 @@ void forwarderConn::unlock() {
 
 bool forwarderConn::open() {
 	try {
-		socket = smcBased ? shared_ptr<TSocket> (new TSocketPool(serverList)) : shared_ptr<TSocket> (new TSocket(remoteHost, remotePort));
+		if (smcBased && leastLatency) {
+			// ӳź, TSocketPool
+			server_vector_t ranked;
+			g_latencyRouter.rank(serverList, ranked);
+			TSocketPool* pool = new TSocketPool(ranked);
+			pool->setRandomize(false);
+			socket = shared_ptr<TSocket> (pool);
+		} else {
+			socket = smcBased ? shared_ptr<TSocket> (new TSocketPool(serverList)) : shared_ptr<TSocket> (new TSocket(remoteHost, remotePort));
+		}
 
 		if (!socket) {
 			throw std::runtime_error("Failed to create socket");
 		}
 		socket->setConnTimeout(timeout);
-		socket->setRecvTimeout(timeout);
-		socket->setSendTimeout(timeout);
-
-		framedTransport = shared_ptr<TFramedTransport> (new TFramedTransport(socket));
-		if (!framedTransport) {
-			throw std::runtime_error("Failed to create framed transport");
-		}
-		protocol = shared_ptr<TBinaryProtocol> (new TBinaryProtocol(framedTransport));
-		if (!protocol) {
-			throw std::runtime_error("Failed to create protocol");
-		}
-		protocol->setStrict(false, false);
-		resendClient = shared_ptr<forwarderClient> (new forwarderClient(protocol));
-		if (!resendClient) {
-			throw std::runtime_error("Failed to create network client");
-		}
-
+		buildTransports();
 		framedTransport->open();
 
 	} catch (TTransportException& ttx) {
@@ -187,10 +429,72 @@ bool forwarderConn::open() {
 		return false;
 	}
 	LOG_OPER("Opened connection to remote forwarder server %s", connectionString().c_str());
+	opened();
+	return true;
+}
+
+// socketϽframedTransport, ʧʱ쳣
+void forwarderConn::buildTransports() {
+	socket->setRecvTimeout(timeout);
+	socket->setSendTimeout(timeout);
+
+	framedTransport = shared_ptr<TFramedTransport> (new TFramedTransport(socket));
+	if (!framedTransport) {
+		throw std::runtime_error("Failed to create framed transport");
+	}
+	protocol = shared_ptr<TBinaryProtocol> (new TBinaryProtocol(framedTransport));
+	if (!protocol) {
+		throw std::runtime_error("Failed to create protocol");
+	}
+	protocol->setStrict(false, false);
+	resendClient = shared_ptr<forwarderClient> (new forwarderClient(protocol));
+	if (!resendClient) {
+		throw std::runtime_error("Failed to create network client");
+	}
+	readTransport = shared_ptr<TFramedTransport> (new TFramedTransport(socket));
+	readProtocol = shared_ptr<TBinaryProtocol> (new TBinaryProtocol(readTransport));
+	readProtocol->setStrict(false, false);
+}
+
+void forwarderConn::opened() {
+	// һԶ˸
+	credit = 0;
+	if (smcBased && leastLatency) {
+		g_Handler->incrementCounter("routing picked " + LatencyRouter::makeKey(socket->getHost(), socket->getPort()));
+	}
+}
+
+// g_connectorõfd
+bool forwarderConn::adoptConnection(int fd, const string& host, int port) {
+	try {
+		socket = shared_ptr<TSocket> (new TSocket(fd));
+		socket->setHost(host);
+		socket->setPort(port);
+		buildTransports();
+	} catch (std::exception& stx) {
+		LOG_OPER("failed to set up connection to remote forwarder server %s std error <%s>", connectionString().c_str(), stx.what());
+		if (socket && socket->isOpen()) {
+			socket->close();
+		} else {
+			::close(fd);
+		}
+		return false;
+	}
+	LOG_OPER("reopened connection to remote forwarder server %s (%s:%d)", connectionString().c_str(), host.c_str(), port);
+	opened();
 	return true;
 }
 
 void forwarderConn::close() {
+	if (connecting) {
+		connecting->cancel();
+		connecting.reset();
+		reconnecting = false;
+	}
+	if (!framedTransport) {
+		// ûд򿪹
+		return;
+	}
 	try {
 		framedTransport->close();
 	} catch (TTransportException& ttx) {
@@ -198,50 +502,573 @@ void forwarderConn::close() {
 	}
 }
 
-bool forwarderConn::send(boost::shared_ptr<logentry_vector_t> messages) {
+send_result_t forwarderConn::send(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const string& sender_id) {
 	int size = messages->size();
 
 	if (size <= 0) {
-		return true;
+		return SEND_OK;
 	}
 
-	// messagesеָݿvector, Ϊthrift֧vectorдָʽ.
-	// һһӰĵط.
-	std::vector<LogEntry> msgs;
-	for (logentry_vector_t::iterator iter = messages->begin(); iter != messages->end(); ++iter) {
-		msgs.push_back(**iter);
+	maybeReroute();
+	if (connBroken && !awaitReconnect()) {
+		return SEND_FAILED;
+	}
+	if (creditFlow) {
+		unsigned long bytes = 0;
+		for (logentry_vector_t::const_iterator iter = messages->begin(); iter != messages->end(); ++iter) {
+			bytes += (*iter)->message.length();
+		}
+		if (!acquireCredit(bytes)) {
+			return SEND_TRY_LATER;
+		}
+	}
+	if (window > 1) {
+		return sendPipelined(messages, batch_id, sender_id);
 	}
 
 	// ʧ,ǻ´Ӳ.
 	// ǵĻӵһserver, serverʧЧ, Ǳ.
 	ResultCode result = TRY_LATER;
 	for (int i = 0; i < 2; ++i) {
+		string host = socket->getHost();
+		int port = socket->getPort();
+		double start = beginSend(host, port);
 		try {
-			result = resendClient->Log(msgs);
+			// ɵclientҪvector<LogEntry>, ҪÿϢһ. ֱӴָ, ػclient
+			writeRequest(*messages, 0, batch_id, sender_id);
+			result = resendClient->recv_Log();
+			endSend(host, port, start, result == OK);
 
 			if (result == OK) {
 				g_Handler->incrementCounter("sent", size);
 				LOG_OPER("Successfully sent <%d> messages to remote forwarder server %s", size, connectionString().c_str());
-				return true;
+				return SEND_OK;
 			} else {
 				LOG_OPER("Failed to send <%d> messages, remote forwarder server %s returned error code <%d>", size, connectionString().c_str(), (int) result);
-				return false; // . ĳ̨,ôͨҲ.
+				credit = 0;
+				// . ĳ̨,ôͨҲ. ɵ߾ȶٷ
+				return result == TRY_LATER ? SEND_TRY_LATER : SEND_FAILED;
 			}
 		} catch (TTransportException& ttx) {
 			LOG_OPER("Failed to send <%d> messages to remote forwarder server %s error <%s>", size, connectionString().c_str(), ttx.what());
 		} catch (...) {
 			LOG_OPER("Unknown exception sending <%d> messages to remote forwarder server %s", size, connectionString().c_str());
 		}
+		endSend(host, port, start, false);
+
+		// ʱ쳣,ͻִе. ں̨, ȵʱռӵ
+		reconnect();
+		if (!awaitReconnect()) {
+			return SEND_FAILED;
+		}
+	}
+	return SEND_FAILED;
+}
 
-		// ʱ쳣,ͻִе
-		close();
-		if (open()) {
-			LOG_OPER("reopened connection to remote forwarder server %s", connectionString().c_str());
+send_result_t forwarderConn::sendFrames(const LogFrameRegion& region, unsigned long& sent) {
+	unsigned long frames = region.frameEnds.size();
+	if (sent >= frames) {
+		return SEND_OK;
+	}
+	maybeReroute();
+	// ֱsocketշ, ܺˮϵ󽻴
+	waitIdle();
+	if (connBroken && !awaitReconnect()) {
+		return SEND_FAILED;
+	}
+
+	int fd = ::open(region.filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOG_OPER("Failed to open buffer file <%s> for sending error <%s>", region.filename.c_str(), strerror(errno));
+		return SEND_FAILED;
+	}
+
+	// ֡ѾLog(), framedTransportֱдsocket, ػclient.
+	// sendһ, ʱ´һ, ûյصǸ֡ʼط
+	send_result_t result = SEND_FAILED;
+	unsigned long first = sent;
+	for (int i = 0; i < 2; ++i) {
+		string host = socket->getHost();
+		int port = socket->getPort();
+		double start_ms = 0; // Ϊ0ʱһ֡ڵȷ
+		try {
+			ResultCode code = OK;
+			while (sent < frames) {
+				unsigned long start = region.frameStart(sent);
+				if (creditFlow && !acquireCredit(region.frameEnds[sent] - start)) {
+					code = TRY_LATER;
+					break;
+				}
+				start_ms = beginSend(host, port);
+				sendFileRegion(fd, start, region.frameEnds[sent] - start);
+				code = resendClient->recv_Log();
+				endSend(host, port, start_ms, code == OK);
+				start_ms = 0;
+				if (code != OK) {
+					credit = 0;
+					LOG_OPER("Failed to send frame at offset <%lu> of <%s>, remote forwarder server %s returned error code <%d>", start, region.filename.c_str(), connectionString().c_str(), (int) code);
+					break;
+				}
+				g_Handler->incrementCounter("sent", region.frameMessages[sent]);
+				g_Handler->incrementCounter("sendfile bytes", region.frameEnds[sent] - start);
+				++sent;
+			}
+			if (sent == frames) {
+				LOG_OPER("Successfully sent <%lu> frames from <%s> to remote forwarder server %s", sent - first, region.filename.c_str(), connectionString().c_str());
+				result = SEND_OK;
+			} else {
+				result = code == TRY_LATER ? SEND_TRY_LATER : SEND_FAILED;
+			}
+			break;
+		} catch (TTransportException& ttx) {
+			LOG_OPER("Failed to send frames from <%s> to remote forwarder server %s error <%s>", region.filename.c_str(), connectionString().c_str(), ttx.what());
+		} catch (...) {
+			LOG_OPER("Unknown exception sending frames from <%s> to remote forwarder server %s", region.filename.c_str(), connectionString().c_str());
+		}
+		if (start_ms) {
+			endSend(host, port, start_ms, false);
+		}
+
+		reconnect();
+		if (!awaitReconnect()) {
+			break;
+		}
+	}
+	::close(fd);
+	return result;
+}
+
+send_result_t forwarderConn::sendPipelined(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const string& sender_id) {
+	int size = messages->size();
+	PendingLog pending;
+	for (int i = 0; i < 2; ++i) {
+		if (i > 0) {
+			LOG_OPER("Resending <%d> unacknowledged messages to remote forwarder server %s", size, connectionString().c_str());
+			g_Handler->incrementCounter("resent", size);
+		}
+		while (true) {
+			while (inflight.size() >= window && !connBroken) {
+				pthread_cond_wait(&inflightCond, &mutex);
+			}
+			if (!connBroken) {
+				break;
+			}
+			// úû, ʱбˮ. ȵʱſmutex, ϺҪ¿window
+			if (!awaitReconnect()) {
+				return SEND_FAILED;
+			}
+		}
+
+		pending = PendingLog();
+		pending.seqid = ++nextSeqid;
+		string host = socket->getHost();
+		int port = socket->getPort();
+		double start = beginSend(host, port);
+		try {
+			writeRequest(*messages, pending.seqid, batch_id, sender_id);
+		} catch (TTransportException& ttx) {
+			LOG_OPER("Failed to send <%d> messages to remote forwarder server %s error <%s>", size, connectionString().c_str(), ttx.what());
+			endSend(host, port, start, false);
+			failConnection();
+			continue;
+		}
+		inflight.push_back(&pending);
+		waitResponse(pending);
+		// ˮϵӳٰǰʱ, ͬһwindow¸Ա֮ȻԱȽ
+		endSend(host, port, start, !pending.lost && pending.result == OK);
+		if (pending.lost) {
+			continue;
+		}
+
+		if (pending.result == OK) {
+			g_Handler->incrementCounter("sent", size);
+			LOG_OPER("Successfully sent <%d> messages to remote forwarder server %s", size, connectionString().c_str());
+			return SEND_OK;
+		}
+		LOG_OPER("Failed to send <%d> messages, remote forwarder server %s returned error code <%d>", size, connectionString().c_str(), (int) pending.result);
+		credit = 0;
+		return pending.result == TRY_LATER ? SEND_TRY_LATER : SEND_FAILED;
+	}
+	return SEND_FAILED;
+}
+
+// ɵforwarderClient::send_Logдֽһ, seqid.
+// 뵽ظʹõframeBuffer, framedTransportһдsocket
+void forwarderConn::writeRequest(const logentry_vector_t& messages, int32_t seqid, int64_t batch_id, const string& sender_id) {
+	frameBuffer.clear();
+	appendLogFrame(messages, seqid, frameBuffer, batch_id, batch_id ? (sender_id.empty() ? localSenderId() : sender_id) : string());
+	socket->write((const uint8_t*) frameBuffer.data(), frameBuffer.length());
+	if (frameBuffer.capacity() > MAX_FRAME_BUFFER_CAPACITY) {
+		// żһر, Ҫһֱռڴ
+		string().swap(frameBuffer);
+	}
+}
+
+// û߳ڶʱɵǰ̷߳ſȥһ, ĲһԼ
+void forwarderConn::waitResponse(PendingLog& pending) {
+	while (!pending.done) {
+		if (reading) {
+			pthread_cond_wait(&inflightCond, &mutex);
+			continue;
+		}
+		reading = true;
+		// ʱỻreadProtocol, оɵ
+		shared_ptr<TBinaryProtocol> iprot = readProtocol;
+		pthread_mutex_unlock(&mutex);
+
+		int32_t seqid = 0;
+		ResultCode result = TRY_LATER;
+		bool ok = true;
+		try {
+			readResponse(iprot, seqid, result);
+		} catch (TException& tx) {
+			LOG_OPER("Failed to read response from remote forwarder server %s error <%s>", connectionString().c_str(), tx.what());
+			ok = false;
+		}
+
+		pthread_mutex_lock(&mutex);
+		reading = false;
+		if (ok && !inflight.empty() && inflight.front()->seqid == seqid) {
+			PendingLog* answered = inflight.front();
+			inflight.pop_front();
+			answered->result = result;
+			answered->done = true;
 		} else {
+			if (ok) {
+				LOG_OPER("Unexpected response seqid <%d> from remote forwarder server %s", (int) seqid, connectionString().c_str());
+			}
+			resetConnection();
+		}
+		pthread_cond_broadcast(&inflightCond);
+	}
+}
+
+void forwarderConn::waitIdle() {
+	while (reading || !inflight.empty()) {
+		pthread_cond_wait(&inflightCond, &mutex);
+	}
+}
+
+// ߳ڶʱ, صsocketʧ, 
+void forwarderConn::failConnection() {
+	if (!reading) {
+		resetConnection();
+		return;
+	}
+	unsigned long generation = connGeneration;
+	::shutdown(socket->getSocketFD(), SHUT_RDWR);
+	while (generation == connGeneration) {
+		pthread_cond_wait(&inflightCond, &mutex);
+	}
+}
+
+// ʱ߳ڶ. ڵȷص󶼱Ϊlost, ɸԵ߳ط
+void forwarderConn::resetConnection() {
+	if (!inflight.empty()) {
+		LOG_OPER("connection to remote forwarder server %s lost with <%lu> requests in flight", connectionString().c_str(), (unsigned long) inflight.size());
+	}
+	for (std::deque<PendingLog*>::iterator iter = inflight.begin(); iter != inflight.end(); ++iter) {
+		(*iter)->lost = true;
+		(*iter)->done = true;
+	}
+	inflight.clear();
+	++connGeneration;
+
+	reconnect();
+	pthread_cond_broadcast(&inflightCond);
+}
+
+// ɵforwarderClient::recv_Logһ, seqidظ
+void forwarderConn::readResponse(shared_ptr<TBinaryProtocol> iprot, int32_t& seqid, ResultCode& result) {
+	string fname;
+	TMessageType mtype;
+	iprot->readMessageBegin(fname, mtype, seqid);
+	if (mtype == T_EXCEPTION) {
+		TApplicationException x;
+		x.read(iprot.get());
+		iprot->readMessageEnd();
+		iprot->getTransport()->readEnd();
+		throw x;
+	}
+	if (mtype != T_REPLY || 0 != fname.compare("Log")) {
+		iprot->skip(T_STRUCT);
+		iprot->readMessageEnd();
+		iprot->getTransport()->readEnd();
+		throw TApplicationException("unexpected response to Log");
+	}
+	forwarder_Log_presult presult;
+	presult.success = &result;
+	presult.read(iprot.get());
+	iprot->readMessageEnd();
+	iprot->getTransport()->readEnd();
+	if (!presult.__isset.success) {
+		throw TApplicationException("Log failed: unknown result");
+	}
+}
+
+// socket˷ͳʱ, sendfileʱ᷵EAGAIN
+void forwarderConn::sendFileRegion(int fd, unsigned long offset, unsigned long length) {
+	off_t file_offset = offset;
+	while (length) {
+		ssize_t n = sendfile(socket->getSocketFD(), fd, &file_offset, length);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			throw TTransportException(TTransportException::UNKNOWN, n < 0 ? strerror(errno) : "unexpected end of buffer file");
+		}
+		length -= n;
+	}
+}
+
+void forwarderConn::reconnect(const server_vector_t* preferred) {
+	close();
+	server_vector_t targets;
+	if (!smcBased) {
+		targets.push_back(std::make_pair(remoteHost, (int) remotePort));
+	} else if (leastLatency) {
+		g_latencyRouter.rank(serverList, targets);
+	} else {
+		// TSocketPoolһѡ
+		targets = serverList;
+		std::random_shuffle(targets.begin(), targets.end());
+	}
+	if (smcBased && preferred && !preferred->empty()) {
+		server_vector_t first(*preferred);
+		std::random_shuffle(first.begin(), first.end());
+		for (server_vector_t::iterator iter = targets.begin(); iter != targets.end(); ++iter) {
+			if (std::find(first.begin(), first.end(), *iter) == first.end()) {
+				first.push_back(*iter);
+			}
+		}
+		targets.swap(first);
+	}
+	connecting = g_connector.connect(targets, timeout);
+	reconnecting = true;
+	connBroken = true;
+}
+
+// timeout. ʱʱȡ, ̨, ´ηʱȡ
+bool forwarderConn::awaitReconnect() {
+	if (!connecting) {
+		// ϴû
+		reconnect();
+	}
+	shared_ptr<ConnectRequest> request = connecting;
+	pthread_mutex_unlock(&mutex);
+	bool finished = request->wait(timeout);
+	pthread_mutex_lock(&mutex);
+
+	if (connecting != request) {
+		// ߳Ѿȡ˽, ӱص
+		return !connBroken;
+	}
+	if (!finished) {
+		g_Handler->incrementCounter("reconnect waits");
+		return false;
+	}
+	connecting.reset();
+	reconnecting = false;
+
+	string host;
+	int port = 0;
+	int fd = request->takeResult(host, port);
+	if (fd < 0 || !adoptConnection(fd, host, port)) {
+		LOG_OPER("failed to reconnect to remote forwarder server %s", connectionString().c_str());
+		g_Handler->incrementCounter("reconnect failures");
+		return false;
+	}
+	connBroken = false;
+	++connGeneration;
+	return true;
+}
+
+void forwarderConn::maybeReroute() {
+	if (!leastLatency || !socket) {
+		return;
+	}
+	time_t now = time(NULL);
+	if (now < nextRerouteCheck) {
+		return;
+	}
+	nextRerouteCheck = now + REROUTE_CHECK_INTERVAL_SEC;
+	if (!g_latencyRouter.shouldLeave(socket->getHost(), socket->getPort(), serverList)) {
+		return;
+	}
+	waitIdle();
+	LOG_OPER("leaving slow remote forwarder server %s of group <%s>", connectionString().c_str(), smcService.c_str());
+	g_Handler->incrementCounter("routing switches");
+	reconnect();
+}
+
+// ʱҪ, Զ˸0˱Ҫ. ˱ܺҪʱſmutex, ӵıճ
+bool forwarderConn::acquireCredit(unsigned long bytes) {
+	bool refreshed = false;
+	unsigned long waited = 0;
+	unsigned long backoff = CREDIT_RETRY_MIN_MS;
+	while (credit < (int64_t) bytes) {
+		if (!refreshCredit()) {
+			// ӳɽķȥ
+			return true;
+		}
+		if (!creditFlow) {
+			return true;
+		}
+		refreshed = true;
+		if (credit > 0) {
+			// õ¶ȺĵһԳ
+			break;
+		}
+
+		if (waited >= (unsigned long) timeout) {
+			g_Handler->incrementCounter("credit exhausted");
 			return false;
 		}
+		g_Handler->incrementCounter("credit waits");
+		pthread_mutex_unlock(&mutex);
+		usleep(backoff * 1000);
+		pthread_mutex_lock(&mutex);
+		waited += backoff;
+		backoff = backoff * 2 > CREDIT_RETRY_MAX_MS ? CREDIT_RETRY_MAX_MS : backoff * 2;
+	}
+
+	// ʣò˾ǰҪ, ȵ˲ͣ
+	if (!refreshed && !creditRefreshing && credit - (int64_t) bytes < lastGrant / CREDIT_REFRESH_DIVISOR) {
+		refreshCredit();
+	}
+	credit -= bytes;
+	return true;
+}
+
+// ڵǰŵĳԱҪ, ˮϵճͺͷ. ͬʱֻһ߳Ҫ, ̵߳Ľ
+bool forwarderConn::refreshCredit() {
+	if (creditRefreshing) {
+		while (creditRefreshing) {
+			pthread_cond_wait(&inflightCond, &mutex);
+		}
+		return true;
+	}
+	if (!socket) {
+		return false;
+	}
+	creditRefreshing = true;
+	string host = socket->getHost();
+	int port = socket->getPort();
+	pthread_mutex_unlock(&mutex);
+
+	int64_t granted = -1;
+	bool supported = true;
+	try {
+		if (!creditClient || creditSocket->getHost() != host || creditSocket->getPort() != port) {
+			creditClient.reset();
+			creditSocket = shared_ptr<TSocket> (new TSocket(host, port));
+			creditSocket->setConnTimeout(timeout);
+			creditSocket->setRecvTimeout(timeout);
+			creditSocket->setSendTimeout(timeout);
+			creditTransport = shared_ptr<TFramedTransport> (new TFramedTransport(creditSocket));
+			shared_ptr<TBinaryProtocol> credit_protocol(new TBinaryProtocol(creditTransport));
+			credit_protocol->setStrict(false, false);
+			creditTransport->open();
+			creditClient = shared_ptr<forwarderClient> (new forwarderClient(credit_protocol));
+		}
+		if (creditKey.empty()) {
+			ostringstream oss;
+			oss << localSenderId() << "/" << (const void*) this;
+			creditKey = oss.str();
+		}
+		granted = creditClient->getCredit(creditKey);
+	} catch (TApplicationException& tax) {
+		// Զǻ֧getCreditϰ汾
+		LOG_OPER("remote forwarder server %s:%d does not grant credit <%s>, disabling credit flow", host.c_str(), port, tax.what());
+		supported = false;
+	} catch (TException& tx) {
+		LOG_OPER("Failed to get credit from remote forwarder server %s:%d error <%s>", host.c_str(), port, tx.what());
+		creditClient.reset();
+	}
+
+	pthread_mutex_lock(&mutex);
+	creditRefreshing = false;
+	if (!supported) {
+		creditFlow = false;
+	} else if (granted >= 0) {
+		// Զ˰ڵĶг, ֮ǰʣµĲۼ
+		credit = granted;
+		lastGrant = granted;
+	}
+	pthread_cond_broadcast(&inflightCond);
+	return granted >= 0 || !supported;
+}
+
+double forwarderConn::beginSend(const string& host, int port) {
+	double start_ms = (double) currentTimeMs();
+	g_latencyRouter.beginSend(host, port, start_ms);
+	return start_ms;
+}
+
+void forwarderConn::endSend(const string& host, int port, double start_ms, bool ok) {
+	g_latencyRouter.endSend(host, port, start_ms, !ok);
+}
+
+bool forwarderConn::isOpen() {
+	return socket && socket->isOpen();
+}
+
+bool forwarderConn::isReconnecting() {
+	return reconnecting;
+}
+
+void forwarderConn::updateServers(const server_vector_t &servers, const server_vector_t* move_to) {
+	if (!smcBased) {
+		return;
+	}
+	serverList = servers;
+	string host;
+	int port = 0;
+	if (!getPeer(host, port)) {
+		return;
+	}
+	if (std::find(servers.begin(), servers.end(), std::make_pair(host, port)) == servers.end()) {
+		waitIdle();
+		LOG_OPER("remote forwarder server %s:%d left group <%s>, reconnecting", host.c_str(), port, smcService.c_str());
+		reconnect();
+	} else if (move_to && !move_to->empty()) {
+		waitIdle();
+		LOG_OPER("moving connection from remote forwarder server %s:%d to new members of group <%s>", host.c_str(), port, smcService.c_str());
+		g_Handler->incrementCounter("rebalanced connections");
+		reconnect(move_to);
+	}
+}
+
+bool forwarderConn::getPeer(string& host, int& port) {
+	if (!socket) {
+		return false;
+	}
+	host = socket->getHost();
+	port = socket->getPort();
+	return true;
+}
+
+server_vector_t forwarderConn::getServers() {
+	return serverList;
+}
+
+bool forwarderConn::probe() {
+	if (!open()) {
+		return false;
+	}
+
+	bool healthy = false;
+	try {
+		cloudx::base::base_status status = resendClient->getStatus();
+		healthy = (status == cloudx::base::ALIVE || status == cloudx::base::WARNING);
+		if (!healthy) {
+			LOG_OPER("remote forwarder server %s not ready, status <%d>", connectionString().c_str(), (int) status);
+		}
+	} catch (TException& tx) {
+		LOG_OPER("Failed to probe remote forwarder server %s error <%s>", connectionString().c_str(), tx.what());
 	}
-	return false;
+	close();
+	return healthy;
 }
 
 std::string forwarderConn::connectionString() {
@@ -5,6 +5,7 @@
 #define FORWARDER_CONN_POOL_H
 
 #include <string>
+#include <deque>
 
 #include "thrift/protocol/TBinaryProtocol.h"
 #include "thrift/server/TNonblockingServer.h"
@@ -14,38 +15,133 @@
 #include "thrift/transport/TTransportUtils.h"
 
 #include "common.h"
+#include "log_frame.h"
+#include "latency_router.h"
+#include "connector.h"
 #include "gen-cpp/forwarder.h"
 
 
 
+// ͽ. Զ˷TRY_LATER˵, ҪӳԴ
+enum send_result_t {
+	SEND_OK,
+	SEND_TRY_LATER,
+	SEND_FAILED
+};
+
+// һϢLog()batchId. 32λǽʱѡ, 32λ, ʱ32λһ. ǵ
+int64_t newBatchId();
+// Log()senderId: :pid:ʱ, ֮Ͳһ
+const std::string& localSenderId();
+
 /**
  * ӵķװ.Ϊclientʱʹ
+ *
+ * window1ʱsendˮʽ: ߳ӵд, ȷʱſ,
+ * ԹӵĶ߳windowLogͬʱڵȷ. ÿ߳Լͬһʱֻһ,
+ * ֻһstore(һStoreQueue߳)ʱˮ.
+ * һڵȵ̸߳, seqidӦ. ӳʱûյصطһ.
+ *
+ * ÿη͵ӳٺͽǵg_latencyRouter. smcʽleast_latencyʱԱ,
+ * ǰ(ÿһ)ֵǰԱ޳Աȱ, ͵ˮϵ󶼷غһ.
+ *
+ * credit flowʱ, ÿϢֽӶԶ˸Ķ, ʣ²ϴζȵ1/CREDIT_REFRESH_DIVISORʱǰҪ,
+ * ˾͵Ҫ. getCreditߵǰԱһ, õˮ߿, Ҫʱſmutex.
+ * Զ˸0˱Ҫ(˱ʱҲſmutex), timeout, ֮TRY_LATER. յTRY_LATER.
+ *
+ * һopenͬ. ֮, Աg_connectorں̨, ̷߳ſmutextimeout,
+ * ûϾͷSEND_FAILED, ´ηʱȡ. g_connectorͬһtimeoutڴԱ, һԱϲĵtimeout.
+ * ConnGroupѡʱ.
  */
 class forwarderConn {
 	public:
-		forwarderConn(const std::string& host, unsigned long port, int timeout);
-		forwarderConn(const std::string &service, const server_vector_t &servers, int timeout);
+		forwarderConn(const std::string& host, unsigned long port, int timeout, unsigned long window = 1);
+		forwarderConn(const std::string &service, const server_vector_t &servers, int timeout, unsigned long window = 1,
+				bool least_latency = false);
 		virtual ~forwarderConn();
 
 		void addRef();
 		void releaseRef();
 		unsigned getRef();
+		// open֮ǰ
+		void setCreditFlow(bool enabled);
 
 		void lock();
 		void unlock();
 
 		bool open();
 		void close();
-		bool send(boost::shared_ptr<logentry_vector_t> messages);
+		bool isOpen();
+		// ں̨. , ֻѡ
+		bool isReconnecting();
+		// window1ʱ߱lock(). sender_idΪʱlocalSenderId(), תεʱεsenderId
+		send_result_t send(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id = 0, const std::string& sender_id = "");
+		// ӵsent֡ʼ, ļõ֡sendfileֱдsocket, ÿ֡һη. sentضԶ˽˵֡
+		send_result_t sendFrames(const LogFrameRegion& region, unsigned long& sent);
+		// , getStatusر. Զ˷ALIVEWARNINGΪ
+		bool probe();
+		// smc groupĳԱ, ֮ʱserversѡ. ǰŵĳԱ˾͵ˮϵ󶼷غ.
+		// move_toΪʱʹǰԱҲmove_toĳԱ(¼ĳԱֵ). ߱lock()
+		void updateServers(const server_vector_t &servers, const server_vector_t* move_to = NULL);
+		// ߱lock(). ûʱfalse
+		bool getPeer(std::string& host, int& port);
+		server_vector_t getServers(); // ߱lock()
 
 	private:
+		static const unsigned long MAX_FRAME_BUFFER_CAPACITY = 16 * 1024 * 1024;
+		static const time_t REROUTE_CHECK_INTERVAL_SEC = 1;
+		static const unsigned long CREDIT_RETRY_MIN_MS = 10;
+		static const unsigned long CREDIT_RETRY_MAX_MS = 1000;
+		static const int64_t CREDIT_REFRESH_DIVISOR = 4;
+
+		// һѾдȥ, ڵȷصLog
+		class PendingLog {
+			public:
+				PendingLog() :
+					seqid(0), result(forwarder::thrift::TRY_LATER), done(false), lost(false) {
+				}
+
+				int32_t seqid;
+				forwarder::thrift::ResultCode result;
+				bool done;
+				bool lost; // ӳ, ֪Զûյ
+		};
+
 		std::string connectionString();
+		void buildTransports();
+		void opened(); // ֮
+		bool adoptConnection(int fd, const std::string& host, int port);
+		void sendFileRegion(int fd, unsigned long offset, unsigned long length); // ʧʱTTransportException
+		bool refreshCredit(); // ߱mutex, Ҫʱſ. ϻ߳ʱfalse
+
+		// µĵ߶mutex
+		send_result_t sendPipelined(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id);
+		void writeRequest(const logentry_vector_t& messages, int32_t seqid, int64_t batch_id, const std::string& sender_id);
+		void waitResponse(PendingLog& pending);
+		void waitIdle(); // ˮϵյ
+		void failConnection();
+		void resetConnection();
+		// ص, ں̨ʼ, preferredĳԱ. ʱˮϲ
+		void reconnect(const server_vector_t* preferred = NULL);
+		bool awaitReconnect(); // Ⱥ̨Ľ, ȵʱſmutex. ʱtrue
+		void maybeReroute();
+		// Ӷ۵bytes, ʱԶҪ. timeoutûжʱfalse
+		bool acquireCredit(unsigned long bytes);
+		// g_latencyRouterһη͵Ŀʼͽ
+		double beginSend(const std::string& host, int port);
+		void endSend(const std::string& host, int port, double start_ms, bool ok);
+
+		// mutex, ʱ쳣
+		void readResponse(boost::shared_ptr<apache::thrift::protocol::TBinaryProtocol> iprot, int32_t& seqid, forwarder::thrift::ResultCode& result);
 
 	protected:
 		boost::shared_ptr<apache::thrift::transport::TSocket> socket;
 		boost::shared_ptr<apache::thrift::transport::TFramedTransport> framedTransport;
 		boost::shared_ptr<apache::thrift::protocol::TBinaryProtocol> protocol;
 		boost::shared_ptr<forwarder::thrift::forwarderClient> resendClient;
+		// ˮ߶õtransport, д̻߳
+		boost::shared_ptr<apache::thrift::transport::TFramedTransport> readTransport;
+		boost::shared_ptr<apache::thrift::protocol::TBinaryProtocol> readProtocol;
 
 		unsigned refCount;
 
@@ -55,32 +151,94 @@ class forwarderConn {
 		std::string remoteHost;
 		unsigned long remotePort;
 		int timeout; // connection, send, and recv timeout
+		std::string frameBuffer; // writeRequest, mutex
+		unsigned long window; // ͬʱڵȷص, 1ʾͬ
+		bool leastLatency;
+		time_t nextRerouteCheck;
+		bool creditFlow;
+		int64_t credit; // Էֽ, mutex. õ¶ȺĵһԳ, ʱΪ
+		int64_t lastGrant; // ϴҪĶ, mutex
+		bool creditRefreshing; // ߳Ҫ, mutex
+		// Ҫõ, ֻcreditRefreshingǸ߳ڲmutexʱʹ
+		boost::shared_ptr<apache::thrift::transport::TSocket> creditSocket;
+		boost::shared_ptr<apache::thrift::transport::TFramedTransport> creditTransport;
+		boost::shared_ptr<forwarder::thrift::forwarderClient> creditClient;
+		// getCreditʱԶ˵ıʶ, ÿһ: Զ˰ʶƽֶ, ͬһ̵ļͬһʶĻÿõ
+		std::string creditKey;
+		boost::shared_ptr<ConnectRequest> connecting; // ̨, mutex
+		volatile bool reconnecting; // ͬconnectingΪNULL, isReconnecting
 		pthread_mutex_t mutex;
+
+		// ˮߵ״̬, mutex
+		pthread_cond_t inflightCond; // յ˷, ӱ
+		std::deque<PendingLog*> inflight; // ͵˳
+		int32_t nextSeqid;
+		unsigned long connGeneration; // ÿӼ1
+		bool reading; // ߳ڲmutex¶
+		bool connBroken; // ʱû´
+};
+
+// һ鵽ͬһsmc serviceӵĳԱб. ³Աʱ³Աgroupռı
+// һ(ĳԱ)Ųȥ, һĲְŲ, ܶforwarderֻһʱҲǾ
+void updateConnServers(const std::vector<boost::shared_ptr<forwarderConn> >& conns, const server_vector_t& servers);
+
+/**
+ * ͬһĿһ, ConnPoolü.
+ * ÿηѡһ: least_loadedѡǰ(ˮϵȷ)߳ٵ, һʱ; .
+ */
+class ConnGroup {
+	public:
+		ConnGroup(bool least_loaded) :
+			refCount(1), leastLoaded(least_loaded), next(0) {
+		}
+
+		// ѡһӲĸ, ߱ConnPool::mapMutex
+		unsigned long pick();
+
+		std::vector<boost::shared_ptr<forwarderConn> > conns;
+		std::vector<unsigned> load; // ÿڷ͵߳
+		std::vector<std::string> names; // ͳõ: <key>#<>
+		unsigned refCount;
+		bool leastLoaded;
+		unsigned long next;
 };
 
 // keyΪhostname:portʽ
-typedef std::map<std::string, boost::shared_ptr<forwarderConn> > conn_map_t;
+typedef std::map<std::string, boost::shared_ptr<ConnGroup> > conn_map_t;
 
 class ConnPool {
 	public:
 		ConnPool();
 		virtual ~ConnPool();
 
-		bool open(const std::string& host, unsigned long port, int timeout);
-		bool open(const std::string &service, const server_vector_t &servers, int timeout);
+		// ֻڵһδĿʱЧ. windowcredit_flowforwarderConn, pool_sizeǵĿ
+		bool open(const std::string& host, unsigned long port, int timeout, unsigned long window = 1,
+				unsigned long pool_size = 1, bool least_loaded = true, bool credit_flow = false);
+		bool open(const std::string &service, const server_vector_t &servers, int timeout, unsigned long window = 1,
+				unsigned long pool_size = 1, bool least_loaded = true, bool least_latency = false, bool credit_flow = false);
 
 		void close(const std::string& host, unsigned long port);
 		void close(const std::string &service);
-
-		bool send(const std::string& host, unsigned long port,
-				boost::shared_ptr<logentry_vector_t> messages);
-		bool send(const std::string &service,
-				boost::shared_ptr<logentry_vector_t> messages);
+		// serviceӵĳԱб, forwarderConn::updateServers
+		void updateServers(const std::string &service, const server_vector_t &servers);
+
+		send_result_t send(const std::string& host, unsigned long port,
+				boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id = 0, const std::string& sender_id = "");
+		send_result_t send(const std::string &service,
+				boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id = 0, const std::string& sender_id = "");
+		send_result_t sendFrames(const std::string& host, unsigned long port,
+				const LogFrameRegion& region, unsigned long& sent);
+		send_result_t sendFrames(const std::string &service,
+				const LogFrameRegion& region, unsigned long& sent);
 
 	private:
-		bool openCommon(const std::string &key, boost::shared_ptr<forwarderConn> conn);
+		bool openCommon(const std::string &key, const std::vector<boost::shared_ptr<forwarderConn> >& conns, bool least_loaded);
 		void closeCommon(const std::string &key);
-		bool sendCommon(const std::string &key, boost::shared_ptr<logentry_vector_t> messages);
+		// ѡһ, ֮releaseConn½
+		bool acquireConn(const std::string &key, boost::shared_ptr<ConnGroup>& group, unsigned long& index);
+		void releaseConn(boost::shared_ptr<ConnGroup> group, unsigned long index, send_result_t result, unsigned long messages);
+		send_result_t sendCommon(const std::string &key, boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id);
+		send_result_t sendFramesCommon(const std::string &key, const LogFrameRegion& region, unsigned long& sent);
 
 	protected:
 		std::string makeKey(const std::string& name, unsigned long port);
@@ -0,0 +1,368 @@
+#include "connector.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <set>
+#include <stdexcept>
+
+#include "logger.h"
+#include "utils.h"
+
+using namespace std;
+using boost::shared_ptr;
+
+Connector g_connector;
+
+static void* connectorThreadStatic(void *this_ptr) {
+	Connector *connector_ptr = (Connector*) this_ptr;
+	connector_ptr->threadMember();
+	return NULL;
+}
+
+ConnectRequest::ConnectRequest(const server_vector_t& servers_, unsigned long timeout_ms) :
+	servers(servers_), timeoutMs(timeout_ms), next(0), staggerMs(servers_.size() > 1 ? timeout_ms / servers_.size() : timeout_ms), deadline(0), nextStart(0),
+			finished(false), cancelled(false), resultFd(-1), resultPort(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&doneCond, NULL);
+}
+
+ConnectRequest::~ConnectRequest() {
+	if (resultFd >= 0) {
+		::close(resultFd);
+	}
+	pthread_cond_destroy(&doneCond);
+	pthread_mutex_destroy(&mutex);
+}
+
+bool ConnectRequest::wait(unsigned long wait_ms) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	struct timespec until;
+	until.tv_sec = now.tv_sec + wait_ms / 1000;
+	until.tv_nsec = now.tv_usec * 1000 + (wait_ms % 1000) * 1000000;
+	if (until.tv_nsec >= 1000000000) {
+		++until.tv_sec;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&mutex);
+	while (!finished) {
+		if (ETIMEDOUT == pthread_cond_timedwait(&doneCond, &mutex, &until)) {
+			break;
+		}
+	}
+	bool result = finished;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+bool ConnectRequest::done() {
+	pthread_mutex_lock(&mutex);
+	bool result = finished;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+int ConnectRequest::takeResult(string& host, int& port) {
+	pthread_mutex_lock(&mutex);
+	int fd = resultFd;
+	resultFd = -1;
+	host = resultHost;
+	port = resultPort;
+	pthread_mutex_unlock(&mutex);
+	return fd;
+}
+
+void ConnectRequest::cancel() {
+	pthread_mutex_lock(&mutex);
+	cancelled = true;
+	if (resultFd >= 0) {
+		::close(resultFd);
+		resultFd = -1;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool ConnectRequest::isCancelled() {
+	pthread_mutex_lock(&mutex);
+	bool result = cancelled;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+void ConnectRequest::complete(int fd, const string& host, int port) {
+	pthread_mutex_lock(&mutex);
+	if (cancelled && fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+	resultFd = fd;
+	resultHost = host;
+	resultPort = port;
+	finished = true;
+	pthread_cond_broadcast(&doneCond);
+	pthread_mutex_unlock(&mutex);
+}
+
+Connector::Connector() :
+	started(false), epollFd(-1) {
+	wakeupFds[0] = wakeupFds[1] = -1;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+Connector::~Connector() {
+	// TaskQueueһ, ȫֶڽ˳ʱ, ߳ʲô
+	if (!started) {
+		pthread_mutex_destroy(&mutex);
+	}
+}
+
+shared_ptr<ConnectRequest> Connector::connect(const server_vector_t& servers, unsigned long timeout_ms) {
+	shared_ptr<ConnectRequest> request(new ConnectRequest(servers, timeout_ms));
+	pthread_mutex_lock(&mutex);
+	if (!started) {
+		start();
+	}
+	submitted.push_back(request);
+	pthread_mutex_unlock(&mutex);
+
+	char c = 0;
+	if (write(wakeupFds[1], &c, 1) < 0 && errno != EAGAIN) {
+		LOG_OPER("failed to wake up connector thread error <%s>", strerror(errno));
+	}
+	return request;
+}
+
+void Connector::start() {
+	epollFd = epoll_create(MAX_EVENTS);
+	if (epollFd < 0 || pipe(wakeupFds) < 0) {
+		throw std::runtime_error("failed to create epoll or pipe in Connector");
+	}
+	fcntl(wakeupFds[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakeupFds[1], F_SETFL, O_NONBLOCK);
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = wakeupFds[0];
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeupFds[0], &event);
+
+	pthread_t thread;
+	if (0 != pthread_create(&thread, NULL, connectorThreadStatic, (void*) this)) {
+		throw std::runtime_error("pthread_create failed in Connector");
+	}
+	started = true;
+	LOG_OPER("connector thread started");
+}
+
+void Connector::threadMember() {
+	struct epoll_event events[MAX_EVENTS];
+	while (true) {
+		int count = epoll_wait(epollFd, events, MAX_EVENTS, nextTimeoutMs());
+		if (count < 0 && errno != EINTR) {
+			LOG_OPER("epoll_wait failed in connector thread error <%s>", strerror(errno));
+		}
+
+		for (int i = 0; i < count; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == wakeupFds[0]) {
+				char buf[64];
+				while (read(fd, buf, sizeof(buf)) > 0) {
+				}
+				continue;
+			}
+			connect_map_t::iterator iter = connecting.find(fd);
+			if (iter == connecting.end()) {
+				continue;
+			}
+			shared_ptr<ConnectRequest> request = iter->second;
+
+			int error = 0;
+			socklen_t len = sizeof(error);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+				error = errno;
+			}
+			if (!error) {
+				// һصfdſѾ¿ʼ, ¼Ǿfd, µĻ
+				struct sockaddr_storage addr;
+				socklen_t addr_len = sizeof(addr);
+				if (getpeername(fd, (struct sockaddr*) &addr, &addr_len) < 0 && errno == ENOTCONN) {
+					continue;
+				}
+			}
+			if (error) {
+				abandon(fd, request, strerror(error));
+			} else {
+				unsigned long index = request->attempts[fd];
+				stopAttempt(fd, request);
+				connected(fd, request, index);
+			}
+		}
+		checkTimers();
+
+		std::vector<shared_ptr<ConnectRequest> > requests;
+		pthread_mutex_lock(&mutex);
+		requests.swap(submitted);
+		pthread_mutex_unlock(&mutex);
+		for (unsigned long i = 0; i < requests.size(); ++i) {
+			startNext(requests[i]);
+		}
+	}
+}
+
+// ûʱһֱµ
+int Connector::nextTimeoutMs() {
+	if (connecting.empty()) {
+		return -1;
+	}
+	double now = currentTimeMs();
+	double nearest = 0;
+	for (connect_map_t::iterator iter = connecting.begin(); iter != connecting.end(); ++iter) {
+		ConnectRequest* request = iter->second.get();
+		double until = request->deadline;
+		if (request->next < request->servers.size() && request->nextStart < until) {
+			until = request->nextStart;
+		}
+		if (nearest == 0 || until < nearest) {
+			nearest = until;
+		}
+	}
+	return nearest > now ? (int) (nearest - now) + 1 : 0;
+}
+
+void Connector::checkTimers() {
+	double now = currentTimeMs();
+	std::vector<shared_ptr<ConnectRequest> > requests;
+	std::set<ConnectRequest*> seen;
+	for (connect_map_t::iterator iter = connecting.begin(); iter != connecting.end(); ++iter) {
+		if (seen.insert(iter->second.get()).second) {
+			requests.push_back(iter->second);
+		}
+	}
+
+	for (unsigned long i = 0; i < requests.size(); ++i) {
+		shared_ptr<ConnectRequest> request = requests[i];
+		if (request->isCancelled()) {
+			finish(request, -1, 0);
+		} else if (request->deadline <= now) {
+			for (std::map<int, unsigned long>::iterator iter = request->attempts.begin(); iter != request->attempts.end(); ++iter) {
+				const server_vector_t::value_type& server = request->servers[iter->second];
+				LOG_OPER("failed to connect to remote forwarder server <%s:%d> error <connect timed out>", server.first.c_str(), server.second);
+			}
+			finish(request, -1, 0);
+		} else if (request->next < request->servers.size() && request->nextStart <= now) {
+			startNext(request);
+		}
+	}
+}
+
+// ʼһԱ. ͬʧֱܵ, ʼһͷ, ĳԱnextStartĶʧٿʼ
+void Connector::startNext(shared_ptr<ConnectRequest> request) {
+	if (request->deadline == 0) {
+		request->deadline = currentTimeMs() + request->timeoutMs;
+	}
+	while (request->next < request->servers.size()) {
+		if (request->isCancelled()) {
+			break;
+		}
+		unsigned long index = request->next++;
+		const string& host = request->servers[index].first;
+		int port = request->servers[index].second;
+
+		char port_str[16];
+		snprintf(port_str, sizeof(port_str), "%d", port);
+		struct addrinfo hints, *res = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		int error = getaddrinfo(host.c_str(), port_str, &hints, &res);
+		if (error) {
+			LOG_OPER("failed to resolve remote forwarder server <%s:%d> error <%s>", host.c_str(), port, gai_strerror(error));
+			continue;
+		}
+
+		int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (fd < 0) {
+			LOG_OPER("failed to create socket for remote forwarder server <%s:%d> error <%s>", host.c_str(), port, strerror(errno));
+			freeaddrinfo(res);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		int ret = ::connect(fd, res->ai_addr, res->ai_addrlen);
+		freeaddrinfo(res);
+		if (ret == 0) {
+			connected(fd, request, index);
+			return;
+		}
+		if (errno != EINPROGRESS) {
+			LOG_OPER("failed to connect to remote forwarder server <%s:%d> error <%s>", host.c_str(), port, strerror(errno));
+			::close(fd);
+			continue;
+		}
+
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLOUT;
+		event.data.fd = fd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			LOG_OPER("epoll_ctl failed for remote forwarder server <%s:%d> error <%s>", host.c_str(), port, strerror(errno));
+			::close(fd);
+			continue;
+		}
+		request->attempts[fd] = index;
+		request->nextStart = currentTimeMs() + request->staggerMs;
+		connecting[fd] = request;
+		return;
+	}
+	// ԱԹ, ľ͵ǵĽ
+	if (request->attempts.empty() || request->isCancelled()) {
+		finish(request, -1, 0);
+	}
+}
+
+// TSocket򿪵һ: ģʽ, TCP_NODELAY
+void Connector::connected(int fd, shared_ptr<ConnectRequest> request, unsigned long index) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	finish(request, fd, index);
+}
+
+void Connector::abandon(int fd, shared_ptr<ConnectRequest> request, const char* reason) {
+	const server_vector_t::value_type& server = request->servers[request->attempts[fd]];
+	LOG_OPER("failed to connect to remote forwarder server <%s:%d> error <%s>", server.first.c_str(), server.second, reason);
+	stopAttempt(fd, request);
+	::close(fd);
+	if (request->attempts.empty()) {
+		startNext(request);
+	}
+}
+
+void Connector::finish(shared_ptr<ConnectRequest> request, int fd, unsigned long index) {
+	while (!request->attempts.empty()) {
+		int other = request->attempts.begin()->first;
+		stopAttempt(other, request);
+		::close(other);
+	}
+	if (fd >= 0) {
+		const server_vector_t::value_type& server = request->servers[index];
+		request->complete(fd, server.first, server.second);
+	} else {
+		request->complete(-1, "", 0);
+	}
+}
+
+void Connector::stopAttempt(int fd, shared_ptr<ConnectRequest> request) {
+	connecting.erase(fd);
+	request->attempts.erase(fd);
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+}
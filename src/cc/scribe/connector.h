@@ -0,0 +1,102 @@
+#ifndef FORWARDER_CONNECTOR_H
+#define FORWARDER_CONNECTOR_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include "common.h"
+
+/*
+ * һκ̨: ˳serversеĳԱ, timeout_ms, ϵһͽ, Ĺص.
+ * ÿtimeout_ms/Ա(ǰĶʧ)ٿʼһ, ԵһԱڶҲtimeout_msϺ.
+ * Connector߳, wait/takeResultȡ.
+ */
+class ConnectRequest {
+public:
+	ConnectRequest(const server_vector_t& servers, unsigned long timeout_ms);
+	virtual ~ConnectRequest();
+
+	// ȵ˽߹wait_ms, нʱtrue
+	bool wait(unsigned long wait_ms);
+	bool done();
+	// ʱfd(֮ɵ߹ر)ϵĳԱ, ûϷ-1. ֻȡһ
+	int takeResult(std::string& host, int& port);
+	// Ҫ, ֮ϵfdConnectorص
+	void cancel();
+
+private:
+	friend class Connector;
+
+	void complete(int fd, const std::string& host, int port);
+	bool isCancelled();
+
+	// ֻConnector߳
+	server_vector_t servers;
+	unsigned long timeoutMs;
+	unsigned long next; // һҪԵĳԱ
+	unsigned long staggerMs; // ÿʼһԱ
+	double deadline; // ĳʱʱ(), 0ʾûʼ
+	double nextStart; // ʱ仹ûϾͿʼһԱ()
+	std::map<int, unsigned long> attempts; // fdserversе±
+
+	pthread_mutex_t mutex; // µĽ
+	pthread_cond_t doneCond;
+	bool finished;
+	bool cancelled;
+	int resultFd;
+	std::string resultHost;
+	int resultPort;
+
+	// ֵ
+	ConnectRequest(ConnectRequest& rhs);
+	ConnectRequest& operator=(ConnectRequest& rhs);
+};
+
+/*
+ * һepoll߳гȥӵĽ, forwarderConnߺ, ̲߳connect.
+ * ߳ڵһconnectʱ. ϵsocketĻģʽ.
+ */
+class Connector {
+public:
+	Connector();
+	virtual ~Connector();
+
+	boost::shared_ptr<ConnectRequest> connect(const server_vector_t& servers, unsigned long timeout_ms);
+
+	// ̵߳ѭ
+	void threadMember();
+
+private:
+	static const int MAX_EVENTS = 64;
+
+	typedef std::map<int, boost::shared_ptr<ConnectRequest> > connect_map_t;
+
+	void start(); // ߱mutex
+	// ֻ߳
+	void startNext(boost::shared_ptr<ConnectRequest> request); // ʼһԱ, Թ˲Ҷʧ˾ͽ
+	void connected(int fd, boost::shared_ptr<ConnectRequest> request, unsigned long index);
+	void abandon(int fd, boost::shared_ptr<ConnectRequest> request, const char* reason); // Աû, ûбһ
+	void finish(boost::shared_ptr<ConnectRequest> request, int fd, unsigned long index); // صfd, 
+	void stopAttempt(int fd, boost::shared_ptr<ConnectRequest> request); // ٵfd
+	int nextTimeoutMs();
+	void checkTimers(); // ʱͽ, nextStartͿʼһԱ
+
+	pthread_mutex_t mutex; // submittedstarted
+	std::vector<boost::shared_ptr<ConnectRequest> > submitted;
+	bool started;
+	int epollFd;
+	int wakeupFds[2]; // µʱwakeupFds[1]дһֽ
+	connect_map_t connecting; // fd, ֻ߳
+
+	// ֵ
+	Connector(Connector& rhs);
+	Connector& operator=(Connector& rhs);
+};
+
+extern Connector g_connector;
+
+#endif // !defined FORWARDER_CONNECTOR_H
@@ -0,0 +1,94 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_X86 1
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+// CRC32Cʽ(תʽ)
+#define CRC32C_POLY 0x82F63B78
+
+typedef unsigned (*crc32c_func_t)(unsigned crc, const char* data, size_t length);
+
+static unsigned crc32cTable[256];
+
+static void initTable() {
+	for (unsigned i = 0; i < 256; ++i) {
+		unsigned crc = i;
+		for (int j = 0; j < 8; ++j) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32cTable[i] = crc;
+	}
+}
+
+static unsigned crc32cSoftware(unsigned crc, const char* data, size_t length) {
+	const unsigned char* p = (const unsigned char*) data;
+	crc = ~crc;
+	while (length--) {
+		crc = crc32cTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static unsigned crc32cSse42(unsigned crc, const char* data, size_t length) {
+	const char* p = data;
+	crc = ~crc;
+#ifdef __x86_64__
+	unsigned long long crc64 = crc;
+	while (length >= 8) {
+		unsigned long long word;
+		memcpy(&word, p, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		p += 8;
+		length -= 8;
+	}
+	crc = (unsigned) crc64;
+#endif
+	while (length >= 4) {
+		unsigned word;
+		memcpy(&word, p, 4);
+		crc = _mm_crc32_u32(crc, word);
+		p += 4;
+		length -= 4;
+	}
+	while (length--) {
+		crc = _mm_crc32_u8(crc, (unsigned char) *p++);
+	}
+	return ~crc;
+}
+
+static bool hasSse42() {
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+	return (ecx & bit_SSE4_2) != 0;
+}
+#endif
+
+static crc32c_func_t chooseImpl() {
+	initTable();
+#ifdef CRC32C_X86
+	if (hasSse42()) {
+		return crc32cSse42;
+	}
+#endif
+	return crc32cSoftware;
+}
+
+// ھ̬ʼʱѡʵ, Ͳü
+static crc32c_func_t crc32cImpl = chooseImpl();
+
+unsigned crc32c(unsigned crc, const char* data, size_t length) {
+	return crc32cImpl(crc, data, length);
+}
+
+bool crc32cHardware() {
+	return crc32cImpl != crc32cSoftware;
+}
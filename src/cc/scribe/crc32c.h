@@ -0,0 +1,18 @@
+#ifndef FORWARDER_CRC32C_H
+#define FORWARDER_CRC32C_H
+
+#include <stddef.h>
+
+/*
+ * CRC32C(Castagnoli), УbufferļеÿϢ.
+ * CPU֧SSE4.2ʱcrc32ָ, , ߽һ.
+ *
+ * crcǰһݵĽ, Էֶμ:
+ *   crc32c(crc32c(0, a, len_a), b, len_b) == crc32c(0, ab, len_a + len_b)
+ */
+unsigned crc32c(unsigned crc, const char* data, size_t length);
+
+// ǷӲָ, ֻ״̬鿴
+bool crc32cHardware();
+
+#endif // !defined FORWARDER_CRC32C_H
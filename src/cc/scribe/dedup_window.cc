@@ -0,0 +1,120 @@
+#include "dedup_window.h"
+
+using namespace std;
+
+DedupWindow::DedupWindow(unsigned long window_, unsigned long max_senders) :
+	window(0), maxSenders(0), useClock(0) {
+	pthread_mutex_init(&mutex, NULL);
+	configure(window_, max_senders);
+}
+
+DedupWindow::~DedupWindow() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void DedupWindow::configure(unsigned long window_, unsigned long max_senders) {
+	pthread_mutex_lock(&mutex);
+	unsigned long new_window = (window_ + 63) / 64 * 64;
+	if (new_window != window) {
+		// λͼĴС, ǰļ¼û
+		senders.clear();
+		window = new_window;
+	}
+	maxSenders = max_senders ? max_senders : 1;
+	evictSenders();
+	pthread_mutex_unlock(&mutex);
+}
+
+bool DedupWindow::enabled() {
+	pthread_mutex_lock(&mutex);
+	bool result = window > 0;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+bool DedupWindow::inWindow(const Sender& s, int64_t batch_id) {
+	return s.highest && batch_id <= s.highest && (uint64_t) (s.highest - batch_id) < window;
+}
+
+bool DedupWindow::testBit(const Sender& s, int64_t batch_id) {
+	uint64_t pos = (uint64_t) batch_id % window;
+	return (s.bits[pos / 64] >> (pos % 64)) & 1;
+}
+
+void DedupWindow::setBit(Sender& s, int64_t batch_id) {
+	uint64_t pos = (uint64_t) batch_id % window;
+	s.bits[pos / 64] |= (uint64_t) 1 << (pos % 64);
+}
+
+// ѴǰƵbatch_id, Ƴȥλ
+void DedupWindow::advance(Sender& s, int64_t batch_id) {
+	if (s.bits.empty()) {
+		s.bits.resize(window / 64, 0);
+	}
+	if (!s.highest || (uint64_t) (batch_id - s.highest) >= window) {
+		s.bits.assign(window / 64, 0);
+	} else {
+		for (int64_t id = s.highest + 1; id <= batch_id; ++id) {
+			uint64_t pos = (uint64_t) id % window;
+			s.bits[pos / 64] &= ~((uint64_t) 1 << (pos % 64));
+		}
+	}
+	s.highest = batch_id;
+}
+
+void DedupWindow::evictSenders() {
+	while (senders.size() > maxSenders) {
+		sender_map_t::iterator oldest = senders.end();
+		for (sender_map_t::iterator iter = senders.begin(); iter != senders.end(); ++iter) {
+			if (iter->second.inProgress.empty() && (oldest == senders.end() || iter->second.lastUse < oldest->second.lastUse)) {
+				oldest = iter;
+			}
+		}
+		if (oldest == senders.end()) {
+			break;
+		}
+		senders.erase(oldest);
+	}
+}
+
+DedupWindow::check_result_t DedupWindow::check(const string& sender, int64_t batch_id) {
+	pthread_mutex_lock(&mutex);
+	if (!window) {
+		pthread_mutex_unlock(&mutex);
+		return BATCH_NEW;
+	}
+	bool is_new_sender = senders.find(sender) == senders.end();
+	Sender& s = senders[sender];
+	s.lastUse = ++useClock;
+	check_result_t result = BATCH_NEW;
+	if (s.inProgress.count(batch_id)) {
+		result = BATCH_IN_PROGRESS;
+	} else if (inWindow(s, batch_id) && testBit(s, batch_id)) {
+		result = BATCH_DUPLICATE;
+	} else {
+		s.inProgress.insert(batch_id);
+	}
+	if (is_new_sender) {
+		evictSenders();
+	}
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+void DedupWindow::finish(const string& sender, int64_t batch_id, bool applied) {
+	pthread_mutex_lock(&mutex);
+	sender_map_t::iterator iter = senders.find(sender);
+	if (iter != senders.end()) {
+		Sender& s = iter->second;
+		s.inProgress.erase(batch_id);
+		if (applied && window) {
+			if (batch_id > s.highest) {
+				advance(s, batch_id);
+			}
+			if (inWindow(s, batch_id)) {
+				setBit(s, batch_id);
+			}
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
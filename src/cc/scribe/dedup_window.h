@@ -0,0 +1,72 @@
+#ifndef FORWARDER_DEDUP_WINDOW_H
+#define FORWARDER_DEDUP_WINDOW_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+#define DEFAULT_DEDUP_WINDOW 65536
+#define DEFAULT_DEDUP_MAX_SENDERS 4096
+
+/*
+ * ¼ÿͷLog() batchId, ϳط.
+ *
+ * ͬһͷbatchIdǵ(newBatchId), ÿͷֻidǰwindowidλͼ.
+ * ϵidϲ, µδ. ͷmax_sendersʱûз.
+ */
+class DedupWindow {
+public:
+	enum check_result_t {
+		BATCH_NEW, // ߴ֮finish
+		BATCH_DUPLICATE, // Ѿ
+		BATCH_IN_PROGRESS // ͬһڴ, ֪. num_thrift_server_threads1ʱLog()ǲ, ԳǷݿԭǷݴ֮ǰ
+	};
+
+	DedupWindow(unsigned long window = DEFAULT_DEDUP_WINDOW, unsigned long max_senders = DEFAULT_DEDUP_MAX_SENDERS);
+	virtual ~DedupWindow();
+
+	// windowΪ0ʱȥ, ѾµĶ
+	void configure(unsigned long window, unsigned long max_senders);
+	bool enabled();
+
+	check_result_t check(const std::string& sender, int64_t batch_id);
+	// appliedΪtrueʱ, ֻȥеı, طʱᱻ
+	void finish(const std::string& sender, int64_t batch_id, bool applied);
+
+private:
+	class Sender {
+	public:
+		Sender() :
+			highest(0), lastUse(0) {
+		}
+
+		int64_t highest; // batchId, 0ʾû
+		std::vector<uint64_t> bits; // batchId % window
+		std::set<int64_t> inProgress;
+		unsigned long lastUse;
+	};
+
+	typedef std::map<std::string, Sender> sender_map_t;
+
+	// µĵ߶mutex
+	bool inWindow(const Sender& s, int64_t batch_id);
+	bool testBit(const Sender& s, int64_t batch_id);
+	void setBit(Sender& s, int64_t batch_id);
+	void advance(Sender& s, int64_t batch_id);
+	void evictSenders();
+
+	pthread_mutex_t mutex;
+	unsigned long window; // 64ı
+	unsigned long maxSenders;
+	unsigned long useClock;
+	sender_map_t senders;
+
+	// ֵ
+	DedupWindow(DedupWindow& rhs);
+	DedupWindow& operator=(DedupWindow& rhs);
+};
+
+#endif // !defined FORWARDER_DEDUP_WINDOW_H
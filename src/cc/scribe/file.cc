@@ -4,9 +4,14 @@
  */
 #include "file.h"
 
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <boost/filesystem/operations.hpp>
 
 #include "common.h"
+#include "crc32c.h"
 
 #include "logger.h"
 
@@ -17,13 +22,20 @@
 // INITIAL_BUFFER_SIZE must always be >= UINT_SIZE
 #define INITIAL_BUFFER_SIZE 4096
 #define UINT_SIZE 4
+// v2 frame: magic(4) (4) ݵcrc(4) ǰ12ֽڵcrc(4)
+#define FRAME_V2_SIZE 16
+// ĳֻݻ, Ҫȥڴ
+#define MAX_RECORD_SIZE (256 * 1024 * 1024)
 
 using namespace std;
 using boost::shared_ptr;
 
-boost::shared_ptr<FileInterface> FileInterface::createFileInterface(const std::string& type, const std::string& name, bool framed) {
+// v1ʽһ2Gĳ, v1ļﲻ
+static const char FRAME_V2_MAGIC[UINT_SIZE] = { (char) 0xF2, (char) 0xC5, (char) 0x3A, (char) 0xB7 };
+
+boost::shared_ptr<FileInterface> FileInterface::createFileInterface(const std::string& type, const std::string& name, bool framed, bool checksum) {
 	if (0 == type.compare("std")) {
-		return shared_ptr<FileInterface> (new StdFile(name, framed));
+		return shared_ptr<FileInterface> (new StdFile(name, framed, checksum));
 	} else {
 		return shared_ptr<FileInterface> ();
 	}
@@ -45,8 +57,8 @@ FileInterface::FileInterface(const std::string& name, bool frame) :
 FileInterface::~FileInterface() {
 }
 
-StdFile::StdFile(const std::string& name, bool frame) :
-	FileInterface(name, frame), inputBuffer(NULL), bufferSize(0) {
+StdFile::StdFile(const std::string& name, bool frame, bool frame_checksum) :
+	FileInterface(name, frame), inputBuffer(NULL), bufferSize(0), preallocated(false), checksum(frame_checksum), readChecksum(false) {
 }
 
 StdFile::~StdFile() {
@@ -56,8 +68,20 @@ StdFile::~StdFile() {
 	}
 }
 
+// v2ʱļv2; ļͷ, һframev2ľͰv2. Ϊĳframe˾͸İv1
 bool StdFile::openRead() {
-	return open(fstream::in);
+	readChecksum = checksum;
+	if (!open(fstream::in)) {
+		return false;
+	}
+	if (framed && !readChecksum) {
+		char header[UINT_SIZE];
+		file.read(header, UINT_SIZE);
+		readChecksum = file.gcount() == UINT_SIZE && 0 == memcmp(header, FRAME_V2_MAGIC, UINT_SIZE);
+		file.clear();
+		file.seekg(0);
+	}
+	return true;
 }
 
 bool StdFile::openWrite() {
@@ -97,7 +121,47 @@ bool StdFile::isOpen() {
 void StdFile::close() {
 	if (file.is_open()) {
 		file.close();
+
+		// Ԥ䵫ûõĿռ仹ȥ
+		if (preallocated) {
+			preallocated = false;
+			if (0 != truncate(filename.c_str(), fileSize())) {
+				LOG_OPER("Failed to release preallocated space of file <%s>", filename.c_str());
+			}
+		}
+	}
+}
+
+bool StdFile::preallocate(unsigned long size) {
+	int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		LOG_OPER("Failed to open file <%s> for preallocation", filename.c_str());
+		return false;
 	}
+	// FALLOC_FL_KEEP_SIZE: ֻ̿, ļС, ׷дλҲͲӰ
+	bool success = (0 == fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size));
+	if (!success) {
+		LOG_OPER("Failed to preallocate <%lu> bytes for file <%s>", size, filename.c_str());
+	}
+	::close(fd);
+	preallocated = preallocated || success;
+	return success;
+}
+
+bool StdFile::seek(unsigned long offset) {
+	if (!file.is_open()) {
+		return false;
+	}
+	file.clear();
+	file.seekg(offset);
+	return file.good();
+}
+
+long StdFile::tell() {
+	if (!file.is_open()) {
+		return -1;
+	}
+	return file.tellg();
 }
 
 string StdFile::getFrame(unsigned data_length) {
@@ -111,6 +175,18 @@ string StdFile::getFrame(unsigned data_length) {
 	}
 }
 
+string StdFile::getFrame(const std::string& data, const std::string& suffix) {
+	if (!framed || !checksum) {
+		return getFrame(data.length() + suffix.length());
+	}
+	char buf[FRAME_V2_SIZE];
+	memcpy(buf, FRAME_V2_MAGIC, UINT_SIZE);
+	serializeUInt(data.length() + suffix.length(), buf + 4);
+	serializeUInt(crc32c(crc32c(0, data.data(), data.length()), suffix.data(), suffix.length()), buf + 8);
+	serializeUInt(crc32c(0, buf, 12), buf + 12);
+	return string(buf, FRAME_V2_SIZE);
+}
+
 bool StdFile::write(const std::string& data) {
 	if (!file.is_open()) {
 		return false;
@@ -135,33 +211,68 @@ bool StdFile::readNext(std::string& _return) {
 	}
 
 	if (framed) {
-		unsigned size;
-		file.read(inputBuffer, UINT_SIZE); // assumes INITIAL_BUFFER_SIZE > UINT_SIZE
-		if (file.good() && (size = unserializeUInt(inputBuffer))) {
-			// sizeǷmax uint sizeһ, ôϢܱ̬, ҪдϢ
-			if (size >= (((unsigned) 1) << (UINT_SIZE*8 - 1))) {
-				LOG_OPER("WARNING: attempting to read message of size %d bytes", size);
-
-				// ôϢ,Ͳ˫ԭչ,ڴܻ
-				bufferSize = size;
+		while (true) {
+			std::streamoff start = file.tellg();
+			file.read(inputBuffer, UINT_SIZE); // assumes INITIAL_BUFFER_SIZE > UINT_SIZE
+			if (!file.good()) {
+				return false;
 			}
 
-			// СϢ˫ԭ
-			while (size > bufferSize) {
-				bufferSize = 2 * bufferSize;
-				delete[] inputBuffer;
-				inputBuffer = new char[bufferSize];
-			}
-			// TODO Ժ󿴿ɷ޸ĳaioķʽ.
-			file.read(inputBuffer, size);
-			if (file.good()) {
-				_return.assign(inputBuffer, size);
+			if (0 == memcmp(inputBuffer, FRAME_V2_MAGIC, UINT_SIZE)) {
+				file.read(inputBuffer + UINT_SIZE, FRAME_V2_SIZE - UINT_SIZE);
+				if (!file.good()) {
+					// ļĩβдһframe
+					return false;
+				}
+				if (crc32c(0, inputBuffer, 12) != unserializeUInt(inputBuffer + 12)) {
+					LOG_OPER("WARNING: corrupted frame header in file %s at offset %ld", filename.c_str(), (long) start);
+					if (!resync(start + 1)) {
+						return false;
+					}
+					continue;
+				}
+				unsigned size = unserializeUInt(inputBuffer + 4);
+				unsigned crc = unserializeUInt(inputBuffer + 8);
+				if (size > MAX_RECORD_SIZE) {
+					LOG_OPER("WARNING: record size %u in file %s at offset %ld is too large", size, filename.c_str(), (long) start);
+					if (!resync(start + 1)) {
+						return false;
+					}
+					continue;
+				}
+				if (!readRecord(size, _return)) {
+					return false;
+				}
+				if (crc32c(0, _return.data(), _return.length()) != crc) {
+					LOG_OPER("WARNING: checksum mismatch for record of %u bytes in file %s at offset %ld", size, filename.c_str(), (long) start);
+					if (!resync(start + 1)) {
+						return false;
+					}
+					continue;
+				}
+				readChecksum = true;
 				return true;
-			} else {
-				int offset = file.tellg();
-				LOG_OPER("ERROR: Failed to read file %s at offset %d", filename.c_str(), offset);
+			}
+
+			if (readChecksum) {
+				// v2ļﲻmagic˵ݻ
+				LOG_OPER("WARNING: missing frame magic in file %s at offset %ld", filename.c_str(), (long) start);
+				if (!resync(start + 1)) {
+					return false;
+				}
+				continue;
+			}
+
+			unsigned size = unserializeUInt(inputBuffer);
+			if (!size) {
 				return false;
 			}
+			// v1ûа취ҵһframe, ȲֻܷļĲ
+			if (size > MAX_RECORD_SIZE) {
+				LOG_OPER("ERROR: record size %u in file %s at offset %ld is too large, file is corrupted", size, filename.c_str(), (long) start);
+				return false;
+			}
+			return readRecord(size, _return);
 		}
 	} else {
 		file.getline(inputBuffer, bufferSize);
@@ -173,6 +284,61 @@ bool StdFile::readNext(std::string& _return) {
 	return false;
 }
 
+// һsizeֽڵϢ, inputBuffer
+bool StdFile::readRecord(unsigned size, std::string& _return) {
+	if (size > bufferSize) {
+		// СϢ˫ԭ, رϢͰʵʴС, ڴܻ
+		unsigned new_size = bufferSize;
+		while (new_size < size && new_size < (((unsigned) 1) << (UINT_SIZE*8 - 1))) {
+			new_size = 2 * new_size;
+		}
+		if (new_size < size) {
+			new_size = size;
+		}
+		delete[] inputBuffer;
+		inputBuffer = new char[new_size];
+		bufferSize = new_size;
+	}
+	// TODO Ժ󿴿ɷ޸ĳaioķʽ.
+	file.read(inputBuffer, size);
+	if (file.good()) {
+		_return.assign(inputBuffer, size);
+		return true;
+	} else {
+		int offset = file.tellg();
+		LOG_OPER("ERROR: Failed to read file %s at offset %d", filename.c_str(), offset);
+		return false;
+	}
+}
+
+// fromʼһv2 framemagic, ҵѶλ赽. Ҳ(ļĩβ)false
+bool StdFile::resync(std::streamoff from) {
+	file.clear();
+	file.seekg(from);
+	std::streamoff pos = from;
+	while (file.good()) {
+		file.read(inputBuffer, bufferSize);
+		std::streamsize got = file.gcount();
+		if (got < UINT_SIZE) {
+			break;
+		}
+		for (std::streamsize i = 0; i + UINT_SIZE <= got; ++i) {
+			if (0 == memcmp(inputBuffer + i, FRAME_V2_MAGIC, UINT_SIZE)) {
+				LOG_OPER("WARNING: skipped %ld corrupted bytes in file %s", (long) (pos + i - from + 1), filename.c_str());
+				file.clear();
+				file.seekg(pos + i);
+				return file.good();
+			}
+		}
+		// magicܿread֮
+		pos += got - (UINT_SIZE - 1);
+		file.clear();
+		file.seekg(pos);
+	}
+	LOG_OPER("WARNING: no more valid frames after offset %ld in file %s", (long) from - 1, filename.c_str());
+	return false;
+}
+
 unsigned long StdFile::fileSize() {
 	unsigned long size = 0;
 	try {
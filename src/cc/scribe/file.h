@@ -15,7 +15,8 @@ public:
 	FileInterface(const std::string& name, bool framed);
 	virtual ~FileInterface();
 
-	static boost::shared_ptr<FileInterface> createFileInterface(const std::string& type, const std::string& name, bool framed = false);
+	// checksumֻframedļЧ, дv2ʽframe(CRC32C)
+	static boost::shared_ptr<FileInterface> createFileInterface(const std::string& type, const std::string& name, bool framed = false, bool checksum = false);
 	static std::vector<std::string> list(const std::string& path, const std::string& fsType);
 
 	virtual bool openRead() = 0;
@@ -24,6 +25,10 @@ public:
 	virtual bool isOpen() = 0;
 	virtual void close() = 0;
 	virtual bool write(const std::string& data) = 0;
+	// дnum_recordsϢ, ҪϢʵ(BlockFile)
+	virtual bool writeRecords(const std::string& data, unsigned long num_records) {
+		return write(data);
+	}
 	virtual void flush() = 0;
 	virtual unsigned long fileSize() = 0;
 	virtual bool readNext(std::string& _return) = 0; // returns a line if unframed or a record if framed
@@ -33,6 +38,21 @@ public:
 		return std::string();
 	}
 	;
+	// ¼Ϊdata + suffixʱframe, ҪУݵĸʽ
+	virtual std::string getFrame(const std::string& data, const std::string& suffix) {
+		return getFrame(data.length() + suffix.length());
+	}
+	// Ԥȸļ̿ռ(ıļС), ֧ʱfalse
+	virtual bool preallocate(unsigned long size) {
+		return false;
+	}
+	// ļʱλ, ֧ʱseekfalse, tell-1
+	virtual bool seek(unsigned long offset) {
+		return false;
+	}
+	virtual long tell() {
+		return -1;
+	}
 
 protected:
 	bool framed;
@@ -44,7 +64,7 @@ protected:
 
 class StdFile: public FileInterface {
 public:
-	StdFile(const std::string& name, bool framed);
+	StdFile(const std::string& name, bool framed, bool checksum = false);
 	virtual ~StdFile();
 
 	bool openRead();
@@ -59,12 +79,21 @@ public:
 	void deleteFile();
 	void listImpl(const std::string& path, std::vector<std::string>& _return);
 	std::string getFrame(unsigned data_size);
+	std::string getFrame(const std::string& data, const std::string& suffix);
+	bool preallocate(unsigned long size);
+	bool seek(unsigned long offset);
+	long tell();
 
 private:
 	bool open(std::ios_base::openmode mode);
+	bool readRecord(unsigned size, std::string& _return);
+	bool resync(std::streamoff from);
 
 	char* inputBuffer;
 	unsigned bufferSize;
+	bool preallocated; // closeʱҪѶĿռ仹ȥ
+	bool checksum; // дv2ʽframe, ʱļv2
+	bool readChecksum; // ļv2(v2ļv2frameͷ), magicݾ͵
 	std::fstream file;
 
 	// ֵͿչ
@@ -246,7 +246,7 @@ int main(int argc, char **argv) {
 				if(total_messages % BATCH_LINES == 0) {
 					int retry = 3;
 					for(;;) {
-						rc = client.Log(messages);
+						rc = client.Log(messages, 0, "");
 						if(OK == rc) {
 							vector<LogEntry>().swap(messages);
 							break;
@@ -264,7 +264,7 @@ int main(int argc, char **argv) {
 			if(messages.size() > 0) {
 				int retry = 3;
 				for(;;) {
-					rc = client.Log(messages);
+					rc = client.Log(messages, 0, "");
 					if(OK == rc) {
 						vector<LogEntry>().swap(messages);
 						break;
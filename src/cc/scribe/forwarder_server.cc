@@ -4,10 +4,16 @@
 #include <sys/resource.h>
 
 #include <boost/filesystem/operations.hpp>
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/concurrency/PosixThreadFactory.h>
 
 #include "inet_addr.h"
 #include "store.h"
 #include "store_queue.h"
+#include "task_queue.h"
+#include "compactor.h"
+#include "replay_scheduler.h"
+#include "latency_router.h"
 #include "group_service.h"
 #include "logger.h"
 
@@ -30,6 +36,9 @@ shared_ptr<forwarderHandler> g_Handler;
 #define DEFAULT_CHECK_PERIOD       5
 #define DEFAULT_MAX_MSG_PER_SECOND 100000
 #define DEFAULT_MAX_QUEUE_SIZE     5000000
+#define CREDIT_SENDER_TIMEOUT_SEC  30 // ôûҪȵķͷٲƽ
+#define DEFAULT_SERVER_THREADS     1
+#define DEFAULT_WAL_SERVER_THREADS 3 // WALûnum_thrift_server_threadsʱ߳
 
 
 
@@ -78,7 +87,14 @@ int main(int argc, char **argv) {
 		shared_ptr<TProcessor> processor(new forwarderProcessor(g_Handler));
 
 		shared_ptr<TProtocolFactory> binaryProtocolFactory(new TBinaryProtocolFactory(0, 0, false, false));
-		TNonblockingServer server(processor, binaryProtocolFactory, g_Handler->port);
+		// ڹ߳ﴦ, һLog()WAL̵ʱ, Log()һfdatasync
+		shared_ptr<ThreadManager> thread_manager;
+		if (g_Handler->numThriftServerThreads > 1) {
+			thread_manager = ThreadManager::newSimpleThreadManager(g_Handler->numThriftServerThreads);
+			thread_manager->threadFactory(shared_ptr<PosixThreadFactory> (new PosixThreadFactory()));
+			thread_manager->start();
+		}
+		TNonblockingServer server(processor, binaryProtocolFactory, g_Handler->port, thread_manager);
 
 		LOG_OPER("Starting forwarder server on port %lu", g_Handler->port);
 		fflush(stderr);
@@ -94,7 +110,7 @@ int main(int argc, char **argv) {
 }
 
 forwarderHandler::forwarderHandler(unsigned long int server_port, const std::string& config_file) :
-	CloudxBase("Forwarder"), port(server_port), checkPeriod(DEFAULT_CHECK_PERIOD),
+	CloudxBase("Forwarder"), port(server_port), numThriftServerThreads(DEFAULT_SERVER_THREADS), checkPeriod(DEFAULT_CHECK_PERIOD),
 	pcategories(NULL), pcategory_prefixes(NULL), configFilename(config_file), status(STARTING), statusDetails("initial state"), numMsgLastSecond(0), maxMsgPerSecond(DEFAULT_MAX_MSG_PER_SECOND),
 	maxQueueSize(DEFAULT_MAX_QUEUE_SIZE),
 	newThreadPerCategory(true) {
@@ -114,6 +130,7 @@ base_status forwarderHandler::getStatus() {
 	Guard monitor(statusLock);
 	base_status return_status(status);
 	if (status == ALIVE) {
+		Guard handler_guard(handlerLock);
 		for (category_map_t::iterator cat_iter = pcategories->begin(); cat_iter != pcategories->end(); ++cat_iter) {
 			for (store_list_t::iterator store_iter = cat_iter->second->begin(); store_iter != cat_iter->second->end(); ++store_iter) {
 				if (!(*store_iter)->getStatus().empty()) {
@@ -137,6 +154,7 @@ void forwarderHandler::getStatusDetails(std::string& _return) {
 	Guard monitor(statusLock);
 	_return = statusDetails;
 	if (_return.empty()) {
+		Guard handler_guard(handlerLock);
 		if (pcategories) {
 			for (category_map_t::iterator cat_iter = pcategories->begin(); cat_iter != pcategories->end(); ++cat_iter) {
 				for (store_list_t::iterator store_iter = cat_iter->second->begin(); store_iter != cat_iter->second->end(); ++store_iter) {
@@ -214,129 +232,223 @@ bool forwarderHandler::createCategoryFromModel(const string &category, const boo
 	return true;
 }
 
-ResultCode forwarderHandler::Log(const vector<LogEntry>& messages) {
-	//LOG_OPER("received Log with <%d> messages", (int)messages.size());
-
-	if (throttleDeny(messages.size())) {	//ֵ
-		incrementCounter("denied for rate");
-		return TRY_LATER;
+// batchIdȲǲѾ, ظֱӷOK, Ҳ
+ResultCode forwarderHandler::Log(const vector<LogEntry>& messages, const int64_t batchId, const string& senderId) {
+	if (!batchId || senderId.empty()) {
+		return handleLog(messages, 0, "");
 	}
 
-	if (!pcategories || !pcategory_prefixes) {
-		incrementCounter("invalid requests");
+	DedupWindow::check_result_t check = dedupWindow.check(senderId, batchId);
+	if (check == DedupWindow::BATCH_DUPLICATE) {
+		incrementCounter("duplicate batches");
+		incrementCounter("duplicate messages", messages.size());
+		return OK;
+	} else if (check == DedupWindow::BATCH_IN_PROGRESS) {
+		// ͬһεһݻû, ÷ͷһ
+		incrementCounter("duplicate batches in progress");
 		return TRY_LATER;
 	}
+	ResultCode result = handleLog(messages, batchId, senderId);
+	dedupWindow.finish(senderId, batchId, result == OK);
+	return result;
+}
 
-	// ÷ֵֹstore queue. ΪŵеϢҪôɹ,Ҫôʧ.
-	unsigned long max_count = 0;
-	for (category_map_t::iterator cat_iter = pcategories->begin(); cat_iter != pcategories->end(); ++cat_iter) {
-		shared_ptr<store_list_t> pstores = cat_iter->second;
-		if (!pstores) {
-			throw std::logic_error("throttle check: iterator in category map holds null pointer");
-		}
-		for (store_list_t::iterator store_iter = pstores->begin(); store_iter != pstores->end(); ++store_iter) {
-			if (*store_iter == NULL) {
-				throw std::logic_error("throttle check: iterator in store map holds null pointer");
-			} else {
-				unsigned long size = (*store_iter)->getSize();
-				if (size > max_count) {
-					max_count = size;
-				}
-			}
+ResultCode forwarderHandler::handleLog(const vector<LogEntry>& messages, int64_t batchId, const string& senderId) {
+	//LOG_OPER("received Log with <%d> messages", (int)messages.size());
+
+	// StoreQueueϢһ, WALĶһдһ
+	std::map<shared_ptr<StoreQueue>, logentry_vector_t> batches;
+
+	// , ҺʹҪ. WALʱ, Log()Թһύ
+	{
+		Guard handler_guard(handlerLock);
+		if (throttleDeny(messages.size())) {	//ֵ
+			incrementCounter("denied for rate");
+			return TRY_LATER;
 		}
-	}
 
-	// һδݵϢܳĳ
-	if (max_count > maxQueueSize) {
-		incrementCounter("denied for queue size");
-		return TRY_LATER;
-	}
+		if (!pcategories || !pcategory_prefixes) {
+			incrementCounter("invalid requests");
+			return TRY_LATER;
+		}
 
-	for (vector<LogEntry>::const_iterator msg_iter = messages.begin(); msg_iter != messages.end(); ++msg_iter) {
-		// Ϊַ
-		if ((*msg_iter).category.empty()) {
-			incrementCounter("received blank category");
-			continue;
+		// ÷ֵֹstore queue. ΪŵеϢҪôɹ,Ҫôʧ.
+		// һδݵϢܳĳ
+		if (maxStoreQueueSize() > maxQueueSize) {
+			incrementCounter("denied for queue size");
+			return TRY_LATER;
 		}
 
-		boost::shared_ptr<store_list_t> store_list;
+		for (vector<LogEntry>::const_iterator msg_iter = messages.begin(); msg_iter != messages.end(); ++msg_iter) {
+			// Ϊַ
+			if ((*msg_iter).category.empty()) {
+				incrementCounter("received blank category");
+				continue;
+			}
+
+			boost::shared_ptr<store_list_t> store_list;
 
-		string category = (*msg_iter).category;
+			string category = (*msg_iter).category;
 
-		// 1). оȷƥ
-		if (pcategories) {
-			category_map_t::iterator cat_iter = pcategories->find(category);
-			if (cat_iter != pcategories->end()) {
-				store_list = cat_iter->second;
+			// 1). оȷƥ
+			if (pcategories) {
+				category_map_t::iterator cat_iter = pcategories->find(category);
+				if (cat_iter != pcategories->end()) {
+					store_list = cat_iter->second;
+				}
 			}
-		}
 
-		// 2). ǰ׺ƥ
-		if (store_list == NULL) {
-			category_prefix_map_t::iterator cat_prefix_iter = pcategory_prefixes->begin();
-			while (cat_prefix_iter != pcategory_prefixes->end()) {
-				string::size_type len = cat_prefix_iter->first.size();
-				if (cat_prefix_iter->first.compare(0, len - 1, category, 0, len - 1) == 0) {
-					// ҵһƥʹһ
-					if (createCategoryFromModel(category, cat_prefix_iter->second)) {
+			// 2). ǰ׺ƥ
+			if (store_list == NULL) {
+				category_prefix_map_t::iterator cat_prefix_iter = pcategory_prefixes->begin();
+				while (cat_prefix_iter != pcategory_prefixes->end()) {
+					string::size_type len = cat_prefix_iter->first.size();
+					if (cat_prefix_iter->first.compare(0, len - 1, category, 0, len - 1) == 0) {
+						// ҵһƥʹһ
+						if (createCategoryFromModel(category, cat_prefix_iter->second)) {
+							category_map_t::iterator cat_iter = pcategories->find(category);
+
+							if (cat_iter != pcategories->end()) {
+								store_list = cat_iter->second;
+							} else {
+								LOG_OPER("failed to create new prefix store for category <%s>", category.c_str());
+							}
+						}
+
+						break;
+					}
+					++cat_prefix_iter;
+				}
+			}
+
+			// 3). ûҵǾͿûĬϵstore, о͸Ĭstoreһ
+			if (store_list == NULL) {
+				if (defaultStore != NULL) {
+					if (createCategoryFromModel(category, defaultStore)) {
 						category_map_t::iterator cat_iter = pcategories->find(category);
 
 						if (cat_iter != pcategories->end()) {
 							store_list = cat_iter->second;
 						} else {
-							LOG_OPER("failed to create new prefix store for category <%s>", category.c_str());
+							LOG_OPER("failed to create new default store for category <%s>", category.c_str());
 						}
 					}
-
-					break;
 				}
-				++cat_prefix_iter;
 			}
-		}
 
-		// 3). ûҵǾͿûĬϵstore, о͸Ĭstoreһ
-		if (store_list == NULL) {
-			if (defaultStore != NULL) {
-				if (createCategoryFromModel(category, defaultStore)) {
-					category_map_t::iterator cat_iter = pcategories->find(category);
+			// Ҳ, ˵Ϸ
+			if (store_list == NULL) {
+				LOG_OPER("log entry has invalid category <%s>", (*msg_iter).category.c_str());
+				incrementCounter("received bad");
+				continue;
+			}
 
-					if (cat_iter != pcategories->end()) {
-						store_list = cat_iter->second;
-					} else {
-						LOG_OPER("failed to create new default store for category <%s>", category.c_str());
-					}
-				}
+			int numstores = 0;
+
+			// Ϣӵstore_list
+			for (store_list_t::iterator store_iter = store_list->begin(); store_iter != store_list->end(); ++store_iter) {
+				++numstores;
+				boost::shared_ptr<LogEntry> ptr(new LogEntry);
+				ptr->category = (*msg_iter).category;
+				ptr->message = (*msg_iter).message;
+
+				batches[*store_iter].push_back(ptr);
+			}
+
+			// ϢǷӵstore_list
+			if (numstores) {
+				incrementCounter("received good");
+			} else {
+				incrementCounter("received bad");
 			}
 		}
+	}
 
-		// Ҳ, ˵Ϸ
-		if (store_list == NULL) {
-			LOG_OPER("log entry has invalid category <%s>", (*msg_iter).category.c_str());
-			incrementCounter("received bad");
-			continue;
+	// WALĶ׷ӵWAL, WALύ, ֻǵ
+	std::map<shared_ptr<StoreQueue>, WalRange> wal_ranges;
+	for (std::map<shared_ptr<StoreQueue>, logentry_vector_t>::iterator batch_iter = batches.begin(); batch_iter != batches.end(); ++batch_iter) {
+		if (batch_iter->first->usesWal()) {
+			wal_ranges[batch_iter->first] = batch_iter->first->appendWal(batch_iter->second);
+		}
+	}
+	bool durable = true;
+	for (std::map<shared_ptr<StoreQueue>, WalRange>::iterator wal_iter = wal_ranges.begin(); wal_iter != wal_ranges.end(); ++wal_iter) {
+		if (!wal_iter->first->waitDurable(wal_iter->second)) {
+			durable = false;
 		}
+	}
 
-		int numstores = 0;
+	// һû̾, ͻʱظ
+	if (!durable) {
+		for (std::map<shared_ptr<StoreQueue>, WalRange>::iterator wal_iter = wal_ranges.begin(); wal_iter != wal_ranges.end(); ++wal_iter) {
+			wal_iter->first->abandonWal(wal_iter->second);
+		}
+		incrementCounter("wal errors");
+		return TRY_LATER;
+	}
 
-		// Ϣӵstore_list
-		for (store_list_t::iterator store_iter = store_list->begin(); store_iter != store_list->end(); ++store_iter) {
-			++numstores;
-			boost::shared_ptr<LogEntry> ptr(new LogEntry);
-			ptr->category = (*msg_iter).category;
-			ptr->message = (*msg_iter).message;
+	// ֻһʱԭתεbatchIdsenderId, Գĸλϳ.
+	// ֵ˼еĻÿõݶһ, ͬһʶ
+	// storebatchId͵ĻStoreQueueʶ, ϲ
+	bool forward_id = batchId && batches.size() == 1;
+	for (std::map<shared_ptr<StoreQueue>, logentry_vector_t>::iterator batch_iter = batches.begin(); batch_iter != batches.end(); ++batch_iter) {
+		std::map<shared_ptr<StoreQueue>, WalRange>::iterator wal_iter = wal_ranges.find(batch_iter->first);
+		batch_iter->first->addMessages(batch_iter->second, wal_iter == wal_ranges.end() ? NULL : &wal_iter->second, forward_id ? batchId : 0,
+				forward_id ? senderId : "");
+	}
+	return OK;
+}
 
-			(*store_iter)->addMessage(ptr);
+unsigned long forwarderHandler::maxStoreQueueSize() {
+	unsigned long max_count = 0;
+	for (category_map_t::iterator cat_iter = pcategories->begin(); cat_iter != pcategories->end(); ++cat_iter) {
+		shared_ptr<store_list_t> pstores = cat_iter->second;
+		if (!pstores) {
+			throw std::logic_error("throttle check: iterator in category map holds null pointer");
+		}
+		for (store_list_t::iterator store_iter = pstores->begin(); store_iter != pstores->end(); ++store_iter) {
+			if (*store_iter == NULL) {
+				throw std::logic_error("throttle check: iterator in store map holds null pointer");
+			} else {
+				unsigned long size = (*store_iter)->getSize();
+				if (size > max_count) {
+					max_count = size;
+				}
+			}
 		}
+	}
+	return max_count;
+}
+
+// Ȱֽ: StoreQueuemax_queue_size, ƽָCREDIT_SENDER_TIMEOUT_SECҪȵķͷ.
+// ͷÿӸһsenderIdҪ(forwarderConn::creditKey), ƽֵķ.
+// ûм·ȥûõĶ, ֻǸ, handleLogĶгȼȻЧ
+int64_t forwarderHandler::getCredit(const string& senderId) {
+	Guard handler_guard(handlerLock);
+	if (!pcategories || !pcategory_prefixes) {
+		incrementCounter("credit denied");
+		return 0;
+	}
 
-		// ϢǷӵstore_list
-		if (numstores) {
-			incrementCounter("received good");
+	time_t now = time(NULL);
+	creditSenders[senderId] = now;
+	for (map<string, time_t>::iterator iter = creditSenders.begin(); iter != creditSenders.end();) {
+		if (now - iter->second > CREDIT_SENDER_TIMEOUT_SEC) {
+			creditSenders.erase(iter++);
 		} else {
-			incrementCounter("received bad");
+			++iter;
 		}
 	}
 
-	return OK;
+	unsigned long queued = maxStoreQueueSize();
+	if (queued >= maxQueueSize) {
+		incrementCounter("credit denied");
+		return 0;
+	}
+	// ûٸ1, ͷõµĶȺܿԷһ
+	int64_t credit = (maxQueueSize - queued) / creditSenders.size();
+	incrementCounter("credit granted");
+	return credit ? credit : 1;
 }
 
 // 򷵻true, ÿ̶ֻϢ.
@@ -368,6 +480,7 @@ void forwarderHandler::shutdown() {
 	setStatus(STOPPING);
 
 	// Thrift ǰִ֧handlerֹserver, Ǿֻô.
+	Guard handler_guard(handlerLock);
 	deleteCategoryMap(pcategories);
 	pcategories = NULL;
 	if (pcategory_prefixes) {
@@ -390,6 +503,8 @@ void forwarderHandler::initialize() {
 	bool perfect_config = true;
 	bool enough_config_to_run = true;
 	int numstores = 0;
+	bool server_threads_set = false;
+	bool wal_configured = false;
 	category_map_t *pnew_categories = new category_map_t;
 	category_prefix_map_t *pnew_category_prefixes = new category_prefix_map_t;
 	shared_ptr<StoreQueue> tmpDefault;
@@ -412,6 +527,54 @@ void forwarderHandler::initialize() {
 		config.getUnsigned("max_msg_per_second", maxMsgPerSecond);
 		config.getUnsigned("max_queue_size", maxQueueSize);
 		config.getUnsigned("check_interval", checkPeriod);
+		server_threads_set = config.getUnsigned("num_thrift_server_threads", numThriftServerThreads);
+
+		// ̨ļ(rotate)߳
+		unsigned long file_task_threads = 0;
+		if (config.getUnsigned("file_task_threads", file_task_threads)) {
+			g_fileTaskQueue.setNumThreads(file_task_threads);
+		}
+		unsigned long compress_threads = 0;
+		if (config.getUnsigned("compress_threads", compress_threads)) {
+			g_compressTaskQueue.setNumThreads(compress_threads);
+		}
+		unsigned long send_task_threads = 0;
+		if (config.getUnsigned("send_task_threads", send_task_threads)) {
+			g_sendTaskQueue.setNumThreads(send_task_threads);
+			g_primarySendTaskQueue.setNumThreads(send_task_threads);
+		}
+		// batchIdLog()ͷ¼dedup_windowbatchId, 0ʾȥ
+		unsigned long dedup_window = DEFAULT_DEDUP_WINDOW;
+		unsigned long dedup_max_senders = DEFAULT_DEDUP_MAX_SENDERS;
+		config.getUnsigned("dedup_window", dedup_window);
+		config.getUnsigned("dedup_max_senders", dedup_max_senders);
+		dedupWindow.configure(dedup_window, dedup_max_senders);
+		// ̨ѹrotateļʱio
+		unsigned long compact_bytes_per_sec = 0;
+		if (config.getUnsigned("compact_bytes_per_sec", compact_bytes_per_sec)) {
+			g_compactor.setBytesPerSec(compact_bytes_per_sec);
+		}
+		// replay_mode=scheduledBufferStoreõطܴ߳
+		unsigned long replay_threads = 0;
+		if (config.getUnsigned("replay_scheduler_threads", replay_threads)) {
+			g_replayScheduler.setNumThreads(replay_threads);
+		}
+		unsigned long replay_bytes_per_sec = 0;
+		if (config.getUnsigned("replay_scheduler_bytes_per_sec", replay_bytes_per_sec)) {
+			g_replayScheduler.setBytesPerSec(replay_bytes_per_sec);
+		}
+		// routing=least_latencyNetworkStoreõӳͳƺ޳
+		unsigned long latency_ewma_percent = 0;
+		if (config.getUnsigned("latency_ewma_percent", latency_ewma_percent)) {
+			g_latencyRouter.setEwmaPercent(latency_ewma_percent);
+		}
+		unsigned long outlier_eject_ms = DEFAULT_OUTLIER_EJECT_MS;
+		unsigned long outlier_latency_percent = DEFAULT_OUTLIER_LATENCY_PERCENT;
+		unsigned long outlier_try_later_percent = DEFAULT_OUTLIER_TRY_LATER_PERCENT;
+		config.getUnsigned("outlier_eject_ms", outlier_eject_ms);
+		config.getUnsigned("outlier_latency_percent", outlier_latency_percent);
+		config.getUnsigned("outlier_try_later_percent", outlier_try_later_percent);
+		g_latencyRouter.setOutlierEjection(outlier_eject_ms, outlier_latency_percent, outlier_try_later_percent);
 
 
 		// new_thread_per_categoryΪ, ôǽΪΨһϢ𶼴һthread/StoreQueue.
@@ -544,6 +707,9 @@ void forwarderHandler::initialize() {
 
 			pstore->configureAndOpen(store_conf);
 			++numstores;
+			if (pstore->walConfigured()) {
+				wal_configured = true;
+			}
 
 			if (is_default) {
 				LOG_OPER("Creating default store");
@@ -583,6 +749,11 @@ void forwarderHandler::initialize() {
 		enough_config_to_run = false;
 	}
 
+	// WALʱLog()Ҫ, ̴߳󲢷Log()ܹһfdatasync. WALʱֵ߳, ʽ
+	if (wal_configured && !server_threads_set) {
+		numThriftServerThreads = DEFAULT_WAL_SERVER_THREADS;
+	}
+
 	if (numstores) {
 		LOG_OPER("configured <%d> stores", numstores);
 	} else {
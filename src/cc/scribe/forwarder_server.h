@@ -12,6 +12,7 @@
 
 #include <cloudxbase/CloudxBase.h>
 #include "gen-cpp/forwarder.h"
+#include "dedup_window.h"
 
 
 
@@ -41,7 +42,8 @@ public:
 	void initialize();
 	void reinitialize();
 
-	forwarder::thrift::ResultCode Log(const std::vector<forwarder::thrift::LogEntry>& messages);
+	forwarder::thrift::ResultCode Log(const std::vector<forwarder::thrift::LogEntry>& messages, const int64_t batchId, const std::string& senderId);
+	int64_t getCredit(const std::string& senderId);
 
 	void getVersion(std::string& _return) {
 		_return = "1.0";
@@ -53,6 +55,7 @@ public:
 
 	std::string eth;
 	unsigned long int port; // it's long because that's all I implemented in the conf class
+	unsigned long numThriftServerThreads; // Ĺ߳, 1ʱTNonblockingServer߳ﴦ
 	//TODO must move to a global singleton
 	boost::shared_ptr<GroupService> groupServicePtr;
 private:
@@ -71,11 +74,14 @@ private:
 	cloudx::base::base_status status;
 	std::string statusDetails;
 	apache::thrift::concurrency::Mutex statusLock;
+	apache::thrift::concurrency::Mutex handlerLock; // pcategories, ȵ״̬. ж߳ʱLog()ǲ
 	time_t lastMsgTime;
 	unsigned long numMsgLastSecond;
 	unsigned long maxMsgPerSecond;
 	unsigned long maxQueueSize;
 	bool newThreadPerCategory;
+	DedupWindow dedupWindow; // batchIdLog()ͷȥ
+	std::map<std::string, time_t> creditSenders; // Ҫȵķͷ, һҪʱ
 
 
 	//new feature added by edison
@@ -91,6 +97,9 @@ private:
 
 protected:
 	bool throttleDeny(int num_messages); // 򷵻true
+	// batchIdΪ0ʱתεαʶ
+	forwarder::thrift::ResultCode handleLog(const std::vector<forwarder::thrift::LogEntry>& messages, int64_t batchId, const std::string& senderId);
+	unsigned long maxStoreQueueSize(); // StoreQueueﻺֽ
 	void deleteCategoryMap(category_map_t *pcats);
 	const char* statusAsString(cloudx::base::base_status new_status);
 	bool createCategoryFromModel(const std::string &category, const boost::shared_ptr<StoreQueue> &model);
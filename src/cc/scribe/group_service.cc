@@ -1,32 +1,66 @@
 #include "group_service.h"
 
+#include <errno.h>
 #include <iostream>
 
+#include "logger.h"
+#include "utils.h"
+
 
 GroupService::GroupService(const string &rootPath, const string &quorumServers, const int timeout):
         rootPath_(rootPath),
 	quorumServers_(quorumServers),
        	timeout_(timeout),
-        connected(false) {
+        connected(false),
+	sessionExpired(false),
+	stopping(false) {
 	
 	pthread_mutex_init(&mutex, NULL);
         pthread_cond_init(&hasConnectedCond, NULL);
+	pthread_mutex_init(&listenerMutex, NULL);
+	pthread_rwlock_init(&zhLock, NULL);
+	pthread_mutex_init(&retryMutex, NULL);
+	pthread_cond_init(&retryCond, NULL);
 
+	// д, ϵ¼Ҫzhֵ֮Ŵ
+	pthread_rwlock_wrlock(&zhLock);
 	zh = zookeeper_init(quorumServers_.c_str(), GroupService::watcher, 10000, 0, this, 0);
+	pthread_rwlock_unlock(&zhLock);
 	if(zh==0) {
-		cout<<"GroupService start error"<<endl;
-		return;
+		LOG_OPER("GroupService start error, servers <%s>", quorumServers_.c_str());
 	}
+	pthread_create(&retryThread, NULL, GroupService::retryThreadStatic, this);
+}
+
+GroupService::~GroupService() {
+	pthread_mutex_lock(&retryMutex);
+	stopping = true;
+	pthread_cond_signal(&retryCond);
+	pthread_mutex_unlock(&retryMutex);
+	pthread_join(retryThread, NULL);
+
+	if(zh) {
+		zookeeper_close(zh);
+	}
+
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&hasConnectedCond);
+	pthread_mutex_destroy(&listenerMutex);
+	pthread_rwlock_destroy(&zhLock);
+	pthread_mutex_destroy(&retryMutex);
+	pthread_cond_destroy(&retryCond);
 }
 
 void GroupService::ensureRoot() {
 	struct Stat stat;
+	pthread_rwlock_rdlock(&zhLock);
 	int rc = zoo_exists(zh, rootPath_.c_str(), 1, &stat);
 
 	if (rc == ZNONODE) {
 		rc = zoo_create(zh, rootPath_.c_str(), "", 0, &ZOO_OPEN_ACL_UNSAFE, 0, 0, 0);
 		//FIXME don't hanle rc
 	}
+	pthread_rwlock_unlock(&zhLock);
 }
 
 
@@ -40,20 +74,27 @@ bool GroupService::waitForConnected(int timeout) {
 	time(&now);
 	abs_timeout.tv_sec = now + timeout;
 	pthread_mutex_lock(&mutex);
-	pthread_cond_timedwait(&hasConnectedCond, &mutex, &abs_timeout);
+	while (!this->connected) {
+		if (ETIMEDOUT == pthread_cond_timedwait(&hasConnectedCond, &mutex, &abs_timeout)) {
+			break;
+		}
+	}
+	bool result = this->connected;
 	pthread_mutex_unlock(&mutex);
-	return this->connected;
+	return result;
 }
 
 
 void GroupService::ensureGroup(const string &group) {
 	struct Stat stat;
 	string path = rootPath_ + "/" + group;
+	pthread_rwlock_rdlock(&zhLock);
 	int rc = zoo_exists(zh, path.c_str(), 1, &stat); 
 	if (rc == ZNONODE) {
 		rc = zoo_create(zh, path.c_str(), "", 0, &ZOO_OPEN_ACL_UNSAFE, 0, 0, 0);
 		//FIXME don't hanle rc
 	}
+	pthread_rwlock_unlock(&zhLock);
 }
 
 void GroupService::addMember(const string &group, const string &member,bool autoCreate) {
@@ -61,20 +102,35 @@ void GroupService::addMember(const string &group, const string &member,bool auto
 		ensureGroup(group);
 	}
 
+	pthread_mutex_lock(&retryMutex);
+	pair<string, string> added(group, member);
+	bool known = false;
+	for (vector<pair<string, string> >::iterator iter = members.begin(); iter != members.end(); ++iter) {
+		known = known || *iter == added;
+	}
+	if (!known) {
+		members.push_back(added);
+	}
+	pthread_mutex_unlock(&retryMutex);
+
 	struct Stat stat;
 	string path = rootPath_ + "/" + group + "/" + member;
+	pthread_rwlock_rdlock(&zhLock);
 	int rc = zoo_exists(zh, path.c_str(), 1, &stat); 
 	if (rc == ZNONODE) {
 		rc = zoo_create(zh, path.c_str(), "", 0, &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL, 0, 0);
 		//FIXME don't hanle rc
 		//
 	}
+	pthread_rwlock_unlock(&zhLock);
 }
 
 bool GroupService::getMembers(const string &group, vector<string> &memberList) {
 	string path = rootPath_ + "/" + group;
 	String_vector children;
+	pthread_rwlock_rdlock(&zhLock);
 	int rc = zoo_get_children(zh, path.c_str(), 0, &children);
+	pthread_rwlock_unlock(&zhLock);
 	if(ZOK != rc) {
 		return false;
 	}
@@ -82,23 +138,263 @@ bool GroupService::getMembers(const string &group, vector<string> &memberList) {
 		char *m = children.data[i];
 		memberList.push_back(m);
 	}
+	deallocate_String_vector(&children);
 	return true;
 }
 
-void GroupService::watcher(zhandle_t *, int type, int state, const char *path,void*v) {
-	cout<<"GroupService::watcher"<<endl;
-	GroupService *ctx = (GroupService*)v;
+// zoo_awget_childrenĻص
+struct ChildrenContext {
+	GroupService *service;
+	string group;
+};
 
-	if (state == ZOO_CONNECTED_STATE) {
-		ctx->connected = true; 
+void GroupService::watchMembers(const string &group, GroupListener *listener) {
+	pthread_mutex_lock(&listenerMutex);
+	list<GroupListener*> &group_listeners = listeners[group];
+	bool first = group_listeners.empty();
+	group_listeners.push_back(listener);
+	pthread_mutex_unlock(&listenerMutex);
+
+	if (first) {
+		armWatch(group);
 	} else {
-		ctx->connected = false;
-	}       
-	if (type != ZOO_SESSION_EVENT) {
-	}       
+		// watchѾ, µlistenerһݵǰб
+		vector<string> memberList;
+		if (getMembers(group, memberList)) {
+			pthread_mutex_lock(&listenerMutex);
+			listener->membersChanged(group, memberList);
+			pthread_mutex_unlock(&listenerMutex);
+		}
+	}
+}
+
+void GroupService::unwatchMembers(const string &group, GroupListener *listener) {
+	pthread_mutex_lock(&listenerMutex);
+	listener_map_t::iterator iter = listeners.find(group);
+	if (iter != listeners.end()) {
+		iter->second.remove(listener);
+		// watchzookeeperǱûȡ, ʱûlistenerͲ
+	}
+	pthread_mutex_unlock(&listenerMutex);
+}
 
+void GroupService::armWatch(const string &group) {
+	string path = rootPath_ + "/" + group;
+	ChildrenContext *ctx = new ChildrenContext;
+	ctx->service = this;
+	ctx->group = group;
+	pthread_rwlock_rdlock(&zhLock);
+	int rc = zoo_awget_children(zh, path.c_str(), GroupService::childWatcher, this, GroupService::childrenCompletion, ctx);
+	pthread_rwlock_unlock(&zhLock);
+	if (ZOK != rc) {
+		delete ctx;
+		if (ZCONNECTIONLOSS == rc || ZOPERATIONTIMEOUT == rc) {
+			LOG_OPER("GroupService failed to watch <%s> rc=<%d>, will retry", path.c_str(), rc);
+			scheduleRetry(group);
+		} else {
+			// ỰʱZINVALIDSTATE, handle֮
+			LOG_OPER("GroupService failed to watch <%s> rc=<%d>", path.c_str(), rc);
+		}
+	}
+}
+
+bool GroupService::isWatched(const string &group) {
+	pthread_mutex_lock(&listenerMutex);
+	listener_map_t::iterator iter = listeners.find(group);
+	bool watched = iter != listeners.end() && !iter->second.empty();
+	pthread_mutex_unlock(&listenerMutex);
+	return watched;
+}
+
+void GroupService::scheduleRetry(const string &group) {
+	pthread_mutex_lock(&retryMutex);
+	unsigned long &backoff = retryBackoff[group];
+	backoff = backoff ? (backoff * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : backoff * 2) : RETRY_MIN_MS;
+	retryAt[group] = currentTimeMs() + backoff;
+	pthread_cond_signal(&retryCond);
+	pthread_mutex_unlock(&retryMutex);
+}
+
+void GroupService::retrySucceeded(const string &group) {
+	pthread_mutex_lock(&retryMutex);
+	retryBackoff.erase(group);
+	pthread_mutex_unlock(&retryMutex);
+}
+
+// һµhandle, handleϵwatchʱڵ㶼ŻỰû
+bool GroupService::recreateHandle() {
+	LOG_OPER("GroupService session expired, reconnecting to <%s>", quorumServers_.c_str());
+	pthread_mutex_lock(&mutex);
+	connected = false;
+	pthread_mutex_unlock(&mutex);
+
+	pthread_rwlock_wrlock(&zhLock);
+	zhandle_t *old_zh = zh;
+	zh = zookeeper_init(quorumServers_.c_str(), GroupService::watcher, 10000, 0, this, 0);
+	zhandle_t *new_zh = zh;
+	if (!new_zh) {
+		zh = old_zh;
+	}
+	pthread_rwlock_unlock(&zhLock);
+	if (!new_zh) {
+		LOG_OPER("GroupService failed to recreate zookeeper handle, will retry");
+		return false;
+	}
+	// ܳд: handleĻصܻҪzh
+	if (old_zh) {
+		zookeeper_close(old_zh);
+	}
+
+	if (!waitForConnected(timeout_)) {
+		LOG_OPER("GroupService not connected after <%d> seconds, re-adding members anyway", timeout_);
+	}
+	pthread_mutex_lock(&retryMutex);
+	vector<pair<string, string> > added = members;
+	pthread_mutex_unlock(&retryMutex);
+	for (vector<pair<string, string> >::iterator iter = added.begin(); iter != added.end(); ++iter) {
+		addMember(iter->first, iter->second, true);
+	}
+
+	vector<string> groups;
+	pthread_mutex_lock(&listenerMutex);
+	for (listener_map_t::iterator iter = listeners.begin(); iter != listeners.end(); ++iter) {
+		if (!iter->second.empty()) {
+			groups.push_back(iter->first);
+		}
+	}
+	pthread_mutex_unlock(&listenerMutex);
+	for (vector<string>::iterator iter = groups.begin(); iter != groups.end(); ++iter) {
+		armWatch(*iter);
+	}
+	return true;
+}
+
+void* GroupService::retryThreadStatic(void *arg) {
+	((GroupService*) arg)->retryThreadMember();
+	return NULL;
+}
+
+void GroupService::retryThreadMember() {
+	pthread_mutex_lock(&retryMutex);
+	while (!stopping) {
+		unsigned long long now = currentTimeMs();
+		unsigned long long wake = 0;
+		if (sessionExpired) {
+			sessionExpired = false;
+			pthread_mutex_unlock(&retryMutex);
+			bool recreated = recreateHandle();
+			pthread_mutex_lock(&retryMutex);
+			if (recreated) {
+				continue;
+			}
+			sessionExpired = true;
+			wake = now + RETRY_MAX_MS;
+		} else {
+			vector<string> due;
+			for (map<string, unsigned long long>::iterator iter = retryAt.begin(); iter != retryAt.end();) {
+				if (iter->second <= now) {
+					due.push_back(iter->first);
+					retryAt.erase(iter++);
+				} else {
+					wake = (!wake || iter->second < wake) ? iter->second : wake;
+					++iter;
+				}
+			}
+			if (!due.empty()) {
+				pthread_mutex_unlock(&retryMutex);
+				for (vector<string>::iterator iter = due.begin(); iter != due.end(); ++iter) {
+					if (isWatched(*iter)) {
+						armWatch(*iter);
+					}
+				}
+				pthread_mutex_lock(&retryMutex);
+				continue;
+			}
+		}
+
+		if (stopping) {
+			break;
+		} else if (wake) {
+			struct timespec abs_timeout;
+			abs_timeout.tv_sec = wake / 1000;
+			abs_timeout.tv_nsec = (wake % 1000) * 1000000;
+			pthread_cond_timedwait(&retryCond, &retryMutex, &abs_timeout);
+		} else {
+			pthread_cond_wait(&retryCond, &retryMutex);
+		}
+	}
+	pthread_mutex_unlock(&retryMutex);
+}
+
+void GroupService::childWatcher(zhandle_t *, int type, int state, const char *path, void *v) {
+	GroupService *service = (GroupService*)v;
+	if (type != ZOO_CHILD_EVENT || !path) {
+		return;
+	}
+	string prefix = service->rootPath_ + "/";
+	string group(path);
+	if (group.compare(0, prefix.length(), prefix) != 0) {
+		return;
+	}
+	group = group.substr(prefix.length());
+
+	if (service->isWatched(group)) {
+		// watchֻһ, бͬʱ
+		service->armWatch(group);
+	}
+}
+
+void GroupService::childrenCompletion(int rc, const struct String_vector *strings, const void *data) {
+	ChildrenContext *ctx = (ChildrenContext*)data;
+	if (ZOK == rc && strings) {
+		vector<string> memberList;
+		for(int i=0;i<strings->count;++i) {
+			memberList.push_back(strings->data[i]);
+		}
+		ctx->service->retrySucceeded(ctx->group);
+		ctx->service->notifyListeners(ctx->group, memberList);
+	} else if (ZCONNECTIONLOSS == rc || ZOPERATIONTIMEOUT == rc) {
+		LOG_OPER("GroupService failed to get members of <%s> rc=<%d>, will retry", ctx->group.c_str(), rc);
+		ctx->service->scheduleRetry(ctx->group);
+	} else if (ZCLOSING != rc) {
+		// ZSESSIONEXPIREDĻhandle֮
+		LOG_OPER("GroupService failed to get members of <%s> rc=<%d>", ctx->group.c_str(), rc);
+	}
+	delete ctx;
+}
+
+void GroupService::notifyListeners(const string &group, const vector<string> &memberList) {
+	pthread_mutex_lock(&listenerMutex);
+	listener_map_t::iterator iter = listeners.find(group);
+	if (iter != listeners.end()) {
+		for (list<GroupListener*>::iterator it = iter->second.begin(); it != iter->second.end(); ++it) {
+			(*it)->membersChanged(group, memberList);
+		}
+	}
+	pthread_mutex_unlock(&listenerMutex);
+}
+
+void GroupService::watcher(zhandle_t *handle, int type, int state, const char *path,void*v) {
+	GroupService *ctx = (GroupService*)v;
+
+	pthread_rwlock_rdlock(&ctx->zhLock);
+	bool current = handle == ctx->zh;
+	pthread_rwlock_unlock(&ctx->zhLock);
+	if (!current) {
+		// Ѿľhandle
+		return;
+	}
+
+	if (type == ZOO_SESSION_EVENT && state == ZOO_EXPIRED_SESSION_STATE) {
+		LOG_OPER("GroupService zookeeper session expired");
+		pthread_mutex_lock(&ctx->retryMutex);
+		ctx->sessionExpired = true;
+		pthread_cond_signal(&ctx->retryCond);
+		pthread_mutex_unlock(&ctx->retryMutex);
+	}
 
 	pthread_mutex_lock(&(ctx->mutex));
+	ctx->connected = (state == ZOO_CONNECTED_STATE);
 	pthread_cond_signal(&(ctx->hasConnectedCond));
 	pthread_mutex_unlock(&(ctx->mutex));
 }
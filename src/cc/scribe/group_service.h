@@ -21,7 +21,9 @@
 #include <iostream>
 #include <string>
 #include <list>
+#include <map>
 #include <vector>
+#include <utility>
 
 using namespace std;
 
@@ -48,6 +50,21 @@ private:
 
 
 
+/*
+ * groupԱ仯Ķ(NetworkStore).
+ * صzookeeper¼߳, ܵGroupServiceͬӿ, ҲҪʱ.
+ */
+class GroupListener {
+public:
+	virtual ~GroupListener() {
+	}
+	virtual void membersChanged(const string &group, const vector<string> &memberList) = 0;
+};
+
+/*
+ * watchʧʱ, CONNECTIONLOSSOPERATIONTIMEOUTretry߳ﰴgroup˱.
+ * Ựںretry̻߳һµhandle, ¼addMemberӹĳԱ, watch.
+ */
 class GroupService {
 public:
 	GroupService(const string &rootPath, const string &quorumServers, const int timeout=5);
@@ -56,37 +73,64 @@ public:
 	
 	void ensureRoot();
 
-	virtual ~GroupService() {
-		if(zh) {
-			zookeeper_close(zh);
-		}
-
-		pthread_mutex_destroy(&mutex);
-		pthread_cond_destroy(&hasConnectedCond);
-	}
+	virtual ~GroupService();
 
 	void ensureGroup(const string &znode);
 	
 	void addMember(const string &group, const string &member, bool autoCreate=false);
 
 	bool getMembers(const string &group, vector<string> &memberList);
+
+	// groupchild watch, Աб仯ʱµĳԱбƸlistener(ʱĵһ).
+	// unwatchMembers֮󲻻ٻصlistener
+	void watchMembers(const string &group, GroupListener *listener);
+	void unwatchMembers(const string &group, GroupListener *listener);
 	
 
 private:
 
 	
 	static void watcher(zhandle_t *, int type, int state, const char *path,void*v);
+	static void childWatcher(zhandle_t *, int type, int state, const char *path, void *v);
+	static void childrenCompletion(int rc, const struct String_vector *strings, const void *data);
+
+	void armWatch(const string &group); // 첽Աбwatch
+	void notifyListeners(const string &group, const vector<string> &memberList);
+	bool isWatched(const string &group);
+	void scheduleRetry(const string &group); // һretry߳armWatch, ÿη
+	void retrySucceeded(const string &group);
+	bool recreateHandle();
+
+	static void* retryThreadStatic(void *arg);
+	void retryThreadMember();
+
+	static const unsigned long RETRY_MIN_MS = 100;
+	static const unsigned long RETRY_MAX_MS = 10000;
 
 private:
 	zhandle_t *zh;
+	pthread_rwlock_t zhLock; // zhʱж, handleʱд
 
 	pthread_mutex_t mutex;
 	pthread_cond_t hasConnectedCond;
+
+	typedef map<string, list<GroupListener*> > listener_map_t;
+	pthread_mutex_t listenerMutex; // listeners, صڼһֱ
+	listener_map_t listeners;
 	
 	string rootPath_;
 	string quorumServers_;
 	int timeout_;
 	bool connected;
+
+	pthread_t retryThread;
+	pthread_mutex_t retryMutex; // 漸Ա
+	pthread_cond_t retryCond;
+	map<string, unsigned long long> retryAt; // watchgroup, ڵʱ()
+	map<string, unsigned long> retryBackoff; // group´Եļ(), óɹ
+	vector<pair<string, string> > members; // addMemberӹ(group, member)
+	bool sessionExpired;
+	bool stopping;
 };
 
 
@@ -0,0 +1,133 @@
+#include "hash_ring.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "logger.h"
+
+using namespace std;
+
+RouteBalancer g_routeBalancer;
+
+HashRing::HashRing(unsigned vnodes_) :
+	vnodes(vnodes_ ? vnodes_ : DEFAULT_HASH_RING_VNODES) {
+}
+
+HashRing::~HashRing() {
+}
+
+// FNV-1a, murmur3fmix32ѵλɢ, ڵֺ
+unsigned HashRing::hash(const string& key) {
+	unsigned h = 2166136261U;
+	for (string::size_type i = 0; i < key.length(); ++i) {
+		h ^= (unsigned char) key[i];
+		h *= 16777619U;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+void HashRing::setMembers(const vector<string>& new_members, unsigned new_vnodes) {
+	members = new_members;
+	vnodes = new_vnodes ? new_vnodes : DEFAULT_HASH_RING_VNODES;
+	points.clear();
+	points.reserve(members.size() * vnodes);
+	for (unsigned i = 0; i < members.size(); ++i) {
+		for (unsigned j = 0; j < vnodes; ++j) {
+			ostringstream oss;
+			oss << members[i] << "#" << j;
+			points.push_back(make_pair(hash(oss.str()), i));
+		}
+	}
+	sort(points.begin(), points.end());
+}
+
+int HashRing::lookup(const string& key, const vector<unsigned long>& loads, unsigned long capacity) const {
+	if (points.empty()) {
+		return -1;
+	}
+	point_vector_t::const_iterator iter = lower_bound(points.begin(), points.end(), make_pair(hash(key), 0U));
+	for (point_vector_t::size_type i = 0; i < points.size(); ++i, ++iter) {
+		if (iter == points.end()) {
+			iter = points.begin();
+		}
+		if (!capacity || loads[iter->second] < capacity) {
+			return iter->second;
+		}
+	}
+	// , ߵ, Ϊ޲Сƽֵ
+	iter = lower_bound(points.begin(), points.end(), make_pair(hash(key), 0U));
+	return iter == points.end() ? points.begin()->second : iter->second;
+}
+
+RouteBalancer::RouteBalancer() {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+RouteBalancer::~RouteBalancer() {
+	pthread_mutex_destroy(&mutex);
+}
+
+string RouteBalancer::makeMemberName(const string& host, int port) {
+	ostringstream oss;
+	oss << host << ":" << port;
+	return oss.str();
+}
+
+int RouteBalancer::assign(const string& group_name, const server_vector_t& servers, const string& key, unsigned vnodes, double load_factor) {
+	if (servers.empty()) {
+		return -1;
+	}
+	// Ա󽨻, getMembersص˳޹
+	vector<string> names;
+	for (server_vector_t::const_iterator iter = servers.begin(); iter != servers.end(); ++iter) {
+		names.push_back(makeMemberName(iter->first, iter->second));
+	}
+	vector<string> sorted_names(names);
+	sort(sorted_names.begin(), sorted_names.end());
+	sorted_names.erase(unique(sorted_names.begin(), sorted_names.end()), sorted_names.end());
+
+	pthread_mutex_lock(&mutex);
+	Group& group = groups[group_name];
+	if (group.ring.getMembers() != sorted_names || group.ring.getVnodes() != vnodes) {
+		LOG_OPER("rebuilding hash ring for <%s> with <%lu> members", group_name.c_str(), (unsigned long) sorted_names.size());
+		group.ring.setMembers(sorted_names, vnodes);
+	}
+
+	vector<unsigned long> loads;
+	unsigned long total = 0;
+	for (vector<string>::iterator iter = sorted_names.begin(); iter != sorted_names.end(); ++iter) {
+		unsigned long load = group.loads[*iter];
+		loads.push_back(load);
+		total += load;
+	}
+	unsigned long capacity = 0;
+	if (load_factor > 0) {
+		capacity = (unsigned long) ceil(load_factor * (total + 1) / sorted_names.size());
+	}
+	int index = group.ring.lookup(key, loads, capacity);
+	const string& member = sorted_names[index];
+	++group.loads[member];
+	pthread_mutex_unlock(&mutex);
+
+	return find(names.begin(), names.end(), member) - names.begin();
+}
+
+void RouteBalancer::release(const string& group_name, const string& member) {
+	pthread_mutex_lock(&mutex);
+	map<string, Group>::iterator group = groups.find(group_name);
+	if (group != groups.end()) {
+		map<string, unsigned long>::iterator load = group->second.loads.find(member);
+		if (load != group->second.loads.end() && load->second > 0) {
+			--load->second;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
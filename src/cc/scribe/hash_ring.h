@@ -0,0 +1,77 @@
+#ifndef FORWARDER_HASH_RING_H
+#define FORWARDER_HASH_RING_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "common.h"
+
+#define DEFAULT_HASH_RING_VNODES 160
+
+/*
+ * һԹϣ, ÿԱڻvnodesڵ.
+ * lookupkeyĹϣֵ˳ʱҵһڵ, ԱʱֻkeyỻԱ.
+ * ˸ʱѾ˵ĳԱ(bounded load), ˳ӵϵһ.
+ */
+class HashRing {
+public:
+	HashRing(unsigned vnodes = DEFAULT_HASH_RING_VNODES);
+	virtual ~HashRing();
+
+	void setMembers(const std::vector<std::string>& members, unsigned vnodes);
+	const std::vector<std::string>& getMembers() const {
+		return members;
+	}
+	unsigned getVnodes() const {
+		return vnodes;
+	}
+
+	// سԱ, ûгԱʱ-1. capacityΪ0ʱloads[i] >= capacityĳԱ
+	int lookup(const std::string& key, const std::vector<unsigned long>& loads, unsigned long capacity) const;
+
+	static unsigned hash(const std::string& key);
+
+private:
+	typedef std::vector<std::pair<unsigned, unsigned> > point_vector_t; // (ϣֵ, Ա), ϣֵ
+
+	unsigned vnodes;
+	std::vector<std::string> members;
+	point_vector_t points;
+};
+
+/*
+ * аһԹϣ·ɵNetworkStore, ¼ÿgroupĹϣÿԱֵstore.
+ * ceil(load_factor * (ѷĿ + 1) / Ա), Ա䲢ûйʱͬһkeyǷֵͬһԱ.
+ */
+class RouteBalancer {
+public:
+	RouteBalancer();
+	virtual ~RouteBalancer();
+
+	// serverskeyѡһԱ븺, serversе, serversΪʱ-1.
+	// load_factorΪ0ʱƸ
+	int assign(const std::string& group, const server_vector_t& servers, const std::string& key, unsigned vnodes, double load_factor);
+	void release(const std::string& group, const std::string& member);
+
+	static std::string makeMemberName(const std::string& host, int port);
+
+private:
+	class Group {
+	public:
+		HashRing ring;
+		std::map<std::string, unsigned long> loads; // Ա -> ֵstore
+	};
+
+	pthread_mutex_t mutex;
+	std::map<std::string, Group> groups;
+
+	// ֵ
+	RouteBalancer(RouteBalancer& rhs);
+	RouteBalancer& operator=(RouteBalancer& rhs);
+};
+
+extern RouteBalancer g_routeBalancer;
+
+#endif // !defined FORWARDER_HASH_RING_H
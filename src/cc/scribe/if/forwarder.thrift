@@ -15,5 +15,13 @@ struct LogEntry {
 }
 
 service forwarder extends cloudxbase.CloudxService {
-  ResultCode Log(1: list<LogEntry> messages);
+  # batchId: ͷÿϢı, ط, Գ巢͵ĸʹbufferطŵĶͬһ. 0ʾûб
+  # senderId: Դ̵ıʶ, շֱ¼batchId, ͬһյظֱӷOK.
+  #   ԳĸһԱ, һȥ, ݶᱻ. мתʱεbatchIdsenderId,
+  #   ݸںĳһ㵽ͬһʱŻᱻϳ
+  ResultCode Log(1: list<LogEntry> messages, 2: i64 batchId, 3: string senderId);
+
+  # طͷڻԷֽڵϢ, 0ʾȱ, һ.
+  # շѶеʣռƽָҪȵķͷ. Կ۶ȵҪòͬsenderId
+  i64 getCredit(1: string senderId);
 }
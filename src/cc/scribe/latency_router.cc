@@ -0,0 +1,194 @@
+#include "latency_router.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "logger.h"
+#include "forwarder_server.h"
+#include "utils.h"
+
+using namespace std;
+
+LatencyRouter g_latencyRouter;
+
+LatencyRouter::LatencyRouter() :
+	ewmaWeight(DEFAULT_LATENCY_EWMA_PERCENT / 100.0), ejectMs(DEFAULT_OUTLIER_EJECT_MS), latencyPercent(DEFAULT_OUTLIER_LATENCY_PERCENT),
+			tryLaterPercent(DEFAULT_OUTLIER_TRY_LATER_PERCENT) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+LatencyRouter::~LatencyRouter() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void LatencyRouter::setEwmaPercent(unsigned long percent) {
+	if (!percent || percent > 100) {
+		LOG_OPER("Bad config - latency_ewma_percent must be between 1 and 100, using <%d>", DEFAULT_LATENCY_EWMA_PERCENT);
+		percent = DEFAULT_LATENCY_EWMA_PERCENT;
+	}
+	pthread_mutex_lock(&mutex);
+	ewmaWeight = percent / 100.0;
+	pthread_mutex_unlock(&mutex);
+}
+
+void LatencyRouter::setOutlierEjection(unsigned long eject_ms, unsigned long latency_percent, unsigned long try_later_percent) {
+	pthread_mutex_lock(&mutex);
+	ejectMs = eject_ms;
+	latencyPercent = latency_percent < 100 ? 100 : latency_percent;
+	tryLaterPercent = try_later_percent;
+	pthread_mutex_unlock(&mutex);
+}
+
+string LatencyRouter::makeKey(const string& host, int port) {
+	ostringstream oss;
+	oss << host << ":" << port;
+	return oss.str();
+}
+
+double LatencyRouter::score(const Stats& stats) {
+	if (!stats.samples) {
+		return 0;
+	}
+	return stats.latencyMs / max(1 - stats.tryLaterRate, 0.05);
+}
+
+void LatencyRouter::record(const string& host, int port, double latency_ms, bool try_later) {
+	pthread_mutex_lock(&mutex);
+	recordLocked(stats[makeKey(host, port)], latency_ms, try_later);
+	pthread_mutex_unlock(&mutex);
+}
+
+void LatencyRouter::beginSend(const string& host, int port, double start_ms) {
+	pthread_mutex_lock(&mutex);
+	stats[makeKey(host, port)].inflight.insert(start_ms);
+	pthread_mutex_unlock(&mutex);
+}
+
+void LatencyRouter::endSend(const string& host, int port, double start_ms, bool try_later) {
+	double now = (double) currentTimeMs();
+	pthread_mutex_lock(&mutex);
+	Stats& s = stats[makeKey(host, port)];
+	multiset<double>::iterator iter = s.inflight.find(start_ms);
+	if (iter != s.inflight.end()) {
+		s.inflight.erase(iter);
+	}
+	recordLocked(s, now - start_ms, try_later);
+	pthread_mutex_unlock(&mutex);
+}
+
+bool LatencyRouter::isStalled(const string& host, int port, double threshold_ms) {
+	double now = (double) currentTimeMs();
+	pthread_mutex_lock(&mutex);
+	const Stats& s = stats[makeKey(host, port)];
+	bool stalled = !s.inflight.empty() && now - *s.inflight.begin() > threshold_ms;
+	pthread_mutex_unlock(&mutex);
+	return stalled;
+}
+
+void LatencyRouter::recordLocked(Stats& s, double latency_ms, bool try_later) {
+	if (!s.samples) {
+		s.latencyMs = latency_ms;
+		s.tryLaterRate = try_later ? 1 : 0;
+	} else {
+		s.latencyMs += ewmaWeight * (latency_ms - s.latencyMs);
+		s.tryLaterRate += ewmaWeight * ((try_later ? 1 : 0) - s.tryLaterRate);
+	}
+	++s.samples;
+}
+
+void LatencyRouter::checkOutliers(const server_vector_t& servers, double now) {
+	vector<Stats*> candidates;
+	vector<string> keys;
+	vector<double> latencies;
+	unsigned long ejected = 0;
+	for (server_vector_t::const_iterator iter = servers.begin(); iter != servers.end(); ++iter) {
+		string key = makeKey(iter->first, iter->second);
+		Stats& s = stats[key];
+		if (s.ejectedUntil && now >= s.ejectedUntil) {
+			LOG_OPER("remote forwarder server <%s> back from outlier ejection", key.c_str());
+			Stats fresh;
+			fresh.inflight.swap(s.inflight);
+			s = fresh;
+		}
+		if (s.ejectedUntil) {
+			++ejected;
+		} else if (s.samples >= MIN_SAMPLES) {
+			candidates.push_back(&s);
+			keys.push_back(key);
+			latencies.push_back(s.latencyMs);
+		}
+	}
+	if (!ejectMs || candidates.empty()) {
+		return;
+	}
+
+	// λ, ԱʱͿǸ
+	sort(latencies.begin(), latencies.end());
+	double median = latencies[(latencies.size() - 1) / 2];
+	for (unsigned long i = 0; i < candidates.size() && (ejected + 1) * 2 <= servers.size(); ++i) {
+		Stats& s = *candidates[i];
+		bool throttled = s.tryLaterRate * 100 >= tryLaterPercent;
+		bool slow = candidates.size() > 1 && s.latencyMs * 100 > median * latencyPercent;
+		if (!throttled && !slow) {
+			continue;
+		}
+		s.ejectedUntil = now + ejectMs / 1000.0;
+		++ejected;
+		LOG_OPER("ejecting remote forwarder server <%s> for <%lu> ms: latency <%.1f> ms (group median <%.1f> ms), try later rate <%.2f>",
+				keys[i].c_str(), ejectMs, s.latencyMs, median, s.tryLaterRate);
+		g_Handler->incrementCounter("routing ejections");
+		g_Handler->incrementCounter("routing ejected " + keys[i]);
+	}
+}
+
+void LatencyRouter::rank(const server_vector_t& servers, server_vector_t& ranked) {
+	// ȴ, һ(綼û)ĳԱͬһǰ
+	vector<unsigned long> order;
+	for (unsigned long i = 0; i < servers.size(); ++i) {
+		order.push_back(i);
+	}
+	random_shuffle(order.begin(), order.end());
+
+	vector<pair<pair<bool, double>, unsigned long> > scored;
+	pthread_mutex_lock(&mutex);
+	checkOutliers(servers, currentTimeSec());
+	for (unsigned long i = 0; i < order.size(); ++i) {
+		const Stats& s = stats[makeKey(servers[order[i]].first, servers[order[i]].second)];
+		scored.push_back(make_pair(make_pair(s.ejectedUntil != 0, score(s)), i));
+	}
+	pthread_mutex_unlock(&mutex);
+
+	sort(scored.begin(), scored.end());
+	ranked.clear();
+	for (unsigned long i = 0; i < scored.size(); ++i) {
+		ranked.push_back(servers[order[scored[i].second]]);
+	}
+}
+
+bool LatencyRouter::shouldLeave(const string& host, int port, const server_vector_t& servers) {
+	pthread_mutex_lock(&mutex);
+	checkOutliers(servers, currentTimeSec());
+	const Stats& current = stats[makeKey(host, port)];
+	bool leave = current.ejectedUntil != 0;
+	if (!leave && current.samples >= MIN_SAMPLES) {
+		double current_score = score(current);
+		for (server_vector_t::const_iterator iter = servers.begin(); iter != servers.end(); ++iter) {
+			if (iter->first == host && iter->second == port) {
+				continue;
+			}
+			const Stats& s = stats[makeKey(iter->first, iter->second)];
+			// ҪԸòŻ, ĳԱ֮
+			if (!s.ejectedUntil && s.samples >= MIN_SAMPLES && score(s) * 2 < current_score) {
+				leave = true;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return leave;
+}
@@ -0,0 +1,85 @@
+#ifndef FORWARDER_LATENCY_ROUTER_H
+#define FORWARDER_LATENCY_ROUTER_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <pthread.h>
+
+#include "common.h"
+
+#define DEFAULT_LATENCY_EWMA_PERCENT 20
+#define DEFAULT_OUTLIER_EJECT_MS 30000
+#define DEFAULT_OUTLIER_LATENCY_PERCENT 300
+#define DEFAULT_OUTLIER_TRY_LATER_PERCENT 50
+
+/*
+ * ¼ÿĿ(host:port)ķӳٺTRY_LATERָȨƽ, routing=least_latencyѡsmc groupеĳԱ.
+ *
+ *  ӳ / (1 - TRY_LATER), ƽÿɹһҪʱ, ԽСԽ. ûĳԱΪ0, ȱ.
+ * 㹻ĳԱһʱ޳eject_ms, ڼ, ںͳ¿ʼ:
+ *   TRY_LATERСtry_later_percent%; ӳٳgroupδ޳Աӳλlatency_percent%.
+ * ͬһgroup޳һĳԱ.
+ */
+class LatencyRouter {
+public:
+	LatencyRouter();
+	virtual ~LatencyRouter();
+
+	// Ȩ(ٷֱ)
+	void setEwmaPercent(unsigned long percent);
+	// eject_msΪ0ʱ޳
+	void setOutlierEjection(unsigned long eject_ms, unsigned long latency_percent, unsigned long try_later_percent);
+
+	// ¼һη, latency_msǴдյصʱ. ӳҲTRY_LATER
+	void record(const std::string& host, int port, double latency_ms, bool try_later);
+	// ͬ, ͿʼʱȵbeginSend, ʱͬһstart_msendSend, ڼڵȷص
+	void beginSend(const std::string& host, int port, double start_ms);
+	void endSend(const std::string& host, int port, double start_ms, bool try_later);
+	// Ѿ˳threshold_msûз
+	bool isStalled(const std::string& host, int port, double threshold_ms);
+	// Ӻõservers, ޳ķ(ȫʱ)
+	void rank(const server_vector_t& servers, server_vector_t& ranked);
+	// ǰĳԱ޳, 㹻ĳԱһʱtrue
+	bool shouldLeave(const std::string& host, int port, const server_vector_t& servers);
+
+	static std::string makeKey(const std::string& host, int port);
+
+private:
+	static const unsigned long MIN_SAMPLES = 10; // ʱ޳, ҲΪԱ
+
+	class Stats {
+	public:
+		Stats() :
+			latencyMs(0), tryLaterRate(0), samples(0), ejectedUntil(0) {
+		}
+
+		double latencyMs;
+		double tryLaterRate;
+		unsigned long samples;
+		double ejectedUntil; // , 0ʾûб޳
+		std::multiset<double> inflight; // ڵȷصĿʼʱ()
+	};
+
+	typedef std::map<std::string, Stats> stats_map_t;
+
+	static double score(const Stats& stats);
+	void checkOutliers(const server_vector_t& servers, double now); // ߱mutex
+	void recordLocked(Stats& s, double latency_ms, bool try_later); // ߱mutex
+
+	double ewmaWeight;
+	unsigned long ejectMs;
+	unsigned long latencyPercent;
+	unsigned long tryLaterPercent;
+
+	pthread_mutex_t mutex; // stats
+	stats_map_t stats;
+
+	// ֵ
+	LatencyRouter(LatencyRouter& rhs);
+	LatencyRouter& operator=(LatencyRouter& rhs);
+};
+
+extern LatencyRouter g_latencyRouter;
+
+#endif // !defined FORWARDER_LATENCY_ROUTER_H
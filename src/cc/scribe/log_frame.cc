@@ -0,0 +1,131 @@
+#include "log_frame.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "thrift/protocol/TBinaryProtocol.h"
+#include "thrift/transport/TTransportUtils.h"
+
+#include "logger.h"
+
+using namespace std;
+using namespace apache::thrift;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::transport;
+using namespace forwarder::thrift;
+using boost::shared_ptr;
+
+static void serializeFrameUInt(unsigned data, char* buffer) {
+	for (int i = 0; i < 4; ++i) {
+		buffer[i] = (char) ((data >> (8 * (3 - i))) & 0xff);
+	}
+}
+
+static unsigned unserializeFrameUInt(const char* buffer) {
+	unsigned data = 0;
+	for (int i = 0; i < 4; ++i) {
+		data = (data << 8) | (unsigned char) buffer[i];
+	}
+	return data;
+}
+
+static void appendFrameUInt(unsigned data, string& frame) {
+	char buffer[4];
+	serializeFrameUInt(data, buffer);
+	frame.append(buffer, 4);
+}
+
+static void appendFrameString(const string& data, string& frame) {
+	appendFrameUInt(data.length(), frame);
+	frame += data;
+}
+
+static void appendFieldHeader(TType type, int16_t id, string& frame) {
+	frame += (char) type;
+	frame += (char) ((id >> 8) & 0xff);
+	frame += (char) (id & 0xff);
+}
+
+void encodeLogFrame(const logentry_vector_t& messages, string& frame, int64_t batch_id, const string& sender_id) {
+	frame.clear();
+	appendLogFrame(messages, 0, frame, batch_id, sender_id);
+}
+
+// ɵforwarder_Log_pargs::writeĽһ:
+// callͷ, ֶ1(list<LogEntry>), ÿLogEntryֶ1(category) ֶ2(message) T_STOP, ֶ2(batchId) ֶ3(senderId),
+// ǲstructT_STOP
+void appendLogFrame(const logentry_vector_t& messages, int32_t seqid, string& frame, int64_t batch_id, const string& sender_id) {
+	unsigned long size = LOG_FRAME_HEADER_SIZE + 1 + 11 + 7 + sender_id.length();
+	for (logentry_vector_t::const_iterator iter = messages.begin(); iter != messages.end(); ++iter) {
+		size += (*iter)->category.length() + (*iter)->message.length() + 15;
+	}
+	string::size_type start = frame.length();
+	frame.reserve(start + size);
+
+	frame.append(4, 0); // 
+	appendFrameString("Log", frame);
+	frame += (char) T_CALL;
+	appendFrameUInt((unsigned) seqid, frame);
+	appendFieldHeader(T_LIST, 1, frame);
+	frame += (char) T_STRUCT;
+	appendFrameUInt(messages.size(), frame);
+	for (logentry_vector_t::const_iterator iter = messages.begin(); iter != messages.end(); ++iter) {
+		appendFieldHeader(T_STRING, 1, frame);
+		appendFrameString((*iter)->category, frame);
+		appendFieldHeader(T_STRING, 2, frame);
+		appendFrameString((*iter)->message, frame);
+		frame += (char) T_STOP;
+	}
+	if (batch_id) {
+		appendFieldHeader(T_I64, 2, frame);
+		appendFrameUInt((unsigned) ((uint64_t) batch_id >> 32), frame);
+		appendFrameUInt((unsigned) batch_id, frame);
+		appendFieldHeader(T_STRING, 3, frame);
+		appendFrameString(sender_id, frame);
+	}
+	frame += (char) T_STOP;
+
+	serializeFrameUInt(frame.length() - start - 4, &frame[start]);
+}
+
+bool decodeLogFrame(const string& frame, logentry_vector_t& messages) {
+	if (frame.length() < LOG_FRAME_HEADER_SIZE || unserializeFrameUInt(frame.data()) != frame.length() - 4) {
+		return false;
+	}
+
+	try {
+		shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer((uint8_t*) frame.data() + 4, frame.length() - 4));
+		TBinaryProtocol protocol(buffer);
+		protocol.setStrict(false, false);
+
+		string name;
+		TMessageType type;
+		int32_t seqid;
+		protocol.readMessageBegin(name, type, seqid);
+		if (type != T_CALL || 0 != name.compare("Log")) {
+			return false;
+		}
+		forwarder_Log_args args;
+		args.read(&protocol);
+		protocol.readMessageEnd();
+
+		for (std::vector<LogEntry>::iterator iter = args.messages.begin(); iter != args.messages.end(); ++iter) {
+			messages.push_back(logentry_ptr_t(new LogEntry(*iter)));
+		}
+	} catch (TException& tx) {
+		LOG_OPER("failed to decode Log() frame of <%lu> bytes error <%s>", (unsigned long) frame.length(), tx.what());
+		return false;
+	}
+	return true;
+}
+
+bool parseLogFrameHeader(const char* header, unsigned long& frame_bytes, unsigned& num_messages) {
+	const unsigned char* bytes = (const unsigned char*) header;
+	if (unserializeFrameUInt(header + 4) != 3 || 0 != memcmp(header + 8, "Log", 3) || bytes[11] != T_CALL
+			|| bytes[16] != T_LIST || bytes[17] != 0 || bytes[18] != 1 || bytes[19] != T_STRUCT) {
+		return false;
+	}
+	frame_bytes = (unsigned long) unserializeFrameUInt(header) + 4;
+	num_messages = unserializeFrameUInt(header + 20);
+	return frame_bytes >= LOG_FRAME_HEADER_SIZE;
+}
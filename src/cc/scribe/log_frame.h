@@ -0,0 +1,52 @@
+#ifndef FORWARDER_LOG_FRAME_H
+#define FORWARDER_LOG_FRAME_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+/*
+ * ԤȱõLog()֡, forwarderConnȥֽȫһ:
+ *   TFramedTransport4ֽڴ˳ + TBinaryProtocol(strict)call("Log", seqidΪ0).
+ * buffer_format=thriftbufferļһһ֡, طʱ԰ļֱдsocket(forwarderConn::sendFrames).
+ */
+
+// ֡ͷ: (4) (4) "Log"(3) Ϣ(1) seqid(4) ֶ(1) ֶid(2) Ԫ(1) Ϣ(4)
+#define LOG_FRAME_HEADER_SIZE 24
+
+// һϢһ֡
+void encodeLogFrame(const logentry_vector_t& messages, std::string& frame, int64_t batch_id = 0, const std::string& sender_id = std::string());
+// ͬ, ׷ӵframeĺ沢ָseqid. ֱӰTBinaryProtocolĸʽLogEntryָ, LogEntry,
+// frameظʹ, clear֮. batch_idΪ0ʱдbatchIdsenderIdֶ
+void appendLogFrame(const logentry_vector_t& messages, int32_t seqid, std::string& frame, int64_t batch_id = 0,
+		const std::string& sender_id = std::string());
+// һ֡(4ֽڳ), ʧܷfalse
+bool decodeLogFrame(const std::string& frame, logentry_vector_t& messages);
+// ֡ͷ, frame_bytes֡ĳ(4ֽڳ). Log()֡ʱfalse
+bool parseLogFrameHeader(const char* header, unsigned long& frame_bytes, unsigned& num_messages);
+
+/*
+ * bufferļһ֡.
+ */
+class LogFrameRegion {
+public:
+	LogFrameRegion() :
+		offset(0) {
+	}
+
+	unsigned long bytes() const {
+		return frameEnds.empty() ? 0 : frameEnds.back() - offset;
+	}
+	// i֡ʼλ
+	unsigned long frameStart(unsigned long i) const {
+		return i ? frameEnds[i - 1] : offset;
+	}
+
+	std::string filename;
+	unsigned long offset; // һ֡ʼλ
+	std::vector<unsigned long> frameEnds; // ÿ֡λ
+	std::vector<unsigned> frameMessages; // ÿ֡Ϣ
+};
+
+#endif // !defined FORWARDER_LOG_FRAME_H
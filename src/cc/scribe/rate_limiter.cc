@@ -0,0 +1,58 @@
+#include "rate_limiter.h"
+
+#include <time.h>
+
+RateLimiter::RateLimiter(unsigned long bytes_per_sec) :
+	bytesPerSec(bytes_per_sec), tokens(bytes_per_sec) {
+	pthread_mutex_init(&mutex, NULL);
+	gettimeofday(&lastRefill, NULL);
+}
+
+RateLimiter::~RateLimiter() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void RateLimiter::setRate(unsigned long bytes_per_sec) {
+	pthread_mutex_lock(&mutex);
+	bytesPerSec = bytes_per_sec;
+	tokens = bytes_per_sec;
+	gettimeofday(&lastRefill, NULL);
+	pthread_mutex_unlock(&mutex);
+}
+
+unsigned long RateLimiter::getRate() {
+	pthread_mutex_lock(&mutex);
+	unsigned long rate = bytesPerSec;
+	pthread_mutex_unlock(&mutex);
+	return rate;
+}
+
+double RateLimiter::reserve(unsigned long bytes) {
+	pthread_mutex_lock(&mutex);
+	if (!bytesPerSec) {
+		pthread_mutex_unlock(&mutex);
+		return 0;
+	}
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	double elapsed = (now.tv_sec - lastRefill.tv_sec) + (now.tv_usec - lastRefill.tv_usec) / 1000000.0;
+	lastRefill = now;
+	tokens += elapsed * bytesPerSec;
+	if (tokens > bytesPerSec) {
+		tokens = bytesPerSec;
+	}
+	tokens -= bytes;
+	double wait = tokens < 0 ? -tokens / bytesPerSec : 0;
+	pthread_mutex_unlock(&mutex);
+	return wait;
+}
+
+void RateLimiter::throttle(unsigned long bytes) {
+	double wait = reserve(bytes);
+	if (wait > 0) {
+		struct timespec sleep_time;
+		sleep_time.tv_sec = (time_t) wait;
+		sleep_time.tv_nsec = (long) ((wait - sleep_time.tv_sec) * 1000000000);
+		nanosleep(&sleep_time, NULL);
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef FORWARDER_RATE_LIMITER_H
+#define FORWARDER_RATE_LIMITER_H
+
+#include <pthread.h>
+#include <sys/time.h>
+
+/*
+ * ֽٵͰ, һ. ߳̿Թһ.
+ */
+class RateLimiter {
+public:
+	RateLimiter(unsigned long bytes_per_sec = 0);
+	virtual ~RateLimiter();
+
+	// 0ʾ
+	void setRate(unsigned long bytes_per_sec);
+	unsigned long getRate();
+
+	// õbytesֽ, ػҪȶܼ
+	double reserve(unsigned long bytes);
+	// reserve֮ڵǰ߳sleep
+	void throttle(unsigned long bytes);
+
+private:
+	pthread_mutex_t mutex;
+	unsigned long bytesPerSec;
+	double tokens;
+	struct timeval lastRefill;
+
+	// ֵ
+	RateLimiter(RateLimiter& rhs);
+	RateLimiter& operator=(RateLimiter& rhs);
+};
+
+#endif // !defined FORWARDER_RATE_LIMITER_H
@@ -0,0 +1,186 @@
+#include "replay_scheduler.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <stdexcept>
+
+#include "logger.h"
+#include "utils.h"
+
+using namespace std;
+
+ReplayScheduler g_replayScheduler;
+
+static void* replaySchedulerThreadStatic(void *this_ptr) {
+	ReplayScheduler *scheduler_ptr = (ReplayScheduler*) this_ptr;
+	scheduler_ptr->threadMember();
+	return NULL;
+}
+
+ReplayScheduler::ReplayScheduler(unsigned num_threads) :
+	numThreads(num_threads), started(false) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&entryCond, NULL);
+}
+
+ReplayScheduler::~ReplayScheduler() {
+	// TaskQueueһ, ȫֶڽ˳ʱ, ߳Ͳdestroy
+	if (!started) {
+		pthread_mutex_destroy(&mutex);
+		pthread_cond_destroy(&entryCond);
+	}
+}
+
+void ReplayScheduler::setNumThreads(unsigned num_threads) {
+	pthread_mutex_lock(&mutex);
+	if (started) {
+		LOG_OPER("WARNING: replay scheduler already started with <%u> threads, ignoring <%u>", numThreads, num_threads);
+	} else if (num_threads > 0) {
+		numThreads = num_threads;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void ReplayScheduler::setBytesPerSec(unsigned long bytes_per_sec) {
+	limiter.setRate(bytes_per_sec);
+}
+
+unsigned long ReplayScheduler::getSize() {
+	pthread_mutex_lock(&mutex);
+	unsigned long size = entries.size();
+	pthread_mutex_unlock(&mutex);
+	return size;
+}
+
+ReplayScheduler::entry_list_t::iterator ReplayScheduler::findEntry(ReplaySource* source) {
+	for (entry_list_t::iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+		if (iter->source == source && !iter->removed) {
+			return iter;
+		}
+	}
+	return entries.end();
+}
+
+void ReplayScheduler::addSource(ReplaySource* source, int priority, time_t since) {
+	pthread_mutex_lock(&mutex);
+	if (!started) {
+		startThreads();
+	}
+	entry_list_t::iterator iter = findEntry(source);
+	if (iter == entries.end()) {
+		entries.push_back(Entry(source, priority, since));
+	} else {
+		iter->priority = priority;
+		iter->since = since;
+	}
+	pthread_cond_broadcast(&entryCond);
+	pthread_mutex_unlock(&mutex);
+}
+
+void ReplayScheduler::removeSource(ReplaySource* source) {
+	pthread_mutex_lock(&mutex);
+	entry_list_t::iterator iter = findEntry(source);
+	if (iter != entries.end()) {
+		if (iter->running) {
+			// ɹ߳ط֮ɾ
+			iter->removed = true;
+			while (true) {
+				bool found = false;
+				for (entry_list_t::iterator it = entries.begin(); it != entries.end(); ++it) {
+					if (it->source == source && it->removed) {
+						found = true;
+						break;
+					}
+				}
+				if (!found) {
+					break;
+				}
+				pthread_cond_wait(&entryCond, &mutex);
+			}
+		} else {
+			entries.erase(iter);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+// ߱mutex
+void ReplayScheduler::startThreads() {
+	for (unsigned i = 0; i < numThreads; ++i) {
+		pthread_t thread;
+		if (0 != pthread_create(&thread, NULL, replaySchedulerThreadStatic, (void*) this)) {
+			throw std::runtime_error("pthread_create failed in ReplayScheduler");
+		}
+		threads.push_back(thread);
+	}
+	started = true;
+	LOG_OPER("replay scheduler started <%u> threads", numThreads);
+}
+
+// ҳһطŵsource, ûʱnext_readyԵȵʱ(0ʾûڵȵsource)
+ReplayScheduler::entry_list_t::iterator ReplayScheduler::pickEntry(double now, double& next_ready) {
+	entry_list_t::iterator best = entries.end();
+	next_ready = 0;
+	for (entry_list_t::iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+		if (iter->running || iter->removed) {
+			continue;
+		}
+		if (iter->notBefore > now) {
+			if (!next_ready || iter->notBefore < next_ready) {
+				next_ready = iter->notBefore;
+			}
+			continue;
+		}
+		if (best == entries.end() || iter->priority > best->priority || (iter->priority == best->priority && iter->since < best->since)) {
+			best = iter;
+		}
+	}
+	return best;
+}
+
+void ReplayScheduler::threadMember() {
+	while (true) {
+		pthread_mutex_lock(&mutex);
+		entry_list_t::iterator entry;
+		while (true) {
+			double next_ready = 0;
+			entry = pickEntry(currentTimeSec(), next_ready);
+			if (entry != entries.end()) {
+				break;
+			}
+			if (next_ready) {
+				struct timespec deadline;
+				deadline.tv_sec = (time_t) next_ready;
+				deadline.tv_nsec = (long) ((next_ready - deadline.tv_sec) * 1000000000);
+				pthread_cond_timedwait(&entryCond, &mutex, &deadline);
+			} else {
+				pthread_cond_wait(&entryCond, &mutex);
+			}
+		}
+		// listiteratorڱԪرɾʱȻЧ, runningentryֻб̻߳ɾ
+		entry->running = true;
+		ReplaySource* source = entry->source;
+		pthread_mutex_unlock(&mutex);
+
+		unsigned long bytes = 0;
+		double delay = 0;
+		bool more = false;
+		try {
+			more = source->replayChunk(bytes, delay);
+		} catch (std::exception const& e) {
+			LOG_OPER("Exception < %s > replaying buffer", e.what());
+		}
+		limiter.throttle(bytes);
+
+		pthread_mutex_lock(&mutex);
+		entry->running = false;
+		if (!more || entry->removed) {
+			entries.erase(entry);
+		} else {
+			entry->notBefore = delay > 0 ? currentTimeSec() + delay : 0;
+		}
+		pthread_cond_broadcast(&entryCond);
+		pthread_mutex_unlock(&mutex);
+	}
+}
@@ -0,0 +1,90 @@
+#ifndef FORWARDER_REPLAY_SCHEDULER_H
+#define FORWARDER_REPLAY_SCHEDULER_H
+
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+
+#include "rate_limiter.h"
+
+/*
+ * ReplaySchedulerطŻѹݵĶ(BufferStore).
+ */
+class ReplaySource {
+public:
+	virtual ~ReplaySource() {
+	}
+	// طһ, ڹ߳. bytesط͵ֽ, delayٶ֮ٵ.
+	// falseʾѹѾû, schedulerƳ, ֮sourceԼµǼ
+	virtual bool replayChunk(unsigned long& bytes, double& delay) = 0;
+};
+
+/*
+ * ȫֵطŵ, ù̶Ĺ̲߳еطźܶcategoryĻѹ.
+ *
+ * ÿ߳ÿѡһûطŵsourceطһ, ѡ˳:
+ *   priority(õҪcategory), ͬʱsince(ѹݸ).
+ * ͬһʱnum_threadssourceط, ȼߵĻȱ.
+ * й̷߳͵ֽϼbytes_per_sec.
+ * ߳ڵһaddSourceʱ.
+ */
+class ReplayScheduler {
+public:
+	ReplayScheduler(unsigned num_threads = 4);
+	virtual ~ReplayScheduler();
+
+	// ֻ֮߳ǰòЧ
+	void setNumThreads(unsigned num_threads);
+	// 0ʾ
+	void setBytesPerSec(unsigned long bytes_per_sec);
+
+	// ѾǼǹsourceֻprioritysince
+	void addSource(ReplaySource* source, int priority, time_t since);
+	// Ƴsource, ߳ط͵. ֮schedulerʹsource
+	void removeSource(ReplaySource* source);
+
+	// ֻ״̬鿴.
+	unsigned long getSize();
+
+	// ̵߳ѭ
+	void threadMember();
+
+private:
+	class Entry {
+	public:
+		Entry(ReplaySource* replay_source, int replay_priority, time_t replay_since) :
+			source(replay_source), priority(replay_priority), since(replay_since), notBefore(0), running(false), removed(false) {
+		}
+
+		ReplaySource* source;
+		int priority;
+		time_t since;
+		double notBefore; // ʱ()֮ǰ
+		bool running;
+		bool removed; // طŵʱƳ, طɾ
+	};
+
+	typedef std::list<Entry> entry_list_t;
+
+	void startThreads(); // ߱mutex
+	entry_list_t::iterator pickEntry(double now, double& next_ready); // ߱mutex
+	entry_list_t::iterator findEntry(ReplaySource* source); // ߱mutex
+
+	entry_list_t entries;
+	std::vector<pthread_t> threads;
+	unsigned numThreads;
+	bool started;
+	RateLimiter limiter;
+
+	pthread_mutex_t mutex; // entries
+	pthread_cond_t entryCond; // µsourcesourceطһ
+
+	// ֵ
+	ReplayScheduler(ReplayScheduler& rhs);
+	ReplayScheduler& operator=(ReplayScheduler& rhs);
+};
+
+extern ReplayScheduler g_replayScheduler;
+
+#endif // !defined FORWARDER_REPLAY_SCHEDULER_H
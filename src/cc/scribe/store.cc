@@ -4,17 +4,25 @@
  */
 #include "store.h"
 
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include <sstream>
+#include <fstream>
 #include <iostream>
 #include <iomanip>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/split.hpp>
 
+#include "crc32c.h"
 #include "forwarder_server.h"
 #include "group_service.h"
+#include "hash_ring.h"
+#include "task_queue.h"
 #include "utils.h"
 #include "logger.h"
 
@@ -32,10 +40,16 @@ using namespace forwarder::thrift;
 #define DEFAULT_FILESTORE_MAX_SIZE               1000000000
 #define DEFAULT_FILESTORE_ROLL_HOUR              1
 #define DEFAULT_FILESTORE_ROLL_MINUTE            15
+#define DEFAULT_FILESTORE_COMPRESSION_LEVEL      -1
+#define DEFAULT_FILESTORE_COMPRESSION_BLOCK_SIZE 262144
+#define DEFAULT_FILESTORE_COMPRESSION_BLOCK_AGE  60
 #define DEFAULT_BUFFERSTORE_MAX_QUEUE_LENGTH     2000000
 #define DEFAULT_BUFFERSTORE_SEND_RATE            1
 #define DEFAULT_BUFFERSTORE_AVG_RETRY_INTERVAL   300
 #define DEFAULT_BUFFERSTORE_RETRY_INTERVAL_RANGE 60
+#define DEFAULT_BUFFERSTORE_REPLAY_CHUNK_BYTES   1048576
+#define DEFAULT_BUFFERSTORE_MEMORY_MAX_OUTAGE    30
+#define DEFAULT_BUFFERSTORE_PROBE_MAX_INTERVAL   30000
 #define DEFAULT_BUCKETSTORE_DELIMITER            ':'
 
 ConnPool g_connPool;
@@ -215,6 +229,9 @@ void FileStoreBase::periodicCheck() {
 	}
 	if (rotate) {
 		rotateFile(timeinfo);
+	} else if (flushOnCheck()) {
+		// ûϢʱStoreQueueflush, ﶨflushһ, ѹļ̫õĲblockдȥ
+		flush();
 	}
 }
 
@@ -311,7 +328,9 @@ int FileStoreBase::getFileSuffix(const string& filename, const string& base_file
 
 	bool retVal = (0 == filename.substr(0, suffix_pos).compare(base_filename));
 
-	if (string::npos != suffix_pos && filename.length() > suffix_pos && retVal) {
+	// suffix治бĶ, .cursor, .fzļҲļ
+	if (string::npos != suffix_pos && filename.length() > suffix_pos + 1 && retVal
+			&& string::npos == filename.find_first_not_of("0123456789", suffix_pos + 1)) {
 		stringstream stream;
 		stream << filename.substr(suffix_pos + 1);
 		stream >> suffix;
@@ -319,18 +338,13 @@ int FileStoreBase::getFileSuffix(const string& filename, const string& base_file
 	return suffix;
 }
 
-//¼ͳϢ
-void FileStoreBase::printStats() {
+string FileStoreBase::makeStatsFilename() {
 	string filename(filePath);
 	filename += "/forwarder_stats";
+	return filename;
+}
 
-	boost::shared_ptr<FileInterface> stats_file = FileInterface::createFileInterface(fsType, filename);
-	if (!stats_file || !stats_file->openWrite()) {
-		LOG_OPER("[%s] Failed to open stats file <%s> of type <%s> for writing", categoryHandled.c_str(), filename.c_str(), fsType.c_str());
-		// This isn't enough of a problem to change our status
-		return;
-	}
-
+string FileStoreBase::makeStats() {
 	time_t rawtime;
 	time(&rawtime);
 	struct tm *local_time = localtime(&rawtime);
@@ -340,9 +354,32 @@ void FileStoreBase::printStats() {
 			<< local_time->tm_hour << ':' << setw(2) << setfill('0') << local_time->tm_min;
 
 	msg << " wrote <" << currentSize << "> bytes in <" << eventsWritten << "> events to file <" << currentFilename << ">" << endl;
+	return msg.str();
+}
+
+// ͬһĿ¼µstoreдͬһͳļ, ̨rotateʱg_fileTaskQueue߳д, ׷ʱҪ
+static pthread_mutex_t statsFileMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool appendStats(const string& fs_type, const string& filename, const string& stats) {
+	pthread_mutex_lock(&statsFileMutex);
+	boost::shared_ptr<FileInterface> stats_file = FileInterface::createFileInterface(fs_type, filename);
+	bool success = stats_file && stats_file->openWrite();
+	if (success) {
+		stats_file->write(stats);
+		stats_file->close();
+	}
+	pthread_mutex_unlock(&statsFileMutex);
+	return success;
+}
+
+//¼ͳϢ
+void FileStoreBase::printStats() {
+	string filename = makeStatsFilename();
 
-	stats_file->write(msg.str());
-	stats_file->close();
+	if (!appendStats(fsType, filename, makeStats())) {
+		LOG_OPER("[%s] Failed to open stats file <%s> of type <%s> for writing", categoryHandled.c_str(), filename.c_str(), fsType.c_str());
+		// This isn't enough of a problem to change our status
+	}
 }
 
 // chunkߴ, Ҫֽ
@@ -359,8 +396,100 @@ unsigned long FileStoreBase::bytesToPad(unsigned long next_message_length, unsig
 	return 0;
 }
 
+NextSegment::NextSegment() :
+	pending(false), size(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&readyCond, NULL);
+}
+
+NextSegment::~NextSegment() {
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&readyCond);
+}
+
+/*
+ * ں̨һļԤռ, ɺŵNextSegmentFileStoreȡ.
+ */
+class PrepareSegmentTask: public Task {
+public:
+	PrepareSegmentTask(shared_ptr<NextSegment> next_segment, shared_ptr<FileInterface> next_file, const string& file_name, const string& base_file_name, unsigned long preallocate_size, const string& category) :
+		segment(next_segment), file(next_file), filename(file_name), baseFilename(base_file_name), preallocateSize(preallocate_size), categoryHandled(category) {
+	}
+
+	void run() {
+		unsigned long size = 0;
+		if (!file || !file->openWrite()) {
+			LOG_OPER("[%s] Failed to prepare next file <%s> for writing", categoryHandled.c_str(), filename.c_str());
+			file.reset();
+		} else {
+			if (preallocateSize) {
+				file->preallocate(preallocateSize);
+			}
+			size = file->fileSize();
+		}
+
+		pthread_mutex_lock(&segment->mutex);
+		segment->file = file;
+		segment->filename = filename;
+		segment->baseFilename = baseFilename;
+		segment->size = size;
+		segment->pending = false;
+		pthread_cond_broadcast(&segment->readyCond);
+		pthread_mutex_unlock(&segment->mutex);
+	}
+
+private:
+	shared_ptr<NextSegment> segment;
+	shared_ptr<FileInterface> file;
+	string filename;
+	string baseFilename;
+	unsigned long preallocateSize;
+	string categoryHandled;
+};
+
+/*
+ * ں̨Ѿrotateļ: дmeta, رļ, дͳϢ.
+ * rotateFileͬ, g_fileTaskQueueж߳ʱ֮û˳, ָļ.
+ */
+class RetireSegmentTask: public Task {
+public:
+	RetireSegmentTask(shared_ptr<FileInterface> old_file, const string& meta, const string& fs_type, const string& stats_filename, const string& stats, const CompactJob* compact_job) :
+		oldFile(old_file), metaLine(meta), fsType(fs_type), statsFilename(stats_filename), statsLine(stats), compact(compact_job != NULL) {
+		if (compact_job) {
+			compactJob = *compact_job;
+		}
+	}
+
+	void run() {
+		if (!metaLine.empty()) {
+			oldFile->write(metaLine);
+		}
+		oldFile->close();
+		if (compact) {
+			g_compactor.addJob(compactJob);
+		}
+
+		if (!appendStats(fsType, statsFilename, statsLine)) {
+			LOG_OPER("Failed to open stats file <%s> of type <%s> for writing", statsFilename.c_str(), fsType.c_str());
+		}
+	}
+
+private:
+	shared_ptr<FileInterface> oldFile;
+	string metaLine;
+	string fsType;
+	string statsFilename;
+	string statsLine;
+	bool compact;
+	CompactJob compactJob;
+};
+
 FileStore::FileStore(const string& category, bool multi_category, bool is_buffer_file) :
-	FileStoreBase(category, "file", multi_category), isBufferFile(is_buffer_file), addNewlines(false) {
+	FileStoreBase(category, "file", multi_category), isBufferFile(is_buffer_file), addNewlines(false), asyncRotate(false), preallocateSize(0),
+	compressionCodec(CODEC_NONE), compressionLevel(DEFAULT_FILESTORE_COMPRESSION_LEVEL), compressionBlockSize(DEFAULT_FILESTORE_COMPRESSION_BLOCK_SIZE),
+	compressionBlockAge(DEFAULT_FILESTORE_COMPRESSION_BLOCK_AGE), asyncCompression(true), indexedSegments(false), frameChecksum(false), compactClosed(false),
+	compactLevel(DEFAULT_FILESTORE_COMPRESSION_LEVEL), compactMergeSize(0), replayChunkBytes(0), replayNewestFirst(false), maxAge(0), thriftFrames(false),
+	currentSuffix(0), nextSegment(new NextSegment), replayStartOffset(0), replayEndOffset(0), replayAtEnd(false), currentBatchId(0) {
 }
 
 FileStore::~FileStore() {
@@ -390,6 +519,121 @@ void FileStore::configure(pStoreConf configuration) {
 	unsigned long inttemp = 0;
 	configuration->getUnsigned("add_newlines", inttemp);
 	addNewlines = inttemp ? true : false;
+
+	string tmp;
+	if (configuration->getString("async_rotate", tmp)) {
+		asyncRotate = (0 == tmp.compare("yes"));
+	}
+	configuration->getUnsigned("preallocate_size", preallocateSize);
+
+	if (isBufferFile && asyncRotate) {
+		// bufferļǰsuffixɾ, ǰõĿļᱻɴ͵buffer, Բ֧
+		LOG_OPER("[%s] WARNING: async_rotate is not supported for buffer files, ignoring", categoryHandled.c_str());
+		asyncRotate = false;
+	}
+
+	if (configuration->getString("compression", tmp)) {
+		if (!BlockFile::parseCodec(tmp, compressionCodec)) {
+			LOG_OPER("[%s] WARNING: Bad config - unknown compression codec <%s>, writing uncompressed", categoryHandled.c_str(), tmp.c_str());
+			compressionCodec = CODEC_NONE;
+		}
+	}
+	configuration->getInt("compression_level", compressionLevel);
+	configuration->getUnsigned("compression_block_size", compressionBlockSize);
+	configuration->getUnsigned("compression_block_max_age", compressionBlockAge);
+	if (configuration->getString("compression_async", tmp)) {
+		asyncCompression = (0 == tmp.compare("yes"));
+	}
+
+	if (configuration->getString("segment_format", tmp)) {
+		if (0 == tmp.compare("indexed")) {
+			indexedSegments = true;
+		} else if (0 != tmp.compare("plain")) {
+			LOG_OPER("[%s] WARNING: Bad config - unknown segment_format <%s>, using plain", categoryHandled.c_str(), tmp.c_str());
+		}
+	}
+
+	if (configuration->getString("frame_format", tmp)) {
+		if (0 == tmp.compare("v2")) {
+			frameChecksum = true;
+			LOG_OPER("[%s] buffer frames are checked with %s CRC32C", categoryHandled.c_str(), crc32cHardware() ? "sse4.2" : "table-driven");
+		} else if (0 != tmp.compare("v1")) {
+			LOG_OPER("[%s] WARNING: Bad config - unknown frame_format <%s>, using v1", categoryHandled.c_str(), tmp.c_str());
+		}
+	}
+	if (!isBufferFile && frameChecksum) {
+		// ֻbufferļframed
+		LOG_OPER("[%s] WARNING: frame_format is only used by buffer files, ignoring", categoryHandled.c_str());
+		frameChecksum = false;
+	}
+
+	if (configuration->getString("buffer_format", tmp)) {
+		if (0 == tmp.compare("thrift")) {
+			thriftFrames = true;
+		} else if (0 != tmp.compare("framed")) {
+			LOG_OPER("[%s] WARNING: Bad config - unknown buffer_format <%s>, using framed", categoryHandled.c_str(), tmp.c_str());
+		}
+	}
+	if (thriftFrames && (!isBufferFile || 0 != fsType.compare("std"))) {
+		// طʱҪֱӶļ
+		LOG_OPER("[%s] WARNING: buffer_format=thrift only works for std buffer files, ignoring", categoryHandled.c_str());
+		thriftFrames = false;
+	}
+	if (thriftFrames && frameChecksum) {
+		LOG_OPER("[%s] WARNING: frame_format is not used with buffer_format=thrift, ignoring", categoryHandled.c_str());
+		frameChecksum = false;
+	}
+
+	if (isBufferFile && compressionCodec != CODEC_NONE) {
+		// bufferļҪط, ѹ
+		LOG_OPER("[%s] WARNING: compression is not supported for buffer files, ignoring", categoryHandled.c_str());
+		compressionCodec = CODEC_NONE;
+	}
+	if (isBufferFile && indexedSegments) {
+		LOG_OPER("[%s] WARNING: indexed segment format is not supported for buffer files, ignoring", categoryHandled.c_str());
+		indexedSegments = false;
+	}
+	if ((compressionCodec != CODEC_NONE || indexedSegments) && !addNewlines) {
+		// BlockFile::readNextзֽѹϢ
+		LOG_OPER("[%s] WARNING: block compressed files need add_newlines, turning it on", categoryHandled.c_str());
+		addNewlines = true;
+	}
+	if (configuration->getString("compact", tmp)) {
+		compactClosed = (0 == tmp.compare("yes"));
+	}
+	configuration->getInt("compact_level", compactLevel);
+	configuration->getUnsigned("compact_merge_size", compactMergeSize);
+	if (compactClosed && (isBufferFile || compressionCodec != CODEC_NONE || indexedSegments)) {
+		// bufferļᱻط; Ѿblockʽļѹ
+		LOG_OPER("[%s] WARNING: compact only works for plain uncompressed files, ignoring", categoryHandled.c_str());
+		compactClosed = false;
+	}
+
+	configuration->getUnsigned("replay_chunk_bytes", replayChunkBytes);
+	if (!isBufferFile && replayChunkBytes) {
+		LOG_OPER("[%s] WARNING: replay_chunk_bytes is only used by buffer files, ignoring", categoryHandled.c_str());
+		replayChunkBytes = 0;
+	}
+	configuration->getUnsigned("max_age", maxAge);
+	if (!isBufferFile && maxAge) {
+		// ͨļյĴ洢, ܰʱɾ
+		maxAge = 0;
+	}
+	if (configuration->getString("replay_order", tmp)) {
+		if (0 == tmp.compare("lifo")) {
+			replayNewestFirst = true;
+		} else if (0 == tmp.compare("fifo")) {
+			replayNewestFirst = false;
+		} else {
+			LOG_OPER("[%s] WARNING: Bad config - unknown replay_order <%s>, using fifo", categoryHandled.c_str(), tmp.c_str());
+		}
+	}
+
+	if (indexedSegments && chunkSize) {
+		// blockseekĵλ, ٰchunk
+		LOG_OPER("[%s] WARNING: chunk_size is ignored for indexed segment format", categoryHandled.c_str());
+		chunkSize = 0;
+	}
 }
 
 bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
@@ -400,6 +644,14 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
 		current_time = localtime(&rawtime);
 	}
 	try {
+		// ̨׼ļǰϵsuffix, Ҫڲļ֮ǰӵ
+		if (useAsyncRotate()) {
+			discardNextSegment();
+			if (!incrementFilename) {
+				removeEmptyTrailingSegments(current_time);
+			}
+		}
+
 		int suffix = findNewestFile(makeBaseFilename(current_time));
 
 		if (incrementFilename) {
@@ -426,9 +678,12 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
 				writeFile->write(meta_logfile_prefix + file);
 			}
 			writeFile->close();
+			if (compactClosed && 0 != currentFilename.compare(file)) {
+				g_compactor.addJob(makeCompactJob(currentFilename));
+			}
 		}
 
-		writeFile = FileInterface::createFileInterface(fsType, file, isBufferFile);
+		writeFile = createWriteFile(file);
 		if (!writeFile) {
 			LOG_OPER("[%s] Failed to create file <%s> of type <%s> for writing",
 					categoryHandled.c_str(), file.c_str(), fsType.c_str());
@@ -454,8 +709,13 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
 
 			currentSize = writeFile->fileSize();
 			currentFilename = file;
+			currentSuffix = suffix;
 			eventsWritten = 0;
 			setStatus("");
+
+			if (useAsyncRotate()) {
+				prepareNextSegment(current_time);
+			}
 		}
 	} catch (std::exception const& e) {
 		LOG_OPER("[%s] Failed to create/open file of type <%s> for writing", categoryHandled.c_str(), fsType.c_str());
@@ -472,9 +732,194 @@ bool FileStore::isOpen() {
 }
 
 void FileStore::close() {
+	if (useAsyncRotate()) {
+		discardNextSegment();
+	}
 	if (writeFile) {
 		writeFile->close();
+
+		// Ѿطbufferļдʱɾ, رԺͿɾ
+		if (replayChunkBytes && !currentFilename.empty()) {
+			unsigned long cursor = readCursor(currentFilename);
+			if (cursor && cursor >= writeFile->fileSize()) {
+				writeFile->deleteFile();
+				unlink(makeCursorFilename(currentFilename).c_str());
+			}
+		}
+	}
+}
+
+bool FileStore::useAsyncRotate() {
+	return asyncRotate && !isBufferFile;
+}
+
+// ύ̨ȥһļ(ǰsuffix + 1)
+void FileStore::prepareNextSegment(struct tm* current_time) {
+	string base_filename = makeBaseFilename(current_time);
+	string filename = makeFullFilename(currentSuffix + 1, current_time);
+
+	pthread_mutex_lock(&nextSegment->mutex);
+	while (nextSegment->pending) {
+		pthread_cond_wait(&nextSegment->readyCond, &nextSegment->mutex);
+	}
+	if (nextSegment->file && 0 == nextSegment->filename.compare(filename)) {
+		// Ѿ׼
+		pthread_mutex_unlock(&nextSegment->mutex);
+		return;
+	}
+	pthread_mutex_unlock(&nextSegment->mutex);
+
+	discardNextSegment();
+
+	pthread_mutex_lock(&nextSegment->mutex);
+	nextSegment->pending = true;
+	pthread_mutex_unlock(&nextSegment->mutex);
+
+	g_fileTaskQueue.addTask(shared_ptr<Task> (new PrepareSegmentTask(nextSegment, createWriteFile(filename), filename, base_filename, preallocateSize, categoryHandled)));
+}
+
+// ôдļõFileInterface, ҪѹʱٰһBlockFile
+shared_ptr<FileInterface> FileStore::createWriteFile(const string& filename) {
+	shared_ptr<FileInterface> file = FileInterface::createFileInterface(fsType, filename, isBufferFile, frameChecksum);
+	if (file && (compressionCodec != CODEC_NONE || indexedSegments)) {
+		file = shared_ptr<FileInterface> (new BlockFile(file, filename, compressionCodec, static_cast<int> (compressionLevel), compressionBlockSize, indexedSegments,
+				asyncCompression ? &g_compressTaskQueue : NULL, compressionBlockAge));
+	}
+	return file;
+}
+
+// رպļg_compactorѹʱĲ
+CompactJob FileStore::makeCompactJob(const string& filename) {
+	CompactJob job;
+	job.fsType = fsType;
+	job.filename = filename;
+	job.category = categoryHandled;
+	// ȥ_suffixǴڵļ
+	job.baseFilename = filename.substr(0, filename.rfind('_'));
+	job.level = static_cast<int> (compactLevel);
+	job.blockSize = compressionBlockSize;
+	job.mergeSize = compactMergeSize;
+	return job;
+}
+
+// ȡߺ̨׼õļ. Ѿ(base_filenameͬ), ӵNULL.
+shared_ptr<FileInterface> FileStore::takeNextSegment(const string& base_filename, string& filename) {
+	shared_ptr<FileInterface> file;
+
+	pthread_mutex_lock(&nextSegment->mutex);
+	// û׼͵һ, inline rotateܺͺ̨ͬһļ
+	while (nextSegment->pending) {
+		pthread_cond_wait(&nextSegment->readyCond, &nextSegment->mutex);
+	}
+	if (nextSegment->file && 0 == nextSegment->baseFilename.compare(base_filename)) {
+		file = nextSegment->file;
+		filename = nextSegment->filename;
+		nextSegment->file.reset();
+	}
+	pthread_mutex_unlock(&nextSegment->mutex);
+
+	if (!file) {
+		discardNextSegment();
+	}
+	return file;
+}
+
+// rotate֮ǰ˳ʱ, ̨׼õһļ, findNewestFilefindOldestFileȥ.
+// ʱɾĿļ, ǰһļд
+void FileStore::removeEmptyTrailingSegments(struct tm* current_time) {
+	string base_filename = makeBaseFilename(current_time);
+	int suffix = findNewestFile(base_filename);
+	while (suffix > 0) {
+		string filename = makeFullFilename(suffix, current_time);
+		shared_ptr<FileInterface> file = FileInterface::createFileInterface(fsType, filename);
+		if (!file || 0 == filename.compare(currentFilename) || 0 != file->fileSize()) {
+			break;
+		}
+		LOG_OPER("[%s] Deleting empty trailing file <%s> left by background rotate", categoryHandled.c_str(), filename.c_str());
+		file->deleteFile();
+		int newest = findNewestFile(base_filename);
+		if (newest >= suffix) {
+			// ûɾ
+			break;
+		}
+		suffix = newest;
+	}
+}
+
+// رպ̨׼õûϵļ, ǿյľɾ, ļ¿ն
+void FileStore::discardNextSegment() {
+	shared_ptr<FileInterface> file;
+	string filename;
+
+	pthread_mutex_lock(&nextSegment->mutex);
+	while (nextSegment->pending) {
+		pthread_cond_wait(&nextSegment->readyCond, &nextSegment->mutex);
+	}
+	file = nextSegment->file;
+	filename = nextSegment->filename;
+	nextSegment->file.reset();
+	pthread_mutex_unlock(&nextSegment->mutex);
+
+	if (file) {
+		file->close();
+		if (0 != filename.compare(currentFilename) && 0 == file->fileSize()) {
+			file->deleteFile();
+		}
+	}
+}
+
+bool FileStore::flushOnCheck() {
+	return compressionCodec != CODEC_NONE || indexedSegments;
+}
+
+void FileStore::rotateFile(struct tm *timeinfo) {
+	if (!useAsyncRotate() || !writeFile) {
+		FileStoreBase::rotateFile(timeinfo);
+		return;
+	}
+
+	string next_filename;
+	shared_ptr<FileInterface> next_file = takeNextSegment(makeBaseFilename(timeinfo), next_filename);
+	if (!next_file) {
+		// û׼õļ(׼ʧܻڱ), ֻڵǰ߳rotate
+		FileStoreBase::rotateFile(timeinfo);
+		return;
+	}
+
+	LOG_OPER("[%s] %d:%d rotating file <%s> old size <%lu> max size <%lu> to prepared file <%s>", categoryHandled.c_str(),
+			timeinfo->tm_hour, timeinfo->tm_min, currentFilename.c_str(),
+			currentSize, maxSize, next_filename.c_str());
+
+	// ·ָֻ뽻͸·, رļͳϢ̨߳
+	CompactJob compact_job;
+	if (compactClosed) {
+		compact_job = makeCompactJob(currentFilename);
 	}
+	shared_ptr<Task> retire(new RetireSegmentTask(writeFile, writeMeta ? meta_logfile_prefix + next_filename : string(), fsType, makeStatsFilename(), makeStats(),
+			compactClosed ? &compact_job : NULL));
+	if (createSymlink) {
+		string symlink_name = makeFullSymlink();
+		unlink(symlink_name.c_str());
+		symlink(next_filename.c_str(), symlink_name.c_str());
+	}
+
+	pthread_mutex_lock(&nextSegment->mutex);
+	currentSize = nextSegment->size;
+	pthread_mutex_unlock(&nextSegment->mutex);
+
+	writeFile = next_file;
+	currentFilename = next_filename;
+	++currentSuffix;
+	eventsWritten = 0;
+	if (rollPeriod == ROLL_DAILY) {
+		lastRollTime = timeinfo->tm_mday;
+	} else {
+		lastRollTime = timeinfo->tm_hour;
+	}
+	setStatus("");
+
+	g_fileTaskQueue.addTask(retire);
+	prepareNextSegment(timeinfo);
 }
 
 void FileStore::flush() {
@@ -488,6 +933,22 @@ shared_ptr<Store> FileStore::copy(const std::string &category) {
 	shared_ptr<Store> copied = shared_ptr<Store> (store);
 
 	store->addNewlines = addNewlines;
+	store->asyncRotate = asyncRotate;
+	store->preallocateSize = preallocateSize;
+	store->compressionCodec = compressionCodec;
+	store->compressionLevel = compressionLevel;
+	store->compressionBlockSize = compressionBlockSize;
+	store->compressionBlockAge = compressionBlockAge;
+	store->asyncCompression = asyncCompression;
+	store->indexedSegments = indexedSegments;
+	store->frameChecksum = frameChecksum;
+	store->compactClosed = compactClosed;
+	store->compactLevel = compactLevel;
+	store->compactMergeSize = compactMergeSize;
+	store->replayChunkBytes = replayChunkBytes;
+	store->replayNewestFirst = replayNewestFirst;
+	store->maxAge = maxAge;
+	store->thriftFrames = thriftFrames;
 	store->copyCommon(this);
 	return copied;
 }
@@ -502,6 +963,15 @@ bool FileStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
 	return writeMessages(messages, writeFile);
 }
 
+bool FileStore::handleBatch(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id) {
+	currentBatchId = batch_id;
+	currentSenderId = sender_id.empty() ? localSenderId() : sender_id;
+	bool success = handleMessages(messages);
+	currentBatchId = 0;
+	currentSenderId.clear();
+	return success;
+}
+
 // Ϣдָļ
 bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages, boost::shared_ptr<FileInterface> write_file) {
 	// ȱд뵽, Ȼٵεд.
@@ -510,56 +980,65 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages, boo
 	string write_buffer;
 	unsigned long current_size_buffered = currentSize; // ǰݴС
 
-	for (logentry_vector_t::iterator iter = messages->begin(); iter != messages->end(); ++iter) {
-		// ҪСļһ³. getFrameֻҪϢĳ, bytesToPadҪframeĳȺϢ.
-		unsigned long length = 0;
-		unsigned long message_length = (*iter)->message.length();
-		string frame, category_frame;
-
-		if (addNewlines) {
-			++message_length;
+	if (thriftFrames) {
+		// ϢһLog()֡, طʱԭȥ. batchId, յβٴһ
+		if (!messages->empty()) {
+			encodeLogFrame(*messages, write_buffer, currentBatchId, currentBatchId ? currentSenderId : string());
+			current_size_buffered += write_buffer.length();
 		}
+	} else {
+		for (logentry_vector_t::iterator iter = messages->begin(); iter != messages->end(); ++iter) {
+			// ҪСļһ³. getFrameҪϢ(v2ҪУ), bytesToPadҪframeĳȺϢ.
+			unsigned long length = 0;
+			unsigned long message_length = (*iter)->message.length();
+			string frame, category_frame, category_line;
+
+			if (addNewlines) {
+				++message_length;
+			}
 
-		length += message_length;
+			length += message_length;
 
-		if (writeCategory) {
-			//Ϊcategory+newlinecategory frameԤռ
-			unsigned long category_length = (*iter)->category.length() + 1;
-			length += category_length;
+			if (writeCategory) {
+				//Ϊcategory+newlinecategory frameԤռ
+				category_line = (*iter)->category + "\n";
+				length += category_line.length();
 
-			category_frame = write_file->getFrame(category_length);
-			length += category_frame.length();
-		}
+				category_frame = write_file->getFrame(category_line, string());
+				length += category_frame.length();
+			}
 
-		frame = write_file->getFrame(message_length);
+			// v2ʽframeϢݵУ, Ҫݴȥ
+			frame = write_file->getFrame((*iter)->message, addNewlines ? string("\n") : string());
 
-		length += frame.length();
+			length += frame.length();
 
-		// Ϣchunk
-		unsigned long padding = bytesToPad(length, current_size_buffered, chunkSize);
+			// Ϣchunk
+			unsigned long padding = bytesToPad(length, current_size_buffered, chunkSize);
 
-		length += padding;
+			length += padding;
 
-		if (padding) {
-			write_buffer += string(padding, 0);
-		}
+			if (padding) {
+				write_buffer += string(padding, 0);
+			}
 
-		if (writeCategory) {
-			write_buffer += category_frame;
-			write_buffer += (*iter)->category + "\n";
-		}
+			if (writeCategory) {
+				write_buffer += category_frame;
+				write_buffer += category_line;
+			}
 
-		write_buffer += frame;
-		write_buffer += (*iter)->message;
+			write_buffer += frame;
+			write_buffer += (*iter)->message;
 
-		if (addNewlines) {//Ҫӻз
-			write_buffer += "\n";
-		}
+			if (addNewlines) {//Ҫӻз
+				write_buffer += "\n";
+			}
 
-		current_size_buffered += length;
+			current_size_buffered += length;
+		}
 	}
 
-	if (!write_file->write(write_buffer)) {
+	if (!write_file->writeRecords(write_buffer, messages->size())) {
 		LOG_OPER("[%s] File store failed to write (%u) messages to file", categoryHandled.c_str(), messages->size());
 		setStatus("File write error");
 		close();
@@ -581,7 +1060,13 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages, boo
 }
 
 void FileStore::deleteOldest(struct tm* now) {
-	int index = findOldestFile(makeBaseFilename(now));
+	if (replayChunkBytes) {
+		if (!replayFilename.empty()) {
+			advanceCursor(replayEndOffset);
+		}
+		return;
+	}
+	int index = findReplayFile(now);
 	if (index < 0) {
 		return;
 	}
@@ -591,8 +1076,20 @@ void FileStore::deleteOldest(struct tm* now) {
 
 // øʱϢ滻ǰļеϢ.
 bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages, struct tm* now) {
+	if (replayChunkBytes) {
+		// ʣµϢһζϢĺһ, α˻صһûȥϢ
+		if (replayFilename.empty() || messages->size() > replayOffsets.size()) {
+			LOG_OPER("[%s] Can not rewind replay cursor for <%u> messages", categoryHandled.c_str(), messages->size());
+			return false;
+		}
+		unsigned long sent = replayOffsets.size() - messages->size();
+		replayAtEnd = false;
+		advanceCursor(sent ? replayOffsets[sent - 1] : replayStartOffset);
+		return true;
+	}
+
 	string base_name = makeBaseFilename(now);
-	int index = findOldestFile(base_name);
+	int index = findReplayFile(now);
 	if (index < 0) {
 		LOG_OPER("[%s] Could not find files <%s>", categoryHandled.c_str(), base_name.c_str());
 		return false;
@@ -604,7 +1101,7 @@ bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages, str
 	close();
 
 	// ɾļ, ȻٴдϢ
-	shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType, filename, isBufferFile);
+	shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType, filename, isBufferFile, frameChecksum);
 	infile->deleteFile();
 
 	bool success;
@@ -623,13 +1120,27 @@ bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages, str
 }
 
 bool FileStore::readOldest(/*out*/boost::shared_ptr<logentry_vector_t> messages, struct tm* now) {
-	int index = findOldestFile(makeBaseFilename(now));
+	if (replayChunkBytes) {
+		return readOldestChunk(messages, now);
+	}
+
+	int index = findUnexpiredReplayFile(now);
 	if (index < 0) {
 		//ûļ, Ǿֱӷ
 		return true;
 	}
 	std::string filename = makeFullFilename(index, now);
 
+	if (thriftFrames) {
+		LogFrameRegion region;
+		bool at_end = false;
+		if (!readLogFrames(filename, 0, 0, region, at_end, messages.get())) {
+			return false;
+		}
+		LOG_OPER("[%s] successfully read <%u> entries from file <%s>", categoryHandled.c_str(), messages->size(), filename.c_str());
+		return true;
+	}
+
 	shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType, filename, isBufferFile);
 
 	if (!infile->openRead()) {
@@ -673,13 +1184,303 @@ bool FileStore::empty(struct tm* now) {
 		if (-1 != suffix) {
 			std::string fullname = makeFullFilename(suffix, now);
 			shared_ptr<FileInterface> file = FileInterface::createFileInterface(fsType, fullname);
-			if (file->fileSize()) {
+			// α֮ǰϢѾȥ
+			if (file->fileSize() > readCursor(fullname)) {
 				return false;
 			}
 		} // else ûҵƥ䵱ǰstoreļ
 	}
 	return true;
 }
+
+// ϵļα괦ʼ, replayChunkBytesֽڵϢ, ÿϢλ.
+// αҪdeleteOldestreplaceOldestʱƶ, ʧܻ߽˳ᶪϢ.
+bool FileStore::readOldestChunk(boost::shared_ptr<logentry_vector_t> messages, struct tm* now) {
+	replayFilename.clear();
+	replayOffsets.clear();
+	replayAtEnd = false;
+
+	int index = findUnexpiredReplayFile(now);
+	if (index < 0) {
+		return true;
+	}
+	string filename = makeFullFilename(index, now);
+	unsigned long cursor = readCursor(filename);
+
+	if (thriftFrames) {
+		LogFrameRegion region;
+		if (!readLogFrames(filename, cursor, replayChunkBytes, region, replayAtEnd, messages.get())) {
+			return false;
+		}
+		replayFilename = filename;
+		replayStartOffset = cursor;
+		replayEndOffset = cursor + region.bytes();
+		// αֻͣ֡ı߽, ֡мϢûȥʱreplaceOldest˻ص֡Ŀͷ, ֡ط
+		for (unsigned long i = 0; i < region.frameEnds.size(); ++i) {
+			for (unsigned j = 0; j < region.frameMessages[i]; ++j) {
+				replayOffsets.push_back(j + 1 == region.frameMessages[i] ? region.frameEnds[i] : region.frameStart(i));
+			}
+		}
+		LOG_OPER("[%s] read <%u> entries from file <%s> at offset <%lu>", categoryHandled.c_str(), messages->size(), filename.c_str(), cursor);
+		return true;
+	}
+
+	shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType, filename, isBufferFile);
+	if (!infile->openRead()) {
+		LOG_OPER("[%s] Failed to open file <%s> for reading", categoryHandled.c_str(), filename.c_str());
+		return false;
+	}
+	if (cursor && !infile->seek(cursor)) {
+		LOG_OPER("[%s] Failed to seek to <%lu> in file <%s>", categoryHandled.c_str(), cursor, filename.c_str());
+		infile->close();
+		return false;
+	}
+
+	replayFilename = filename;
+	replayStartOffset = cursor;
+	replayEndOffset = cursor;
+	replayAtEnd = true;
+
+	unsigned long bytes = 0;
+	std::string message;
+	while (bytes < replayChunkBytes) {
+		if (!infile->readNext(message)) {
+			break;
+		}
+		if (!message.empty()) {
+			logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
+
+			if (writeCategory) {
+				entry->category = message.substr(0, message.length() - 1);
+
+				if (!infile->readNext(message)) {
+					// дһϢ, ´ٶ
+					LOG_OPER("[%s] category not stored with message <%s>", categoryHandled.c_str(), entry->category.c_str());
+					break;
+				}
+			} else {
+				entry->category = categoryHandled;
+			}
+			entry->message = message;
+			bytes += message.length();
+
+			messages->push_back(entry);
+			replayOffsets.push_back(infile->tell());
+		}
+		replayEndOffset = infile->tell();
+	}
+	if (bytes >= replayChunkBytes) {
+		replayAtEnd = false;
+	}
+	infile->close();
+
+	LOG_OPER("[%s] read <%u> entries from file <%s> at offset <%lu>", categoryHandled.c_str(), messages->size(), filename.c_str(), cursor);
+	return true;
+}
+
+// fifoʱϵļ. lifoʱµļ, дļҪȱļٷ, һдһ߶
+int FileStore::findReplayFile(struct tm* now) {
+	string base_filename = makeBaseFilename(now);
+	if (!replayNewestFirst) {
+		return findOldestFile(base_filename);
+	}
+
+	std::vector<std::string> files = FileInterface::list(filePath, fsType);
+	int newest = -1;
+	int writing = -1;
+	for (std::vector<std::string>::iterator iter = files.begin(); iter != files.end(); ++iter) {
+		int suffix = getFileSuffix(*iter, base_filename);
+		if (suffix < 0) {
+			continue;
+		}
+		if (isOpen() && 0 == makeFullFilename(suffix, now).compare(currentFilename)) {
+			writing = suffix;
+		} else if (suffix > newest) {
+			newest = suffix;
+		}
+	}
+	return newest >= 0 ? newest : writing;
+}
+
+int FileStore::findUnexpiredReplayFile(struct tm* now) {
+	while (true) {
+		int index = findReplayFile(now);
+		if (index < 0 || !maxAge || !expireFile(makeFullFilename(index, now))) {
+			return index;
+		}
+	}
+}
+
+// ļ޸ĵʱж, öļ. α֮ǰѾȥĲֲexpired bytes
+bool FileStore::expireFile(const string& filename) {
+	if (isOpen() && 0 == filename.compare(currentFilename)) {
+		return false;
+	}
+	struct stat st;
+	if (0 != stat(filename.c_str(), &st) || time(NULL) - st.st_mtime <= (time_t) maxAge) {
+		return false;
+	}
+
+	unsigned long cursor = readCursor(filename);
+	unsigned long bytes = (unsigned long) st.st_size > cursor ? st.st_size - cursor : 0;
+	LOG_OPER("[%s] Dropping expired buffer file <%s>, <%lu> bytes not replayed", categoryHandled.c_str(), filename.c_str(), bytes);
+	shared_ptr<FileInterface> deletefile = FileInterface::createFileInterface(fsType, filename);
+	deletefile->deleteFile();
+	if (0 == stat(filename.c_str(), &st)) {
+		// ɾ(ûȨ)ճط, ߻һֱҵͬһļ
+		LOG_OPER("[%s] ERROR: failed to delete expired buffer file <%s>, replaying it", categoryHandled.c_str(), filename.c_str());
+		return false;
+	}
+	unlink(makeCursorFilename(filename).c_str());
+
+	g_Handler->incrementCounter("expired segments");
+	g_Handler->incrementCounter("expired bytes", bytes);
+	return true;
+}
+
+bool FileStore::hasLogFrames() {
+	return thriftFrames && replayChunkBytes;
+}
+
+// readOldestChunkһ, ֻɨ֡ͷ, ϢprimaryֱӴļȥ
+bool FileStore::readOldestFrames(LogFrameRegion& region, struct tm* now) {
+	replayFilename.clear();
+	replayOffsets.clear();
+	replayAtEnd = false;
+	region = LogFrameRegion();
+
+	int index = findUnexpiredReplayFile(now);
+	if (index < 0) {
+		return true;
+	}
+	string filename = makeFullFilename(index, now);
+	unsigned long cursor = readCursor(filename);
+
+	if (!readLogFrames(filename, cursor, replayChunkBytes, region, replayAtEnd, NULL)) {
+		return false;
+	}
+	replayFilename = filename;
+	replayStartOffset = cursor;
+	replayEndOffset = cursor + region.bytes();
+	replayOffsets = region.frameEnds;
+	return true;
+}
+
+void FileStore::consumeOldestFrames(unsigned long frames, struct tm* now) {
+	if (replayFilename.empty() || frames > replayOffsets.size()) {
+		return;
+	}
+	advanceCursor(frames ? replayOffsets[frames - 1] : replayStartOffset);
+}
+
+// ɨbuffer_format=thriftļoffsetʼ֡, max_bytesֽ(0ʾ), һ֡.
+// messagesΪNULLʱͬʱϢ. at_endغǷ֡.
+// дһ֡: дļ´ٶ, ļ(дʱ)ļĽβ. 𻵵֡Ҳβ, ݶ
+bool FileStore::readLogFrames(const string& filename, unsigned long offset, unsigned long max_bytes, LogFrameRegion& region, bool& at_end, logentry_vector_t* messages) {
+	region = LogFrameRegion();
+	region.filename = filename;
+	region.offset = offset;
+	at_end = false;
+
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOG_OPER("[%s] Failed to open file <%s> for reading", categoryHandled.c_str(), filename.c_str());
+		return false;
+	}
+	struct stat st;
+	if (0 != fstat(fd, &st)) {
+		LOG_OPER("[%s] Failed to stat file <%s>", categoryHandled.c_str(), filename.c_str());
+		::close(fd);
+		return false;
+	}
+	unsigned long file_size = st.st_size;
+	bool writing = isOpen() && 0 == filename.compare(currentFilename);
+
+	unsigned long end = offset;
+	char header[LOG_FRAME_HEADER_SIZE];
+	string frame;
+	while (!max_bytes || end - offset < max_bytes) {
+		if (end >= file_size) {
+			at_end = true;
+			break;
+		}
+		unsigned long frame_bytes = 0;
+		unsigned num_messages = 0;
+		bool partial = end + LOG_FRAME_HEADER_SIZE > file_size;
+		bool valid = partial || (LOG_FRAME_HEADER_SIZE == pread(fd, header, LOG_FRAME_HEADER_SIZE, end) && parseLogFrameHeader(header, frame_bytes, num_messages));
+		if (valid && !partial && end + frame_bytes > file_size) {
+			partial = true;
+		}
+		if (valid && !partial && messages) {
+			frame.resize(frame_bytes);
+			valid = (ssize_t) frame_bytes == pread(fd, &frame[0], frame_bytes, end) && decodeLogFrame(frame, *messages);
+		}
+		if (partial && writing) {
+			break;
+		}
+		if (partial || !valid) {
+			LOG_OPER("[%s] WARNING: %s frame at offset <%lu> in file <%s>, dropping <%lu> bytes", categoryHandled.c_str(), partial ? "truncated" : "corrupted", end, filename.c_str(), file_size - end);
+			at_end = true;
+			break;
+		}
+		end += frame_bytes;
+		region.frameEnds.push_back(end);
+		region.frameMessages.push_back(num_messages);
+	}
+	::close(fd);
+	return true;
+}
+
+// ϴreadOldestChunkļαƵoffset, ļ˾ɾ.
+// дļɾ, closeʱɾ.
+void FileStore::advanceCursor(unsigned long offset) {
+	bool writing = isOpen() && 0 == replayFilename.compare(currentFilename);
+	if (replayAtEnd && offset == replayEndOffset && !writing) {
+		shared_ptr<FileInterface> deletefile = FileInterface::createFileInterface(fsType, replayFilename);
+		deletefile->deleteFile();
+		unlink(makeCursorFilename(replayFilename).c_str());
+	} else if (offset != readCursor(replayFilename)) {
+		writeCursor(replayFilename, offset);
+	}
+	replayFilename.clear();
+	replayOffsets.clear();
+}
+
+string FileStore::makeCursorFilename(const string& filename) {
+	return filename + ".cursor";
+}
+
+// ûαļʱ0
+unsigned long FileStore::readCursor(const string& filename) {
+	unsigned long offset = 0;
+	ifstream in(makeCursorFilename(filename).c_str());
+	if (in.good()) {
+		in >> offset;
+		if (in.fail()) {
+			offset = 0;
+		}
+	}
+	return offset;
+}
+
+// дʱļrename, αļдһ
+bool FileStore::writeCursor(const string& filename, unsigned long offset) {
+	string cursor_filename = makeCursorFilename(filename);
+	string tmp_filename = cursor_filename + ".tmp";
+	{
+		ofstream out(tmp_filename.c_str(), ios_base::out | ios_base::trunc);
+		out << offset << endl;
+		if (out.fail()) {
+			LOG_OPER("[%s] Failed to write replay cursor <%s>", categoryHandled.c_str(), tmp_filename.c_str());
+			return false;
+		}
+	}
+	if (0 != rename(tmp_filename.c_str(), cursor_filename.c_str())) {
+		LOG_OPER("[%s] Failed to rename replay cursor <%s>", categoryHandled.c_str(), cursor_filename.c_str());
+		return false;
+	}
+	return true;
+}
 /* End of FileStore */
 
 /* Start of ThriftFileStore */
@@ -843,16 +1644,28 @@ BufferStore::BufferStore(const string& category, bool multi_category) :
 	Store(category, "buffer", multi_category), maxQueueLength(DEFAULT_BUFFERSTORE_MAX_QUEUE_LENGTH),
 	bufferSendRate(DEFAULT_BUFFERSTORE_SEND_RATE),
 	avgRetryInterval(DEFAULT_BUFFERSTORE_AVG_RETRY_INTERVAL),
-	retryIntervalRange(DEFAULT_BUFFERSTORE_RETRY_INTERVAL_RANGE),
-	state(DISCONNECTED) {
+	retryIntervalRange(DEFAULT_BUFFERSTORE_RETRY_INTERVAL_RANGE), concurrentReplay(false), scheduledReplay(false), replayPriority(0),
+	memoryBufferBytes(0), memoryBufferMaxOutage(DEFAULT_BUFFERSTORE_MEMORY_MAX_OUTAGE), probeInitialMs(0),
+	probeMaxMs(DEFAULT_BUFFERSTORE_PROBE_MAX_INTERVAL), state(DISCONNECTED), memoryBuffer(new logentry_vector_t), memoryBufferSize(0), outageStart(0),
+	backlogSince(0), probeIntervalMs(0), nextProbeTime(0), replayThreadRunning(false), stopReplay(false), replayFailed(false), replayScheduled(false) {
 
 	time(&lastWriteTime);
 	time(&lastOpenAttempt);
 	srand(lastWriteTime);
 	retryInterval = getNewRetryInterval();
+
+	pthread_mutex_init(&primaryMutex, NULL);
+	pthread_mutex_init(&secondaryMutex, NULL);
+	pthread_mutex_init(&replayMutex, NULL);
+	pthread_cond_init(&replayCond, NULL);
 }
 
 BufferStore::~BufferStore() {
+	stopReplayThread();
+	pthread_mutex_destroy(&primaryMutex);
+	pthread_mutex_destroy(&secondaryMutex);
+	pthread_mutex_destroy(&replayMutex);
+	pthread_cond_destroy(&replayCond);
 }
 
 void BufferStore::configure(pStoreConf configuration) {
@@ -862,6 +1675,45 @@ void BufferStore::configure(pStoreConf configuration) {
 	configuration->getUnsigned("retry_interval", (unsigned long&) avgRetryInterval);
 	configuration->getUnsigned("retry_interval_range", (unsigned long&) retryIntervalRange);
 
+	string tmp;
+	if (configuration->getString("replay_mode", tmp)) {
+		if (0 == tmp.compare("concurrent")) {
+			concurrentReplay = true;
+		} else if (0 == tmp.compare("scheduled")) {
+			concurrentReplay = true;
+			scheduledReplay = true;
+		} else if (0 != tmp.compare("serial")) {
+			LOG_OPER("[%s] WARNING: Bad config - unknown replay_mode <%s>, using serial", categoryHandled.c_str(), tmp.c_str());
+		}
+	}
+	unsigned long replay_bytes_per_sec = 0;
+	if (configuration->getUnsigned("replay_bytes_per_sec", replay_bytes_per_sec)) {
+		replayLimiter.setRate(replay_bytes_per_sec);
+	}
+	// fresh_firstҪϢֱӷprimary, Ҳconcurrentط
+	string replay_order;
+	if (configuration->getString("replay_order", replay_order)) {
+		if (0 == replay_order.compare("fresh_first")) {
+			concurrentReplay = true;
+		} else if (0 != replay_order.compare("fifo") && 0 != replay_order.compare("lifo")) {
+			LOG_OPER("[%s] WARNING: Bad config - unknown replay_order <%s>, using fifo", categoryHandled.c_str(), replay_order.c_str());
+			replay_order.clear();
+		}
+	}
+	long priority = 0;
+	if (configuration->getInt("replay_priority", priority)) {
+		replayPriority = (int) priority;
+	}
+	configuration->getUnsigned("memory_buffer_bytes", memoryBufferBytes);
+	configuration->getUnsigned("memory_buffer_max_outage", (unsigned long&) memoryBufferMaxOutage);
+	configuration->getUnsigned("probe_interval_ms", probeInitialMs);
+	configuration->getUnsigned("probe_max_interval_ms", probeMaxMs);
+
+	if (probeInitialMs && probeMaxMs < probeInitialMs) {
+		LOG_OPER("[%s] Bad config - probe_max_interval_ms must not be less than probe_interval_ms. Using <%lu> instead of <%lu>", categoryHandled.c_str(), probeInitialMs, probeMaxMs);
+		probeMaxMs = probeInitialMs;
+	}
+
 	if (retryIntervalRange > avgRetryInterval) {
 		LOG_OPER("[%s] Bad config - retry_interval_range must be less than retry_interval. Using <%d> as range instead of <%d>", categoryHandled.c_str(), (int)avgRetryInterval, (int)retryIntervalRange);
 		retryIntervalRange = avgRetryInterval;
@@ -879,6 +1731,18 @@ void BufferStore::configure(pStoreConf configuration) {
 			setStatus(msg);
 			cout << msg << endl;
 		} else {
+			// طʱsecondaryһдһ߶, ֻаαطŲŲɾдļ
+			unsigned long chunk_bytes = 0;
+			if (concurrentReplay && (!secondary_store_conf->getUnsigned("replay_chunk_bytes", chunk_bytes) || !chunk_bytes)) {
+				secondary_store_conf->setUnsigned("replay_chunk_bytes", DEFAULT_BUFFERSTORE_REPLAY_CHUNK_BYTES);
+			}
+			if (!replay_order.empty()) {
+				secondary_store_conf->setString("replay_order", 0 == replay_order.compare("fifo") ? "fifo" : "lifo");
+			}
+			unsigned long max_age = 0, secondary_max_age = 0;
+			if (configuration->getUnsigned("max_age", max_age) && !secondary_store_conf->getUnsigned("max_age", secondary_max_age)) {
+				secondary_store_conf->setUnsigned("max_age", max_age);
+			}
 			secondaryStore = createStore(type, categoryHandled, true, multiCategory);
 			secondaryStore->configure(secondary_store_conf);
 		}
@@ -915,39 +1779,77 @@ void BufferStore::configure(pStoreConf configuration) {
 }
 
 bool BufferStore::isOpen() {
-	return primaryStore->isOpen() || secondaryStore->isOpen();
+	pthread_mutex_lock(&primaryMutex);
+	bool primary_open = primaryStore->isOpen();
+	pthread_mutex_unlock(&primaryMutex);
+
+	pthread_mutex_lock(&secondaryMutex);
+	bool secondary_open = secondaryStore->isOpen();
+	pthread_mutex_unlock(&secondaryMutex);
+
+	return primary_open || secondary_open;
 }
 
 bool BufferStore::open() {
 	// ԴprimaryStore, Ӧ״̬
-	if (primaryStore->open()) {
+	pthread_mutex_lock(&primaryMutex);
+	bool primary_open = primaryStore->open();
+	pthread_mutex_unlock(&primaryMutex);
+
+	if (primary_open) {
 		// ֮ת״̬Ϊ˷ֹǰһʵļûз
-		changeState(SENDING_BUFFER);
+		// طʱļط߳ȥ
+		changeState(concurrentReplay ? STREAMING : SENDING_BUFFER);
 	} else {
+		pthread_mutex_lock(&secondaryMutex);
 		secondaryStore->open();
+		pthread_mutex_unlock(&secondaryMutex);
 		changeState(DISCONNECTED);
 	}
+
+	if (concurrentReplay) {
+		startReplayThread();
+	}
 	return isOpen();
 }
 
 void BufferStore::close() {
+	stopReplayThread();
+
+	pthread_mutex_lock(&primaryMutex);
 	if (primaryStore->isOpen()) {
 		primaryStore->flush();
 		primaryStore->close();
 	}
+	pthread_mutex_unlock(&primaryMutex);
+
+	pthread_mutex_lock(&secondaryMutex);
+	// ڴﻹûȥϢܶ
+	if (!memoryBuffer->empty()) {
+		if (!secondaryStore->isOpen()) {
+			secondaryStore->open();
+		}
+		spillMemoryBuffer();
+	}
 	if (secondaryStore->isOpen()) {
 		secondaryStore->flush();
 		secondaryStore->close();
 	}
+	pthread_mutex_unlock(&secondaryMutex);
 }
 
 void BufferStore::flush() {
+	pthread_mutex_lock(&primaryMutex);
 	if (primaryStore->isOpen()) {
 		primaryStore->flush();
 	}
+	pthread_mutex_unlock(&primaryMutex);
+
+	pthread_mutex_lock(&secondaryMutex);
 	if (secondaryStore->isOpen()) {
 		secondaryStore->flush();
 	}
+	pthread_mutex_unlock(&secondaryMutex);
 }
 
 shared_ptr<Store> BufferStore::copy(const std::string &category) {
@@ -958,6 +1860,14 @@ shared_ptr<Store> BufferStore::copy(const std::string &category) {
 	store->bufferSendRate = bufferSendRate;
 	store->avgRetryInterval = avgRetryInterval;
 	store->retryIntervalRange = retryIntervalRange;
+	store->concurrentReplay = concurrentReplay;
+	store->scheduledReplay = scheduledReplay;
+	store->replayPriority = replayPriority;
+	store->replayLimiter.setRate(replayLimiter.getRate());
+	store->memoryBufferBytes = memoryBufferBytes;
+	store->memoryBufferMaxOutage = memoryBufferMaxOutage;
+	store->probeInitialMs = probeInitialMs;
+	store->probeMaxMs = probeMaxMs;
 
 	store->primaryStore = primaryStore->copy(category);
 	store->secondaryStore = secondaryStore->copy(category);
@@ -965,6 +1875,15 @@ shared_ptr<Store> BufferStore::copy(const std::string &category) {
 }
 
 bool BufferStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
+	return handleBatch(messages, usesBatchIds() ? newBatchId() : 0, "");
+}
+
+bool BufferStore::usesBatchIds() {
+	return primaryStore && primaryStore->usesBatchIds();
+}
+
+// primaryStoreͳʱοʵѾ, secondaryStoreʱͬһbatchId, طʱϳ
+bool BufferStore::handleBatch(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id) {
 	time_t now;
 	time(&now);
 	lastWriteTime = now;
@@ -977,24 +1896,42 @@ bool BufferStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages)
 	}
 
 	if (state == STREAMING) {
-		if (primaryStore->handleMessages(messages)) {
+		pthread_mutex_lock(&primaryMutex);
+		bool success = primaryStore->handleBatch(messages, batch_id, sender_id);
+		pthread_mutex_unlock(&primaryMutex);
+		if (success) {
 			return true;
 		} else {
-			changeState(DISCONNECTED);
+			primaryFailed();
+		}
+	}
+
+	if (state == MEMORY_BUFFERING) {
+		if (bufferInMemory(messages)) {
+			return true;
 		}
+		LOG_OPER("[%s] BufferStore memory buffer full (%lu bytes), switching to secondary store", categoryHandled.c_str(), memoryBufferSize);
+		changeState(DISCONNECTED);
 	}
 
 	if (state != STREAMING) {
-		return secondaryStore->handleMessages(messages);
+		pthread_mutex_lock(&secondaryMutex);
+		bool success = secondaryStore->handleBatch(messages, batch_id, sender_id);
+		pthread_mutex_unlock(&secondaryMutex);
+		return success;
 	}
 	return false;
 }
 
 // ״̬ת
 void BufferStore::changeState(buffer_state_t new_state) {
+	pthread_mutex_lock(&secondaryMutex);
 	switch (state) {
 	case STREAMING:
-		secondaryStore->open();
+		// ڴ滺ʱòsecondary
+		if (new_state != MEMORY_BUFFERING) {
+			secondaryStore->open();
+		}
 		break;
 	case DISCONNECTED:
 		// 뿪ǰ״̬֮ǰĴ.
@@ -1006,6 +1943,11 @@ void BufferStore::changeState(buffer_state_t new_state) {
 		break;
 	}
 
+	// 뿪STREAMING֮Ϣʼѹsecondary
+	if (state == STREAMING && new_state != STREAMING && !backlogSince) {
+		time(&backlogSince);
+	}
+
 	// µ״̬
 	switch (new_state) {
 	case STREAMING:
@@ -1015,6 +1957,11 @@ void BufferStore::changeState(buffer_state_t new_state) {
 		g_Handler->incrementCounter("retries");
 		time(&lastOpenAttempt);
 		retryInterval = getNewRetryInterval();
+		// նϿʱοܺܿͻָ, ̵̽ļʼ
+		if (probeInitialMs && state != DISCONNECTED) {
+			probeIntervalMs = probeInitialMs;
+			scheduleProbe();
+		}
 		if (!secondaryStore->isOpen()) {
 			secondaryStore->open();
 		}
@@ -1024,90 +1971,475 @@ void BufferStore::changeState(buffer_state_t new_state) {
 			secondaryStore->open();
 		}
 		break;
+	case MEMORY_BUFFERING:
+		time(&outageStart);
+		break;
 	default:
 		break;
 	}
 
+	// ڴ滺primaryûָ, ڴϢҪ֮Ϣдsecondary
+	if (new_state == DISCONNECTED && !memoryBuffer->empty()) {
+		spillMemoryBuffer();
+	}
+
 	LOG_OPER("[%s] Changing state from <%s> to <%s>", categoryHandled.c_str(), stateAsString(state), stateAsString(new_state));
+	if (state != new_state) {
+		g_Handler->incrementCounter(string("buffer state ") + stateAsString(new_state));
+	}
+	pthread_mutex_lock(&replayMutex);
 	state = new_state;
+	// STREAMINGʱط߳
+	pthread_cond_broadcast(&replayCond);
+	pthread_mutex_unlock(&replayMutex);
+	pthread_mutex_unlock(&secondaryMutex);
 }
 
 void BufferStore::periodicCheck() {
+	pthread_mutex_lock(&primaryMutex);
 	primaryStore->periodicCheck();
+	pthread_mutex_unlock(&primaryMutex);
+
+	pthread_mutex_lock(&secondaryMutex);
 	secondaryStore->periodicCheck();
+	pthread_mutex_unlock(&secondaryMutex);
+
+	time_t now;
+	struct tm* nowinfo;
+	time(&now);
+	nowinfo = localtime(&now);
+
+	// ط̷߳ʧ, ˵primary
+	if (concurrentReplay) {
+		pthread_mutex_lock(&replayMutex);
+		bool failed = replayFailed;
+		replayFailed = false;
+		pthread_mutex_unlock(&replayMutex);
+		if (failed && state == STREAMING) {
+			primaryFailed();
+		}
+	}
+	if (scheduledReplay && state == STREAMING) {
+		scheduleReplay(nowinfo);
+	}
+
+	if (state == MEMORY_BUFFERING) {
+		if (now - outageStart > memoryBufferMaxOutage) {
+			LOG_OPER("[%s] primary store down for more than <%d> seconds, switching to secondary store", categoryHandled.c_str(), (int) memoryBufferMaxOutage);
+			changeState(DISCONNECTED);
+		} else if (flushMemoryBuffer()) {
+			changeState(STREAMING);
+		}
+	}
+
+	//ΪϿ, ǾretryInterval֮ٳprimaryStore->open()
+	//̽Ļ, ˱ܼ̽, һָopen
+	if (state == DISCONNECTED && probeInitialMs) {
+		if (currentTimeMs() >= nextProbeTime) {
+			bool primary_open = false;
+			if (probePrimary()) {
+				pthread_mutex_lock(&primaryMutex);
+				primary_open = primaryStore->open();
+				pthread_mutex_unlock(&primaryMutex);
+			}
+			if (primary_open) {
+				changeState(concurrentReplay ? STREAMING : SENDING_BUFFER);
+			} else {
+				scheduleProbe();
+			}
+		}
+	} else if (state == DISCONNECTED) {
+		if (now - lastOpenAttempt > retryInterval) {
+			pthread_mutex_lock(&primaryMutex);
+			bool primary_open = primaryStore->open();
+			pthread_mutex_unlock(&primaryMutex);
+			if (primary_open) {
+				changeState(concurrentReplay ? STREAMING : SENDING_BUFFER);
+			} else {
+				// retryʱ
+				changeState(DISCONNECTED);
+			}
+		}
+	}
+
+	if (state == SENDING_BUFFER) {
+		// secondary storeȡһϢ͸primary store.
+		// primary storeæ,ܻ᷵ Ժ, ҲһԶ̫Ϣ.
+		// secondary storeһļ, ôϢmax file size.
+		unsigned sent = 0;
+		// ÿֻbufferSendRateôbufferļ
+		for (sent = 0; sent < bufferSendRate; ++sent) {
+			unsigned long bytes = 0;
+			replay_result_t result = replayStep(nowinfo, bytes);
+			if (result == REPLAY_FAILED) {
+				changeState(DISCONNECTED);
+				break;
+			} else if (result == REPLAY_ERROR) {
+				break;
+			}
+
+			// bufferϢ,break
+			if (backlogEmpty(nowinfo)) {
+				LOG_OPER("[%s] No more buffer files to send, switching to streaming mode", categoryHandled.c_str());
+				changeState(STREAMING);
+
+				pthread_mutex_lock(&primaryMutex);
+				primaryStore->flush();
+				pthread_mutex_unlock(&primaryMutex);
+				break;
+			}
+		}
+	}// if state == SENDING_BUFFER
+}
+
+// secondaryһϢprimary. ֻڷprimary/secondaryʱжӦ, ԿԺStoreQueueִ̲߳.
+BufferStore::replay_result_t BufferStore::replayStep(struct tm* now, unsigned long& bytes) {
+	if (secondaryStore->hasLogFrames() && primaryStore->canSendFrames()) {
+		return replayFrames(now, bytes);
+	}
+
+	bytes = 0;
+	boost::shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
+
+	//Ϣ
+	pthread_mutex_lock(&secondaryMutex);
+	bool read_ok = secondaryStore->readOldest(messages, now);
+	pthread_mutex_unlock(&secondaryMutex);
+	if (!read_ok) {
+		// Ͳ̫
+		setStatus("Failed to read from secondary store");
+		LOG_OPER("[%s] WARNING: buffer store can't read from secondary store", categoryHandled.c_str());
+		return REPLAY_ERROR;
+	}
+	time(&lastWriteTime);
+
+	unsigned long size = messages->size();
+	if (!size) {
+		// ûϢҪת, bufferϢļΪղſܳ
+		pthread_mutex_lock(&secondaryMutex);
+		secondaryStore->deleteOldest(now);
+		pthread_mutex_unlock(&secondaryMutex);
+		return REPLAY_OK;
+	}
+	for (logentry_vector_t::iterator iter = messages->begin(); iter != messages->end(); ++iter) {
+		bytes += (*iter)->message.length();
+	}
+
+	//ϢǾprimaryStoreȥ
+	pthread_mutex_lock(&primaryMutex);
+	bool success = primaryStore->handleMessages(messages);
+	pthread_mutex_unlock(&primaryMutex);
+
+	pthread_mutex_lock(&secondaryMutex);
+	if (success) {
+		//ɹ,͸ɵϢ
+		secondaryStore->deleteOldest(now);
+	} else if (messages->size() != size) {
+		// ֻһϢ, ֻðⲿϢٷŻȥ
+		LOG_OPER("[%s] buffer store primary store processed %lu/%lu messages", categoryHandled.c_str(), size - messages->size(), size);
+
+		if (!secondaryStore->replaceOldest(messages, now)) {
+			// ݱȥ,ֻñ˵ݶʧ
+			LOG_OPER("[%s] buffer store secondary store lost %u messages", categoryHandled.c_str(), messages->size());
+			g_Handler->incrementCounter("lost", messages->size());
+			secondaryStore->deleteOldest(now);
+		}
+	}
+	pthread_mutex_unlock(&secondaryMutex);
+
+	return success ? REPLAY_OK : REPLAY_FAILED;
+}
+
+// replayStepһ, secondaryõ֡, primaryֱӴļдsocket
+BufferStore::replay_result_t BufferStore::replayFrames(struct tm* now, unsigned long& bytes) {
+	bytes = 0;
+	LogFrameRegion region;
+
+	pthread_mutex_lock(&secondaryMutex);
+	bool read_ok = secondaryStore->readOldestFrames(region, now);
+	pthread_mutex_unlock(&secondaryMutex);
+	if (!read_ok) {
+		setStatus("Failed to read from secondary store");
+		LOG_OPER("[%s] WARNING: buffer store can't read from secondary store", categoryHandled.c_str());
+		return REPLAY_ERROR;
+	}
+	time(&lastWriteTime);
+
+	unsigned long frames = region.frameEnds.size();
+	unsigned long sent = 0;
+	bool success = true;
+	if (frames) {
+		bytes = region.bytes();
+		pthread_mutex_lock(&primaryMutex);
+		success = primaryStore->sendFrames(region, sent);
+		pthread_mutex_unlock(&primaryMutex);
+		if (!success && sent) {
+			LOG_OPER("[%s] buffer store primary store processed %lu/%lu frames", categoryHandled.c_str(), sent, frames);
+		}
+	}
+
+	// û֡ʱҲҪ, ļѾ˾ɾ
+	pthread_mutex_lock(&secondaryMutex);
+	secondaryStore->consumeOldestFrames(success ? frames : sent, now);
+	pthread_mutex_unlock(&secondaryMutex);
+
+	return success ? REPLAY_OK : REPLAY_FAILED;
+}
+
+void BufferStore::primaryFailed() {
+	changeState(memoryBufferBytes ? MEMORY_BUFFERING : DISCONNECTED);
+}
+
+// ŵ¾׷ӵڴ滺, Ų·false
+bool BufferStore::bufferInMemory(boost::shared_ptr<logentry_vector_t> messages) {
+	unsigned long bytes = 0;
+	for (logentry_vector_t::iterator iter = messages->begin(); iter != messages->end(); ++iter) {
+		bytes += (*iter)->message.length();
+	}
+	if (memoryBufferSize + bytes > memoryBufferBytes) {
+		return false;
+	}
+	memoryBuffer->insert(memoryBuffer->end(), messages->begin(), messages->end());
+	memoryBufferSize += bytes;
+	return true;
+}
+
+bool BufferStore::flushMemoryBuffer() {
+	pthread_mutex_lock(&primaryMutex);
+	bool success = primaryStore->isOpen() || primaryStore->open();
+	if (success && !memoryBuffer->empty()) {
+		success = primaryStore->handleMessages(memoryBuffer);
+	}
+	pthread_mutex_unlock(&primaryMutex);
+
+	if (success) {
+		LOG_OPER("[%s] primary store recovered, sent <%lu> bytes from memory buffer", categoryHandled.c_str(), memoryBufferSize);
+		memoryBuffer.reset(new logentry_vector_t);
+		memoryBufferSize = 0;
+	} else {
+		// ܷȥһ, ʣµĻmemoryBuffer
+		memoryBufferSize = 0;
+		for (logentry_vector_t::iterator iter = memoryBuffer->begin(); iter != memoryBuffer->end(); ++iter) {
+			memoryBufferSize += (*iter)->message.length();
+		}
+	}
+	return success;
+}
+
+void BufferStore::spillMemoryBuffer() {
+	unsigned long size = memoryBuffer->size();
+	if (!secondaryStore->handleMessages(memoryBuffer)) {
+		LOG_OPER("[%s] buffer store secondary store lost %lu messages from memory buffer", categoryHandled.c_str(), size);
+		g_Handler->incrementCounter("lost", size);
+	}
+	memoryBuffer.reset(new logentry_vector_t);
+	memoryBufferSize = 0;
+}
+
+bool BufferStore::backlogEmpty(struct tm* now) {
+	pthread_mutex_lock(&secondaryMutex);
+	bool empty = secondaryStore->empty(now);
+	pthread_mutex_unlock(&secondaryMutex);
+	return empty;
+}
+
+static void* replayThreadStatic(void *this_ptr) {
+	BufferStore *store_ptr = (BufferStore*) this_ptr;
+	store_ptr->replayThreadMember();
+	return NULL;
+}
+
+void BufferStore::startReplayThread() {
+	if (scheduledReplay) {
+		// periodicCheckǼǵg_replayScheduler
+		pthread_mutex_lock(&replayMutex);
+		stopReplay = false;
+		pthread_mutex_unlock(&replayMutex);
+		return;
+	}
+	if (replayThreadRunning) {
+		return;
+	}
+	stopReplay = false;
+	if (0 != pthread_create(&replayThread, NULL, replayThreadStatic, (void*) this)) {
+		LOG_OPER("[%s] ERROR: failed to start replay thread, buffer will not be replayed", categoryHandled.c_str());
+		return;
+	}
+	replayThreadRunning = true;
+}
+
+void BufferStore::stopReplayThread() {
+	if (scheduledReplay) {
+		pthread_mutex_lock(&replayMutex);
+		stopReplay = true;
+		bool scheduled = replayScheduled;
+		replayScheduled = false;
+		pthread_mutex_unlock(&replayMutex);
+		// ֮߳̾Ͳõstore
+		if (scheduled) {
+			g_replayScheduler.removeSource(this);
+		}
+		return;
+	}
+	if (!replayThreadRunning) {
+		return;
+	}
+	pthread_mutex_lock(&replayMutex);
+	stopReplay = true;
+	pthread_cond_broadcast(&replayCond);
+	pthread_mutex_unlock(&replayMutex);
+
+	pthread_join(replayThread, NULL);
+	replayThreadRunning = false;
+}
+
+// STREAMING״̬طŻѹϢ, replayLimiter. ûлѹʱÿһ.
+void BufferStore::replayThreadMember() {
+	while (true) {
+		pthread_mutex_lock(&replayMutex);
+		while (!stopReplay && state != STREAMING) {
+			pthread_cond_wait(&replayCond, &replayMutex);
+		}
+		bool stop = stopReplay;
+		pthread_mutex_unlock(&replayMutex);
+		if (stop) {
+			break;
+		}
+
+		time_t now;
+		struct tm nowinfo;
+		time(&now);
+		localtime_r(&now, &nowinfo);
+
+		double wait = 1;
+		if (!backlogEmpty(&nowinfo)) {
+			unsigned long bytes = 0;
+			replay_result_t result = replayStep(&nowinfo, bytes);
+			if (result == REPLAY_OK) {
+				wait = replayLimiter.reserve(bytes);
+			} else if (result == REPLAY_FAILED) {
+				pthread_mutex_lock(&replayMutex);
+				replayFailed = true;
+				pthread_mutex_unlock(&replayMutex);
+			}
+		}
+
+		if (wait > 0) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			long long usec = tv.tv_usec + (long long) (wait * 1000000);
+			struct timespec deadline;
+			deadline.tv_sec = tv.tv_sec + usec / 1000000;
+			deadline.tv_nsec = (usec % 1000000) * 1000;
+
+			pthread_mutex_lock(&replayMutex);
+			if (!stopReplay) {
+				pthread_cond_timedwait(&replayCond, &replayMutex, &deadline);
+			}
+			pthread_mutex_unlock(&replayMutex);
+		}
+	}
+}
+
+bool BufferStore::probePrimary() {
+	unsigned long long start = currentTimeMs();
+	pthread_mutex_lock(&primaryMutex);
+	bool healthy = primaryStore->probe();
+	pthread_mutex_unlock(&primaryMutex);
+
+	g_Handler->incrementCounter("probes");
+	g_Handler->incrementCounter("probe ms", currentTimeMs() - start);
+	if (!healthy) {
+		g_Handler->incrementCounter("probe failures");
+	}
+	return healthy;
+}
+
+void BufferStore::scheduleProbe() {
+	if (!probeIntervalMs) {
+		probeIntervalMs = probeInitialMs;
+	}
+	// 20%Ķ, úܶforwarderͬһʱ̽ͬһ
+	unsigned long jitter = probeIntervalMs / 5;
+	unsigned long delay = probeIntervalMs - jitter + (jitter ? rand() % (2 * jitter + 1) : 0);
+	nextProbeTime = currentTimeMs() + delay;
+
+	probeIntervalMs = probeIntervalMs > probeMaxMs / 2 ? probeMaxMs : probeIntervalMs * 2;
+}
+
+unsigned long BufferStore::nextCheckMs() {
+	if (state != DISCONNECTED || !probeInitialMs) {
+		return 0;
+	}
+	unsigned long long now = currentTimeMs();
+	return nextProbeTime > now ? (unsigned long) (nextProbeTime - now) : 1;
+}
+
+void BufferStore::scheduleReplay(struct tm* now) {
+	pthread_mutex_lock(&replayMutex);
+	bool need_schedule = !replayScheduled && !stopReplay;
+	pthread_mutex_unlock(&replayMutex);
+	if (!need_schedule) {
+		return;
+	}
+
+	if (backlogEmpty(now)) {
+		backlogSince = 0;
+		return;
+	}
+	pthread_mutex_lock(&replayMutex);
+	replayScheduled = true;
+	pthread_mutex_unlock(&replayMutex);
+
+	// ϴʱĻѹûм¼ʱ, տʼѹ
+	g_replayScheduler.addSource(this, replayPriority, backlogSince ? backlogSince : time(NULL));
+}
+
+bool BufferStore::replayChunk(unsigned long& bytes, double& delay) {
+	bytes = 0;
+	delay = 0;
+
+	pthread_mutex_lock(&replayMutex);
+	bool streaming = !stopReplay && state == STREAMING;
+	if (!streaming) {
+		replayScheduled = false;
+	}
+	pthread_mutex_unlock(&replayMutex);
+	if (!streaming) {
+		return false;
+	}
 
 	time_t now;
-	struct tm* nowinfo;
+	struct tm nowinfo;
 	time(&now);
-	nowinfo = localtime(&now);
+	localtime_r(&now, &nowinfo);
 
-	//ΪϿ, ǾretryInterval֮ٳprimaryStore->open()
-	if (state == DISCONNECTED) {
-		if (now - lastOpenAttempt > retryInterval) {
-			if (primaryStore->open()) {
-				changeState(SENDING_BUFFER);
-			} else {
-				// retryʱ
-				changeState(DISCONNECTED);
-			}
-		}
+	replay_result_t result;
+	bool more;
+	try {
+		result = replayStep(&nowinfo, bytes);
+		more = (result == REPLAY_OK && !backlogEmpty(&nowinfo));
+	} catch (...) {
+		// scheduler쳣Ƴsource, periodicCheckŻµǼ
+		pthread_mutex_lock(&replayMutex);
+		replayScheduled = false;
+		pthread_mutex_unlock(&replayMutex);
+		throw;
 	}
 
-	if (state == SENDING_BUFFER) {
-		// secondary storeȡһϢ͸primary store.
-		// primary storeæ,ܻ᷵ Ժ, ҲһԶ̫Ϣ.
-		// secondary storeһļ, ôϢmax file size.
-		unsigned sent = 0;
-		// ÿֻbufferSendRateôbufferļ
-		for (sent = 0; sent < bufferSendRate; ++sent) {
-			boost::shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
-			//Ϣ
-			if (secondaryStore->readOldest(messages, nowinfo)) {
-				time(&lastWriteTime);
-
-				unsigned long size = messages->size();
-				if (size) {
-					//ϢǾprimaryStoreȥ
-					if (primaryStore->handleMessages(messages)) {
-						//ɹ,͸ɵϢ
-						secondaryStore->deleteOldest(nowinfo);
-					} else {
-						if (messages->size() != size) {
-							// ֻһϢ, ֻðⲿϢٷŻȥ
-							LOG_OPER("[%s] buffer store primary store processed %lu/%lu messages", categoryHandled.c_str(), size - messages->size(), size);
-
-							if (!secondaryStore->replaceOldest(messages, nowinfo)) {
-								// ݱȥ,ֻñ˵ݶʧ
-								LOG_OPER("[%s] buffer store secondary store lost %u messages", categoryHandled.c_str(), messages->size());
-								g_Handler->incrementCounter("lost", messages->size());
-								secondaryStore->deleteOldest(nowinfo);
-							}
-						}
-
-						changeState(DISCONNECTED);
-						break;
-					}
-				} else {
-					// ûϢҪת, bufferϢļΪղſܳ
-					secondaryStore->deleteOldest(nowinfo);
-				}
-			} else {
-				// Ͳ̫
-				setStatus("Failed to read from secondary store");
-				LOG_OPER("[%s] WARNING: buffer store can't read from secondary store", categoryHandled.c_str());
-				break;
-			}
-
-			// bufferϢ,break
-			if (secondaryStore->empty(nowinfo)) {
-				LOG_OPER("[%s] No more buffer files to send, switching to streaming mode", categoryHandled.c_str());
-				changeState(STREAMING);
+	pthread_mutex_lock(&replayMutex);
+	if (result == REPLAY_FAILED) {
+		replayFailed = true;
+	}
+	if (!more) {
+		replayScheduled = false;
+	}
+	pthread_mutex_unlock(&replayMutex);
 
-				primaryStore->flush();
-				break;
-			}
-		}
-	}// if state == SENDING_BUFFER
+	if (more) {
+		delay = replayLimiter.reserve(bytes);
+	}
+	return more;
 }
 
 time_t BufferStore::getNewRetryInterval() {
@@ -1124,6 +2456,8 @@ const char* BufferStore::stateAsString(buffer_state_t state) {
 		return "DISCONNECTED";
 	case SENDING_BUFFER:
 		return "SENDING_BUFFER";
+	case MEMORY_BUFFERING:
+		return "MEMORY_BUFFERING";
 	default:
 		return "unknown state";
 	}
@@ -1143,13 +2477,260 @@ std::string BufferStore::getStatus() {
 /* End of BufferStore */
 
 /* Start of NetworkStore */
+HedgedSend::HedgedSend() :
+	result(SEND_FAILED), hedgeWon(false), hedgeStarted(false), pending(0), done(false), tryLater(false) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&doneCond, NULL);
+}
+
+HedgedSend::~HedgedSend() {
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&doneCond);
+}
+
+void HedgedSend::start() {
+	pthread_mutex_lock(&mutex);
+	++pending;
+	pthread_mutex_unlock(&mutex);
+}
+
+bool HedgedSend::startHedge() {
+	pthread_mutex_lock(&mutex);
+	bool started = !done;
+	if (started) {
+		++pending;
+		hedgeStarted = true;
+	}
+	pthread_mutex_unlock(&mutex);
+	return started;
+}
+
+bool HedgedSend::isDone() {
+	pthread_mutex_lock(&mutex);
+	bool result = done;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+bool HedgedSend::finish(send_result_t send_result, bool hedge) {
+	pthread_mutex_lock(&mutex);
+	--pending;
+	bool duplicate = done && result == SEND_OK && send_result == SEND_OK;
+	if (send_result == SEND_TRY_LATER) {
+		tryLater = true;
+	}
+	if (!done && send_result == SEND_OK) {
+		result = SEND_OK;
+		hedgeWon = hedge;
+		done = true;
+	} else if (!done && !pending) {
+		result = tryLater ? SEND_TRY_LATER : SEND_FAILED;
+		done = true;
+	}
+	pthread_cond_broadcast(&doneCond);
+	pthread_mutex_unlock(&mutex);
+	return duplicate;
+}
+
+bool HedgedSend::wait(double deadline_ms) {
+	struct timespec deadline;
+	deadline.tv_sec = (time_t) (deadline_ms / 1000);
+	deadline.tv_nsec = (long) ((deadline_ms - deadline.tv_sec * 1000.0) * 1000000);
+	pthread_mutex_lock(&mutex);
+	while (!done) {
+		if (!deadline_ms) {
+			pthread_cond_wait(&doneCond, &mutex);
+		} else if (ETIMEDOUT == pthread_cond_timedwait(&doneCond, &mutex, &deadline)) {
+			break;
+		}
+	}
+	bool finished = done;
+	pthread_mutex_unlock(&mutex);
+	return finished;
+}
+
+HedgeConnection::HedgeConnection(int timeout_ms, bool credit_flow) :
+	timeout(timeout_ms), creditFlow(credit_flow), closed(false), port(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+HedgeConnection::~HedgeConnection() {
+	pthread_mutex_destroy(&mutex);
+}
+
+shared_ptr<forwarderConn> HedgeConnection::get(const string& new_host, unsigned long new_port) {
+	pthread_mutex_lock(&mutex);
+	if (!closed && (!conn || new_host != host || new_port != port)) {
+		conn.reset(new forwarderConn(new_host, new_port, timeout));
+		conn->setCreditFlow(creditFlow);
+		host = new_host;
+		port = new_port;
+	}
+	shared_ptr<forwarderConn> result = closed ? shared_ptr<forwarderConn> () : conn;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+void HedgeConnection::close() {
+	pthread_mutex_lock(&mutex);
+	shared_ptr<forwarderConn> old_conn = conn;
+	conn.reset();
+	closed = true;
+	pthread_mutex_unlock(&mutex);
+
+	if (old_conn) {
+		old_conn->lock();
+		old_conn->close();
+		old_conn->unlock();
+	}
+}
+
+/*
+ * g_sendTaskQueueȵdeadline, ͻûнͰͬһϢserversûпסһԱ, HedgedSend.
+ * Ŷ˾϶Գ, deadlineͿʼ. NetworkStore, storeر֮ûҲǰȫ.
+ */
+class HedgeTask: public Task {
+public:
+	// skip_hostΪʱԱ(consistent_hashʱ͹̶)
+	HedgeTask(shared_ptr<HedgedSend> hedged_send, shared_ptr<logentry_vector_t> log_messages, int64_t batch_id, const string& sender_id, double deadline_ms, double threshold_ms,
+			const server_vector_t& group_servers, const string& skip_host, unsigned long skip_port, shared_ptr<HedgeConnection> hedge_conn,
+			const string& category) :
+		hedged(hedged_send), messages(log_messages), batchId(batch_id), senderId(sender_id), deadline(deadline_ms), threshold(threshold_ms), servers(group_servers),
+				skipHost(skip_host), skipPort(skip_port), hedgeConn(hedge_conn), categoryHandled(category) {
+	}
+
+	void run() {
+		if (hedged->wait(deadline)) {
+			return;
+		}
+		string host;
+		unsigned long port = 0;
+		if (!pickTarget(host, port)) {
+			g_Handler->incrementCounter("hedge no target");
+			return;
+		}
+		// Ѿн˾ͲҪٽ
+		if (!hedged->startHedge()) {
+			return;
+		}
+		shared_ptr<forwarderConn> conn = hedgeConn->get(host, port);
+		if (!conn) {
+			// storeѾر
+			hedged->finish(SEND_FAILED, true);
+			return;
+		}
+		LOG_OPER("[%s] no response after <%.0f> ms, hedging <%u> messages to <%s:%lu>", categoryHandled.c_str(), threshold, (unsigned) messages->size(), host.c_str(), port);
+		g_Handler->incrementCounter("hedged sends");
+
+		send_result_t result = SEND_FAILED;
+		conn->lock();
+		// ں̨ʱsendȥȽ
+		if (conn->isOpen() || conn->isReconnecting() || conn->open()) {
+			result = conn->send(messages, batchId, senderId);
+		}
+		conn->unlock();
+		if (hedged->finish(result, true)) {
+			LOG_OPER("[%s] hedge of <%u> messages to <%s:%lu> succeeded after the primary send", categoryHandled.c_str(), (unsigned) messages->size(), host.c_str(), port);
+			g_Handler->incrementCounter("hedge duplicates");
+		}
+	}
+
+private:
+	// g_latencyRouterѡһûסֵĳԱ, ͿסǸԱȻ
+	bool pickTarget(string& host, unsigned long& port) {
+		server_vector_t ranked;
+		g_latencyRouter.rank(servers, ranked);
+		for (server_vector_t::const_iterator iter = ranked.begin(); iter != ranked.end(); ++iter) {
+			if (!skipHost.empty() && iter->first == skipHost && (unsigned long) iter->second == skipPort) {
+				continue;
+			}
+			if (g_latencyRouter.isStalled(iter->first, iter->second, threshold)) {
+				continue;
+			}
+			host = iter->first;
+			port = iter->second;
+			return true;
+		}
+		return false;
+	}
+
+	shared_ptr<HedgedSend> hedged;
+	shared_ptr<logentry_vector_t> messages;
+	int64_t batchId;
+	string senderId;
+	double deadline;
+	double threshold;
+	server_vector_t servers;
+	string skipHost;
+	unsigned long skipPort;
+	shared_ptr<HedgeConnection> hedgeConn;
+	string categoryHandled;
+};
+
+// NetworkStore·ɷһϢ. connΪNULLʱ, ӳ, by_serviceʱkeysmc service, host:port.
+// NetworkStore, Ժ̨Ҳ
+static send_result_t sendRouted(shared_ptr<forwarderConn> conn, bool by_service, const string& key, unsigned long port, shared_ptr<logentry_vector_t> messages,
+		int64_t batch_id, const string& sender_id) {
+	if (conn) {
+		// ˮ߷Ҫӵ
+		conn->lock();
+		send_result_t result = conn->send(messages, batch_id, sender_id);
+		conn->unlock();
+		return result;
+	} else if (by_service) {
+		return g_connPool.send(key, messages, batch_id, sender_id);
+	} else {
+		return g_connPool.send(key, port, messages, batch_id, sender_id);
+	}
+}
+
+/*
+ * ˶Գʱ, g_primarySendTaskQueue, storeֻ߳HedgedSendĵһɹĽ.
+ * ʼʱԳѾɹ˾Ͳٷ. HedgeTaskһNetworkStore.
+ */
+class PrimarySendTask: public Task {
+public:
+	PrimarySendTask(shared_ptr<HedgedSend> hedged_send, shared_ptr<logentry_vector_t> log_messages, int64_t batch_id, const string& sender_id,
+			shared_ptr<forwarderConn> send_conn, bool by_service, const string& pool_key, unsigned long pool_port, const string& category) :
+		hedged(hedged_send), messages(log_messages), batchId(batch_id), senderId(sender_id), conn(send_conn), byService(by_service), key(pool_key), port(pool_port),
+				categoryHandled(category) {
+	}
+
+	void run() {
+		send_result_t result = SEND_FAILED;
+		if (!hedged->isDone()) {
+			result = sendRouted(conn, byService, key, port, messages, batchId, senderId);
+		}
+		if (hedged->finish(result, false)) {
+			LOG_OPER("[%s] primary send of <%u> messages succeeded after the hedge won", categoryHandled.c_str(), (unsigned) messages->size());
+			g_Handler->incrementCounter("hedge duplicates");
+		}
+	}
+
+private:
+	shared_ptr<HedgedSend> hedged;
+	shared_ptr<logentry_vector_t> messages;
+	int64_t batchId;
+	string senderId;
+	shared_ptr<forwarderConn> conn;
+	bool byService;
+	string key;
+	unsigned long port;
+	string categoryHandled;
+};
+
 NetworkStore::NetworkStore(const string& category, bool multi_category) :
-	Store(category, "network", multi_category), useConnPool(false), smcBased(false), remotePort(0), opened(false) {
+	Store(category, "network", multi_category), useConnPool(false), smcBased(false), timeout(DEFAULT_SOCKET_TIMEOUT_MS), probeTimeout(DEFAULT_PROBE_TIMEOUT_MS),
+			remotePort(0), tryLaterBackoffMs(DEFAULT_TRY_LATER_BACKOFF_MS), tryLaterMaxMs(DEFAULT_TRY_LATER_MAX_MS), pipelineWindow(1), connPoolSize(1), connPoolLeastLoaded(true),
+			hashRouting(false), latencyRouting(false), hashVnodes(DEFAULT_HASH_RING_VNODES), hashLoadPercent(DEFAULT_HASH_LOAD_PERCENT), watchMembers(true), hedgeAfterMs(0), hedgePercentile(0), hedgeMaxPercent(DEFAULT_HEDGE_MAX_PERCENT), batchIds(false), creditFlow(false), opened(false), routedPort(0),
+			watching(false), membersDirty(false), nextLatency(0), batchesSent(0), batchesHedged(0) {
 	// opened־ȷǲظرӳе,Ӷθɵü.
+	pthread_mutex_init(&memberMutex, NULL);
 }
 
 NetworkStore::~NetworkStore() {
 	close();
+	pthread_mutex_destroy(&memberMutex);
 }
 
 void NetworkStore::configure(pStoreConf configuration) {
@@ -1165,6 +2746,18 @@ void NetworkStore::configure(pStoreConf configuration) {
 	if (!configuration->getInt("timeout", timeout)) {
 		timeout = DEFAULT_SOCKET_TIMEOUT_MS;
 	}
+	if (!configuration->getInt("probe_timeout", probeTimeout)) {
+		probeTimeout = DEFAULT_PROBE_TIMEOUT_MS;
+	}
+	configuration->getUnsigned("try_later_backoff_ms", tryLaterBackoffMs);
+	configuration->getUnsigned("try_later_max_ms", tryLaterMaxMs);
+	if (!tryLaterBackoffMs) {
+		tryLaterBackoffMs = DEFAULT_TRY_LATER_BACKOFF_MS;
+	}
+	configuration->getUnsigned("pipeline_window", pipelineWindow);
+	if (!pipelineWindow) {
+		pipelineWindow = 1;
+	}
 
 	string temp;
 	if (configuration->getString("use_conn_pool", temp)) {
@@ -1172,59 +2765,130 @@ void NetworkStore::configure(pStoreConf configuration) {
 			useConnPool = true;
 		}
 	}
+	configuration->getUnsigned("conn_pool_size", connPoolSize);
+	if (!connPoolSize) {
+		connPoolSize = 1;
+	}
+	if (configuration->getString("conn_pool_select", temp)) {
+		if (0 == temp.compare("round_robin")) {
+			connPoolLeastLoaded = false;
+		} else if (0 == temp.compare("least_loaded")) {
+			connPoolLeastLoaded = true;
+		} else {
+			LOG_OPER("[%s] WARNING: Bad config - unknown conn_pool_select <%s>, using least_loaded", categoryHandled.c_str(), temp.c_str());
+		}
+	}
+	if (!useConnPool && connPoolSize > 1) {
+		LOG_OPER("[%s] WARNING: conn_pool_size is only used with use_conn_pool=yes, ignoring", categoryHandled.c_str());
+		connPoolSize = 1;
+	}
+
+	if (configuration->getString("routing", temp)) {
+		if (0 == temp.compare("consistent_hash")) {
+			hashRouting = true;
+		} else if (0 == temp.compare("least_latency")) {
+			latencyRouting = true;
+		} else if (0 != temp.compare("any")) {
+			LOG_OPER("[%s] WARNING: Bad config - unknown routing <%s>, using any", categoryHandled.c_str(), temp.c_str());
+		}
+	}
+	if (hashRouting && !smcBased) {
+		LOG_OPER("[%s] WARNING: routing=consistent_hash needs smc_service, ignoring", categoryHandled.c_str());
+		hashRouting = false;
+	}
+	if (latencyRouting && !smcBased) {
+		LOG_OPER("[%s] WARNING: routing=least_latency needs smc_service, ignoring", categoryHandled.c_str());
+		latencyRouting = false;
+	}
+	configuration->getString("routing_key", routingKey);
+	configuration->getUnsigned("hash_vnodes", hashVnodes);
+	configuration->getUnsigned("hash_load_percent", hashLoadPercent);
+	if (hashLoadPercent && hashLoadPercent < 100) {
+		LOG_OPER("[%s] Bad config - hash_load_percent must be at least 100, using 100", categoryHandled.c_str());
+		hashLoadPercent = 100;
+	}
+	if (configuration->getString("watch_members", temp)) {
+		watchMembers = (0 == temp.compare("yes"));
+	}
+
+	configuration->getUnsigned("hedge_after_ms", hedgeAfterMs);
+	configuration->getUnsigned("hedge_percentile", hedgePercentile);
+	configuration->getUnsigned("hedge_max_percent", hedgeMaxPercent);
+	if (hedgePercentile >= 100) {
+		LOG_OPER("[%s] Bad config - hedge_percentile must be less than 100, using 99", categoryHandled.c_str());
+		hedgePercentile = 99;
+	}
+	if ((hedgeAfterMs || hedgePercentile) && !smcBased) {
+		LOG_OPER("[%s] WARNING: hedged sends need smc_service, ignoring hedge_after_ms and hedge_percentile", categoryHandled.c_str());
+		hedgeAfterMs = 0;
+		hedgePercentile = 0;
+	}
+	if (configuration->getString("batch_ids", temp)) {
+		batchIds = (0 == temp.compare("yes"));
+	}
+	// ԳҪbatchIdȥ
+	if (hedgeAfterMs || hedgePercentile) {
+		batchIds = true;
+	}
+
+	if (configuration->getString("flow_control", temp)) {
+		if (0 == temp.compare("credit")) {
+			creditFlow = true;
+		} else if (0 != temp.compare("none")) {
+			LOG_OPER("[%s] WARNING: Bad config - unknown flow_control <%s>, using none", categoryHandled.c_str(), temp.c_str());
+		}
+	}
 }
 
 bool NetworkStore::open() {
 	cout<<"open()"<<endl;
 	//service manage center, ʱҪʵһ
 	if (smcBased) { //env_defaultǲ֧smcʽ.
-		vector<string> hostStrs;
-		bool success = g_Handler->groupServicePtr->getMembers(smcService, hostStrs);
-		// ûҵκserver.
-		if (!success || hostStrs.empty()) {
-			LOG_OPER("[%s] Failed to get servers from smc", categoryHandled.c_str());
-			setStatus("Could not get list of servers from smc");
+		server_vector_t servers;
+		if (!getSmcServers(servers)) {
 			return false;
 		}
-	
+		groupServers = servers;
 
-		server_vector_t servers;
-		for(vector<string>::iterator it=hostStrs.begin(),end=hostStrs.end();it!=end;++it) {
-			cout<<"get member: "<<(*it)<<endl;
-			vector<string> host_port_pair;
-			boost::algorithm::split(host_port_pair, (*it), boost::algorithm::is_any_of("_"));
-			if(host_port_pair.size() == 2) { 
-				servers.push_back(
-					std::pair<std::string,int>(
-						host_port_pair[0],
-						atoi(   
-							host_port_pair[1].c_str()
-						)
-					)       
-				);      
+		if (hashRouting) {
+			// ֻϣǸԱ, ֮remote_host + remote_portķʽһ
+			const string& key = routingKey.empty() ? categoryHandled : routingKey;
+			int index = g_routeBalancer.assign(smcService, servers, key, hashVnodes, hashLoadPercent / 100.0);
+			if (index < 0) {
+				// smcĳԱhost:port
+				LOG_OPER("[%s] no usable member in smc group <%s> to route key <%s>", categoryHandled.c_str(), smcService.c_str(), key.c_str());
+				setStatus("No usable server in smc group");
+				return false;
 			}
-		}
-		
-
-		if (useConnPool) {
-			opened = g_connPool.open(smcService, servers, static_cast<int> (timeout));
+			routedHost = servers[index].first;
+			routedPort = servers[index].second;
+			LOG_OPER("[%s] key <%s> routed to <%s:%lu> of <%s>", categoryHandled.c_str(), key.c_str(), routedHost.c_str(), routedPort, smcService.c_str());
+			opened = openTarget(routedHost, routedPort, unpooledConn);
+			if (!opened) {
+				g_routeBalancer.release(smcService, RouteBalancer::makeMemberName(routedHost, routedPort));
+			}
+		} else if (useConnPool) {
+			opened = g_connPool.open(smcService, servers, static_cast<int> (timeout), pipelineWindow, connPoolSize, connPoolLeastLoaded, latencyRouting,
+					creditFlow);
 		} else {
-			unpooledConn = shared_ptr<forwarderConn> (new forwarderConn(smcService, servers, static_cast<int> (timeout)));
+			unpooledConn = shared_ptr<forwarderConn> (new forwarderConn(smcService, servers, static_cast<int> (timeout), pipelineWindow, latencyRouting));
+			unpooledConn->setCreditFlow(creditFlow);
 			opened = unpooledConn->open();
 		}
 
+		if (opened && watchMembers && !watching) {
+			// һλصǵǰĳԱб
+			watching = true;
+			g_Handler->groupServicePtr->watchMembers(smcService, this);
+		}
+
 	} else if (remotePort <= 0 || remoteHost.empty()) {
 		LOG_OPER("[%s] Bad config - won't attempt to connect to <%s:%lu>", categoryHandled.c_str(), remoteHost.c_str(), remotePort);
 		setStatus("Bad config - invalid location for remote server");
 		return false;
 
 	} else {
-		if (useConnPool) {
-			opened = g_connPool.open(remoteHost, remotePort, static_cast<int> (timeout));
-		} else {
-			unpooledConn = shared_ptr<forwarderConn> (new forwarderConn(remoteHost, remotePort, static_cast<int> (timeout)));
-			opened = unpooledConn->open();
-		}
+		opened = openTarget(remoteHost, remotePort, unpooledConn);
 	}
 
 	if (opened) {
@@ -1235,22 +2899,169 @@ bool NetworkStore::open() {
 	return opened;
 }
 
+// smc groupĳԱhost_port
+static void parseSmcMembers(const vector<string>& members, server_vector_t& _return) {
+	for (vector<string>::const_iterator it = members.begin(), end = members.end(); it != end; ++it) {
+		vector<string> host_port_pair;
+		boost::algorithm::split(host_port_pair, (*it), boost::algorithm::is_any_of("_"));
+		if (host_port_pair.size() == 2) {
+			_return.push_back(std::pair<std::string, int>(host_port_pair[0], atoi(host_port_pair[1].c_str())));
+		}
+	}
+}
+
+// smcȡserverб
+bool NetworkStore::getSmcServers(server_vector_t& _return) {
+	vector<string> hostStrs;
+	bool success = g_Handler->groupServicePtr->getMembers(smcService, hostStrs);
+	// ûҵκserver.
+	if (!success || hostStrs.empty()) {
+		LOG_OPER("[%s] Failed to get servers from smc", categoryHandled.c_str());
+		setStatus("Could not get list of servers from smc");
+		return false;
+	}
+
+	parseSmcMembers(hostStrs, _return);
+	return true;
+}
+
+bool NetworkStore::openTarget(const string& host, unsigned long port, shared_ptr<forwarderConn>& conn) {
+	if (useConnPool) {
+		return g_connPool.open(host, port, static_cast<int> (timeout), pipelineWindow, connPoolSize, connPoolLeastLoaded, creditFlow);
+	}
+	conn = shared_ptr<forwarderConn> (new forwarderConn(host, port, static_cast<int> (timeout), pipelineWindow));
+	conn->setCreditFlow(creditFlow);
+	return conn->open();
+}
+
+void NetworkStore::closeTarget(const string& host, unsigned long port, shared_ptr<forwarderConn>& conn) {
+	if (useConnPool) {
+		g_connPool.close(host, port);
+	} else if (conn != NULL) {
+		conn->lock();
+		conn->close();
+		conn->unlock();
+	}
+}
+
+void NetworkStore::membersChanged(const string &group, const vector<string> &memberList) {
+	pthread_mutex_lock(&memberMutex);
+	pendingMembers = memberList;
+	membersDirty = true;
+	pthread_mutex_unlock(&memberMutex);
+}
+
+// ֻhandleMessages/sendFramesͷ, ʱstoreûڷ͵Ϣ;
+// ӳﱻstoreforwarderConn::updateServersˮ߷ٻ
+void NetworkStore::applyMemberChange() {
+	if (!watching) {
+		return;
+	}
+	vector<string> members;
+	pthread_mutex_lock(&memberMutex);
+	bool dirty = membersDirty;
+	members.swap(pendingMembers);
+	membersDirty = false;
+	pthread_mutex_unlock(&memberMutex);
+	if (!dirty) {
+		return;
+	}
+
+	server_vector_t servers;
+	parseSmcMembers(members, servers);
+	if (servers.empty()) {
+		// ֻzookeeperǱߵsession, ڵ
+		LOG_OPER("[%s] smc group <%s> has no members, keeping current connections", categoryHandled.c_str(), smcService.c_str());
+		return;
+	}
+	g_Handler->incrementCounter("smc member changes");
+	groupServers = servers;
+
+	if (hashRouting) {
+		const string& key = routingKey.empty() ? categoryHandled : routingKey;
+		int index = g_routeBalancer.assign(smcService, servers, key, hashVnodes, hashLoadPercent / 100.0);
+		if (index < 0) {
+			return;
+		}
+		string host = servers[index].first;
+		unsigned long port = servers[index].second;
+		if (host == routedHost && port == routedPort) {
+			// ԭĳԱ, ȥظļ
+			g_routeBalancer.release(smcService, RouteBalancer::makeMemberName(host, port));
+			return;
+		}
+		// µĳԱٹصɵ, Ͼͼþɵ
+		shared_ptr<forwarderConn> conn;
+		if (!openTarget(host, port, conn)) {
+			LOG_OPER("[%s] failed to connect to <%s:%lu>, keeping <%s:%lu>", categoryHandled.c_str(), host.c_str(), port, routedHost.c_str(), routedPort);
+			g_routeBalancer.release(smcService, RouteBalancer::makeMemberName(host, port));
+			return;
+		}
+		LOG_OPER("[%s] key <%s> moved from <%s:%lu> to <%s:%lu> of <%s>", categoryHandled.c_str(), key.c_str(), routedHost.c_str(), routedPort, host.c_str(), port, smcService.c_str());
+		g_routeBalancer.release(smcService, RouteBalancer::makeMemberName(routedHost, routedPort));
+		closeTarget(routedHost, routedPort, unpooledConn);
+		routedHost = host;
+		routedPort = port;
+		unpooledConn = conn;
+	} else if (useConnPool) {
+		g_connPool.updateServers(smcService, servers);
+	} else if (unpooledConn != NULL) {
+		updateConnServers(vector<shared_ptr<forwarderConn> >(1, unpooledConn), servers);
+	}
+}
+
+// ӳ, ҲӰѾ򿪵
+bool NetworkStore::probe() {
+	shared_ptr<forwarderConn> conn;
+	if (smcBased) {
+		server_vector_t servers;
+		if (!getSmcServers(servers)) {
+			return false;
+		}
+		conn = shared_ptr<forwarderConn> (new forwarderConn(smcService, servers, static_cast<int> (probeTimeout)));
+	} else if (remotePort <= 0 || remoteHost.empty()) {
+		return false;
+	} else {
+		conn = shared_ptr<forwarderConn> (new forwarderConn(remoteHost, remotePort, static_cast<int> (probeTimeout)));
+	}
+	return conn->probe();
+}
+
 void NetworkStore::close() {
+	if (watching) {
+		g_Handler->groupServicePtr->unwatchMembers(smcService, this);
+		watching = false;
+		pthread_mutex_lock(&memberMutex);
+		pendingMembers.clear();
+		membersDirty = false;
+		pthread_mutex_unlock(&memberMutex);
+	}
 	if (!opened) {
 		return;
 	}
 	opened = false;
+	if (hashRouting) {
+		g_routeBalancer.release(smcService, RouteBalancer::makeMemberName(routedHost, routedPort));
+	}
 	if (useConnPool) {
-		if (smcBased) {
+		if (hashRouting) {
+			g_connPool.close(routedHost, routedPort);
+		} else if (smcBased) {
 			g_connPool.close(smcService);
 		} else {
 			g_connPool.close(remoteHost, remotePort);
 		}
 	} else {
 		if (unpooledConn != NULL) {
+			unpooledConn->lock();
 			unpooledConn->close();
+			unpooledConn->unlock();
 		}
 	}
+	if (hedgeConn) {
+		hedgeConn->close();
+		hedgeConn.reset();
+	}
 }
 
 bool NetworkStore::isOpen() {
@@ -1264,6 +3075,23 @@ shared_ptr<Store> NetworkStore::copy(const std::string &category) {
 	store->useConnPool = useConnPool;
 	store->smcBased = smcBased;
 	store->timeout = timeout;
+	store->probeTimeout = probeTimeout;
+	store->tryLaterBackoffMs = tryLaterBackoffMs;
+	store->tryLaterMaxMs = tryLaterMaxMs;
+	store->pipelineWindow = pipelineWindow;
+	store->connPoolSize = connPoolSize;
+	store->connPoolLeastLoaded = connPoolLeastLoaded;
+	store->hashRouting = hashRouting;
+	store->latencyRouting = latencyRouting;
+	store->routingKey = routingKey;
+	store->hashVnodes = hashVnodes;
+	store->hashLoadPercent = hashLoadPercent;
+	store->watchMembers = watchMembers;
+	store->hedgeAfterMs = hedgeAfterMs;
+	store->creditFlow = creditFlow;
+	store->batchIds = batchIds;
+	store->hedgePercentile = hedgePercentile;
+	store->hedgeMaxPercent = hedgeMaxPercent;
 	store->remoteHost = remoteHost;
 	store->remotePort = remotePort;
 	store->smcService = smcService;
@@ -1272,21 +3100,171 @@ shared_ptr<Store> NetworkStore::copy(const std::string &category) {
 }
 
 bool NetworkStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
+	return handleBatch(messages, batchIds ? newBatchId() : 0, "");
+}
+
+bool NetworkStore::usesBatchIds() {
+	return batchIds;
+}
+
+// TRY_LATER֮طͶԳ巢͵ĸͬһbatchId
+bool NetworkStore::handleBatch(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id) {
 	if (!isOpen()) {
-		LOG_OPER("[%s] Logic error: NetworkStore::handleMessages called on closed store", categoryHandled.c_str());
+		LOG_OPER("[%s] Logic error: NetworkStore::handleBatch called on closed store", categoryHandled.c_str());
 		return false;
-	} else if (useConnPool) {
-		if (smcBased) {
-			return g_connPool.send(smcService, messages);
+	}
+	applyMemberChange();
+
+	bool hedging = hedgeAfterMs || hedgePercentile;
+	unsigned long waited = 0;
+	unsigned long backoff = tryLaterBackoffMs;
+	while (true) {
+		send_result_t result = hedging ? sendHedged(messages, batch_id, sender_id) : sendOnce(messages, batch_id, sender_id);
+		if (result == SEND_OK) {
+			return true;
+		} else if (result == SEND_FAILED) {
+			return false;
+		}
+
+		if (!waitTryLater(waited, backoff)) {
+			LOG_OPER("[%s] remote forwarder still busy after <%lu> ms, giving up <%u> messages", categoryHandled.c_str(), waited, (unsigned) messages->size());
+			return false;
+		}
+	}
+}
+
+bool NetworkStore::canSendFrames() {
+	return true;
+}
+
+// ӵsent֡ʼ, TRY_LATERʱhandleMessagesһ˱, ֮ŷʣµ֡
+bool NetworkStore::sendFrames(const LogFrameRegion& region, unsigned long& sent) {
+	sent = 0;
+	if (!isOpen()) {
+		LOG_OPER("[%s] Logic error: NetworkStore::sendFrames called on closed store", categoryHandled.c_str());
+		return false;
+	}
+	applyMemberChange();
+
+	unsigned long waited = 0;
+	unsigned long backoff = tryLaterBackoffMs;
+	while (true) {
+		send_result_t result = sendFramesOnce(region, sent);
+		if (result == SEND_OK) {
+			return true;
+		} else if (result == SEND_FAILED) {
+			return false;
+		}
+
+		if (!waitTryLater(waited, backoff)) {
+			LOG_OPER("[%s] remote forwarder still busy after <%lu> ms, giving up <%lu> frames", categoryHandled.c_str(), waited, (unsigned long) region.frameEnds.size() - sent);
+			return false;
+		}
+	}
+}
+
+// Զֻ, һٷ, еsecondaryд̻
+bool NetworkStore::waitTryLater(unsigned long& waited, unsigned long& backoff) {
+	g_Handler->incrementCounter("try later");
+	if (waited >= tryLaterMaxMs) {
+		return false;
+	}
+	unsigned long sleep_ms = min(backoff, tryLaterMaxMs - waited);
+	usleep(sleep_ms * 1000);
+	waited += sleep_ms;
+	g_Handler->incrementCounter("try later ms", sleep_ms);
+	backoff *= 2;
+	return true;
+}
+
+send_result_t NetworkStore::sendOnce(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id) {
+	if (!useConnPool && !unpooledConn) {
+		LOG_OPER("[%s] Logic error: NetworkStore::handleMessages unpooledConn is NULL", categoryHandled.c_str());
+		return SEND_FAILED;
+	}
+	return sendRouted(useConnPool ? shared_ptr<forwarderConn> () : unpooledConn, !hashRouting && smcBased, hashRouting ? routedHost : (smcBased ? smcService : remoteHost),
+			hashRouting ? routedPort : remotePort, messages, batch_id, sender_id);
+}
+
+// ҪԳ: ͷŵg_primarySendTaskQueue, ͬʱg_sendTaskQueueһHedgeTask: ֵûнʱ,
+// ٰͬһϢ(ͬһbatchId)groupûпסһԱ. store̵߳ȵһɹĽ, õȿסͳʱ.
+// Գhedge_max_percent%, Գλstoreֱ߳ӷ.
+// סĳԱֻռסԳͱ, ñŶ.
+send_result_t NetworkStore::sendHedged(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id) {
+	if (!useConnPool && !unpooledConn) {
+		LOG_OPER("[%s] Logic error: NetworkStore::handleMessages unpooledConn is NULL", categoryHandled.c_str());
+		return SEND_FAILED;
+	}
+	double start = (double) currentTimeMs();
+	double threshold = hedgeThresholdMs();
+
+	shared_ptr<HedgedSend> hedged(new HedgedSend());
+	hedged->start();
+	if (threshold > 0 && groupServers.size() >= 2 && batchesHedged * 100 < (batchesSent + 1) * hedgeMaxPercent) {
+		if (!hedgeConn) {
+			hedgeConn.reset(new HedgeConnection(static_cast<int> (timeout), creditFlow));
+		}
+		g_sendTaskQueue.addTask(shared_ptr<Task> (new HedgeTask(hedged, messages, batch_id, sender_id, start + threshold, threshold, groupServers,
+				hashRouting ? routedHost : "", hashRouting ? routedPort : 0, hedgeConn, categoryHandled)));
+		g_primarySendTaskQueue.addTask(shared_ptr<Task> (new PrimarySendTask(hedged, messages, batch_id, sender_id, useConnPool ? shared_ptr<forwarderConn> () : unpooledConn,
+				!hashRouting && smcBased, hashRouting ? routedHost : (smcBased ? smcService : remoteHost), hashRouting ? routedPort : remotePort, categoryHandled)));
+	} else {
+		hedged->finish(sendOnce(messages, batch_id, sender_id), false);
+	}
+	// ȳɹǸǽ; ʧʱȵ
+	hedged->wait(0);
+
+	double latency = (double) currentTimeMs() - start;
+	if (sendLatencies.size() < HEDGE_LATENCY_SAMPLES) {
+		sendLatencies.push_back(latency);
+	} else {
+		sendLatencies[nextLatency] = latency;
+		nextLatency = (nextLatency + 1) % HEDGE_LATENCY_SAMPLES;
+	}
+	if (++batchesSent >= 1000) {
+		// ֻı
+		batchesSent /= 2;
+		batchesHedged /= 2;
+	}
+	if (hedged->hedgeStarted) {
+		++batchesHedged;
+	}
+	if (hedged->hedgeWon) {
+		g_Handler->incrementCounter("hedge wins");
+	}
+	return hedged->result;
+}
+
+// 0ʾβԳ
+double NetworkStore::hedgeThresholdMs() {
+	double threshold = hedgeAfterMs;
+	if (hedgePercentile && sendLatencies.size() >= HEDGE_MIN_SAMPLES) {
+		vector<double> latencies(sendLatencies);
+		vector<double>::iterator nth = latencies.begin() + latencies.size() * hedgePercentile / 100;
+		nth_element(latencies.begin(), nth, latencies.end());
+		threshold = max(threshold, *nth);
+	}
+	return threshold;
+}
+
+send_result_t NetworkStore::sendFramesOnce(const LogFrameRegion& region, unsigned long& sent) {
+	if (useConnPool) {
+		if (hashRouting) {
+			return g_connPool.sendFrames(routedHost, routedPort, region, sent);
+		} else if (smcBased) {
+			return g_connPool.sendFrames(smcService, region, sent);
 		} else {
-			return g_connPool.send(remoteHost, remotePort, messages);
+			return g_connPool.sendFrames(remoteHost, remotePort, region, sent);
 		}
 	} else {
 		if (unpooledConn) {
-			return unpooledConn->send(messages);
+			unpooledConn->lock();
+			send_result_t result = unpooledConn->sendFrames(region, sent);
+			unpooledConn->unlock();
+			return result;
 		} else {
-			LOG_OPER("[%s] Logic error: NetworkStore::handleMessages unpooledConn is NULL", categoryHandled.c_str());
-			return false;
+			LOG_OPER("[%s] Logic error: NetworkStore::sendFrames unpooledConn is NULL", categoryHandled.c_str());
+			return SEND_FAILED;
 		}
 	}
 }
@@ -1462,6 +3440,17 @@ void BucketStore::periodicCheck() {
 	}
 }
 
+unsigned long BucketStore::nextCheckMs() {
+	unsigned long check_ms = 0;
+	for (std::vector<shared_ptr<Store> >::iterator iter = buckets.begin(); iter != buckets.end(); ++iter) {
+		unsigned long ms = (*iter)->nextCheckMs();
+		if (ms && (!check_ms || ms < check_ms)) {
+			check_ms = ms;
+		}
+	}
+	return check_ms;
+}
+
 shared_ptr<Store> BucketStore::copy(const std::string &category) {
 	BucketStore *store = new BucketStore(category, multiCategory);
 	shared_ptr<Store> copied = shared_ptr<Store> (store);
@@ -1782,6 +3771,17 @@ void MultiStore::periodicCheck() {
 	}
 }
 
+unsigned long MultiStore::nextCheckMs() {
+	unsigned long check_ms = 0;
+	for (std::vector<boost::shared_ptr<Store> >::iterator iter = stores.begin(); iter != stores.end(); ++iter) {
+		unsigned long ms = (*iter)->nextCheckMs();
+		if (ms && (!check_ms || ms < check_ms)) {
+			check_ms = ms;
+		}
+	}
+	return check_ms;
+}
+
 void MultiStore::flush() {
 	for (std::vector<boost::shared_ptr<Store> >::iterator iter = stores.begin(); iter != stores.end(); ++iter) {
 		(*iter)->flush();
@@ -1922,6 +3922,17 @@ void CategoryStore::periodicCheck() {
 	}
 }
 
+unsigned long CategoryStore::nextCheckMs() {
+	unsigned long check_ms = 0;
+	for (map<string, shared_ptr<Store> >::iterator iter = stores.begin(); iter != stores.end(); ++iter) {
+		unsigned long ms = iter->second->nextCheckMs();
+		if (ms && (!check_ms || ms < check_ms)) {
+			check_ms = ms;
+		}
+	}
+	return check_ms;
+}
+
 void CategoryStore::flush() {
 	for (map<string, shared_ptr<Store> >::iterator iter = stores.begin(); iter != stores.end(); ++iter) {
 		iter->second->flush();
@@ -10,7 +10,13 @@
 
 #include "conf.h"
 #include "file.h"
+#include "block_file.h"
+#include "compactor.h"
+#include "rate_limiter.h"
+#include "replay_scheduler.h"
+#include "log_frame.h"
 #include "conn_pool.h"
+#include "group_service.h"
 
 /* defines used by the store class */
 enum roll_period_t {
@@ -37,8 +43,26 @@ public:
 	// Դ洢Ϣ, ɹ򷵻true.
 	// ʧ򷵻false, ʱ,messagesаûоϢ.
 	virtual bool handleMessages(boost::shared_ptr<logentry_vector_t> messages) = 0;
+	// ͬ, batch_idϢLog() batchId, ͬһϢ浽ͬstoreʱͬһ, οԾݴȥ.
+	// sender_idΪʱlocalSenderId(), ԭתεһʱεsenderId(StoreQueue).
+	// ֻNetworkStorebuffer_format=thriftFileStoreõ
+	virtual bool handleBatch(boost::shared_ptr<logentry_vector_t> messages, int64_t /*batch_id*/, const std::string& /*sender_id*/) {
+		return handleMessages(messages);
+	}
+	// ǷδbatchId. ĻStoreQueueðεηֿhandleBatch, Ժϲһ
+	virtual bool usesBatchIds() {
+		return false;
+	}
 	virtual void periodicCheck() {
 	}
+	// ϣٺ֮ٵperiodicCheck, 0ʾStoreQueuecheck_period
+	virtual unsigned long nextCheckMs() {
+		return 0;
+	}
+	// Ƿ, open(). Ҫ̽storetrue, ɵֱopen
+	virtual bool probe() {
+		return true;
+	}
 
 	virtual void flush() = 0;
 
@@ -50,6 +74,26 @@ public:
 	virtual bool replaceOldest(boost::shared_ptr<logentry_vector_t> messages, struct tm* now);
 	virtual bool empty(struct tm* now);
 
+	// bufferļֱӷ(FileStorebuffer_format=thrift), ֵ֧store.
+	// secondary: ҳϵļα֮һ֡, ֻλò. ûʱregionΪ
+	virtual bool hasLogFrames() {
+		return false;
+	}
+	virtual bool readOldestFrames(LogFrameRegion& region, struct tm* now) {
+		return false;
+	}
+	// secondary: ϴreadOldestFramesصǰframes֡Ѿȥ, αƹȥ
+	virtual void consumeOldestFrames(unsigned long frames, struct tm* now) {
+	}
+	// primary: region֡ԭԶ, sentضԶ˽˵֡
+	virtual bool canSendFrames() {
+		return false;
+	}
+	virtual bool sendFrames(const LogFrameRegion& region, unsigned long& sent) {
+		sent = 0;
+		return false;
+	}
+
 	// don't need to override
 	virtual const std::string& getType();
 
@@ -88,9 +132,15 @@ protected:
 	// ⲿopenֻҪĬϲ.
 	virtual bool openInternal(bool incrementFilename, struct tm* current_time) = 0;
 	virtual void rotateFile(struct tm *timeinfo);
+	// periodicCheckûйʱǷflush, ŲѹblockstoreҪ
+	virtual bool flushOnCheck() {
+		return false;
+	}
 
 	// ѵǰļһЩϢдlog,ҲlogļͬĿ¼.
 	virtual void printStats();
+	std::string makeStats(); // printStatsдһͳϢ
+	std::string makeStatsFilename();
 
 	// Ҫ뵽blockߴʣֽڴС
 	unsigned long bytesToPad(unsigned long next_message_length, unsigned long current_file_size, unsigned long chunk_size);
@@ -129,6 +179,23 @@ private:
 	FileStoreBase& operator=(FileStoreBase& rhs);
 };
 
+/*
+ * ɺ̨߳Ԥȴ(Ԥռ)һļ, FileStoreͺ̨֮乲.
+ */
+class NextSegment {
+public:
+	NextSegment();
+	~NextSegment();
+
+	pthread_mutex_t mutex;
+	pthread_cond_t readyCond;
+	bool pending; // ׼Ѿύ, û
+	std::string filename;
+	std::string baseFilename; // жǷѾ
+	unsigned long size;
+	boost::shared_ptr<FileInterface> file;
+};
+
 /*
  * ļstoreʵ, ѲίеFileInterface, FileInterfaceļϵͳĽ. (see file.h)
  */
@@ -139,27 +206,87 @@ public:
 
 	boost::shared_ptr<Store> copy(const std::string &category);
 	bool handleMessages(boost::shared_ptr<logentry_vector_t> messages);
+	bool handleBatch(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id);
 	bool isOpen();
 	void configure(pStoreConf configuration);
 	void close();
 	void flush();
 
 	// ÿζopencloseļǰļ.
+	// replay_chunk_bytesʱ, α괦ôֽ, deleteOldest/replaceOldestֻƶα(readOldestChunk)
+	// replay_order=lifoʱ"Oldest"ָµļ(дļ), ļڲǴǰ
+	// max_ageʱ, ֮ǰȰ޸ʱ䳬max_ageļɾ(дļ)
 	bool readOldest(/*out*/boost::shared_ptr<logentry_vector_t> messages, struct tm* now);
 	virtual bool replaceOldest(boost::shared_ptr<logentry_vector_t> messages, struct tm* now);
 	void deleteOldest(struct tm* now);
 	bool empty(struct tm* now);
 
+	// buffer_format=thriftҰαطʱ֧
+	bool hasLogFrames();
+	bool readOldestFrames(LogFrameRegion& region, struct tm* now);
+	void consumeOldestFrames(unsigned long frames, struct tm* now);
+
 protected:
 	// ʵFileStoreBasevirtual
 	bool openInternal(bool incrementFilename, struct tm* current_time);
+	void rotateFile(struct tm *timeinfo);
+	bool flushOnCheck();
 	bool writeMessages(boost::shared_ptr<logentry_vector_t> messages, boost::shared_ptr<FileInterface> write_file);
 
+	// ̨rotate: ύһȥһļ, Լȡ/Ѿ׼õļ
+	bool useAsyncRotate();
+	void prepareNextSegment(struct tm* current_time);
+	boost::shared_ptr<FileInterface> takeNextSegment(const std::string& base_filename, std::string& filename);
+	void discardNextSegment();
+	void removeEmptyTrailingSegments(struct tm* current_time);
+
+	boost::shared_ptr<FileInterface> createWriteFile(const std::string& filename);
+	CompactJob makeCompactJob(const std::string& filename);
+
+	// αֿطbufferļ, α걣<ļ>.cursor
+	bool readOldestChunk(boost::shared_ptr<logentry_vector_t> messages, struct tm* now);
+	void advanceCursor(unsigned long offset);
+	static std::string makeCursorFilename(const std::string& filename);
+	static unsigned long readCursor(const std::string& filename);
+	bool writeCursor(const std::string& filename, unsigned long offset);
+	int findReplayFile(struct tm* now); // replay_orderһҪطŵļ
+	int findUnexpiredReplayFile(struct tm* now); // ͬ, ˳ɾڵļ
+	bool expireFile(const std::string& filename); // ļʱɾtrue
+	// ɨbuffer_format=thriftļoffsetʼ֡, ʵ
+	bool readLogFrames(const std::string& filename, unsigned long offset, unsigned long max_bytes, LogFrameRegion& region, bool& at_end, logentry_vector_t* messages);
+
 	bool isBufferFile;
 	bool addNewlines;
+	bool asyncRotate; // rotateʱֻл̨Ѿ򿪵ļ, رյȹ̨߳
+	unsigned long preallocateSize; // Ԥȴ򿪵ļԤĿռ, 0ʾԤ
+	block_codec_t compressionCodec; // ΪCODEC_NONEʱblockѹд, ʽblock_file.h
+	long int compressionLevel;
+	unsigned long compressionBlockSize;
+	unsigned long compressionBlockAge; // blockڴܶ, 0ʾȵclose
+	bool asyncCompression; // ں̨߳ѹ
+	bool indexedSegments; // segment_format=indexed, blockʱ, closeʱд
+	bool frameChecksum; // frame_format=v2, bufferļÿϢCRC32C. ʱ򶼰v2, л֮ǰҪȰv1Ļѹ
+	bool compactClosed; // rotateļg_compactorں̨ѹ
+	long int compactLevel;
+	unsigned long compactMergeSize; // ССļϲѹ, 0ʾϲ
+	unsigned long replayChunkBytes; // Ϊ0ʱαֿطbufferļ
+	bool replayNewestFirst; // replay_order=lifo
+	unsigned long maxAge; // λΪsecond, طʱ޸ʱļ, 0ʾ
+	bool thriftFrames; // buffer_format=thrift, ÿϢһõLog()֡(log_frame.h)
 
 	// ״̬
 	boost::shared_ptr<FileInterface> writeFile;
+	int currentSuffix;
+	boost::shared_ptr<NextSegment> nextSegment;
+
+	// һreadOldestChunkλ
+	std::string replayFilename;
+	unsigned long replayStartOffset;
+	std::vector<unsigned long> replayOffsets; // ÿϢλ, readOldestFramesʱÿ֡λ
+	unsigned long replayEndOffset;
+	bool replayAtEnd; // ļĩβ
+	int64_t currentBatchId; // handleBatchд, thriftFramesʱд֡
+	std::string currentSenderId;
 
 private:
 	//ֵͿչ
@@ -203,8 +330,33 @@ private:
  * ʱʧ,Ϣsecondary store, Ժش.
  *
  * buffer, ϢҪbufferڴ,  store down, Ǿsecondary store.
+ * primaryʱϢдsecondary, ָٰsecondaryѹϢطŸprimary.
+ *
+ * replay_mode=serial(Ĭ): primaryָȽSENDING_BUFFER, Ϣдsecondary,
+ *   ÿperiodicCheckطbuffer_send_rate, ѹлSTREAMING. Ϣϸ˳򵽴primary.
+ * replay_mode=concurrent: primaryֱָӽSTREAMING, Ϣֱӷprimary,
+ *   ͬʱһ̰߳replay_bytes_per_secٶطŻѹϢ.
+ *   ˳֤: ѹϢ֮䱣дʱ˳, Ϣ֮Ҳ˳, ѹϢڱµϢ.
+ *   ģʽҪsecondaryǰαֿطŵFileStore(replay_chunk_bytes), ûʱԶ.
+ * replay_mode=scheduled: concurrentһ, ֻǻѹϢԼ߳ط, ǵǼǵȫֵg_replayScheduler,
+ *   categoryһɹ̶̲߳ط, ܵĲʹȫreplay_scheduler_threads/replay_scheduler_bytes_per_sec.
+ *   replay_priorityط, ͬʱȶϿ(ѹݸ)ط. replay_bytes_per_secȻƵcategory.
+ *
+ * memory_buffer_bytesΪ0ʱ, primaryʧȽMEMORY_BUFFERING, Ϣ˳ڴ, ÿperiodicCheckprimary.
+ * ڴŲ»߹ϳmemory_buffer_max_outage, ŰڴϢдsecondaryDISCONNECTED.
+ * ݵĶͲд, Ҳõretry_interval.
+ *
+ * replay_orderƻѹط˳(secondaryFileStore):
+ *   fifo(Ĭ): ϵļʼ.
+ *   lifo: µļʼ, һļڲǰд˳. ָ»ѹȵ, ϵݺ.
+ *   fresh_first: lifoconcurrentط, ָϢֱӷprimary, ѹݴµں̨.
+ *
+ * max_age()ᴫsecondary: طʱһдѾmax_agebufferļٶ, ֱɾ.
+ *
+ * probe_interval_msΪ0ʱ, DISCONNECTED״̬²ٰretry_intervalopen, ȵprimaryprobe()̽,
+ * ̽probe_interval_msʼָ˱ܵprobe_max_interval_ms, 20%. ̽ɹopen primary.
  */
-class BufferStore: public Store {
+class BufferStore: public Store, public ReplaySource {
 
 public:
 	BufferStore(const std::string& category, bool multi_category);
@@ -212,15 +364,23 @@ public:
 
 	boost::shared_ptr<Store> copy(const std::string &category);
 	bool handleMessages(boost::shared_ptr<logentry_vector_t> messages);
+	bool handleBatch(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id);
+	bool usesBatchIds();
 	bool open();
 	bool isOpen();
 	void configure(pStoreConf configuration);
 	void close();
 	void flush();
 	void periodicCheck();
+	unsigned long nextCheckMs();
 
 	std::string getStatus();
 
+	// ط̵߳ѭ
+	void replayThreadMember();
+	// replay_mode=scheduledʱg_replaySchedulerĹ̵߳
+	bool replayChunk(unsigned long& bytes, double& delay);
+
 protected:
 	boost::shared_ptr<Store> primaryStore;
 
@@ -230,13 +390,35 @@ protected:
 	enum buffer_state_t {
 		STREAMING, // ӵprimary storeֱӷ
 		DISCONNECTED, // primary storeʧȥ, ʱsecondary store
-		SENDING_BUFFER
+		SENDING_BUFFER,
 	// storesecondary storeݵ״̬.
+		MEMORY_BUFFERING
+	// primaryճ, Ϣȷڴ
+	};
+
+	enum replay_result_t {
+		REPLAY_OK, // ȥһ(Ҳǿյ)
+		REPLAY_FAILED, // primaryʧ
+		REPLAY_ERROR // secondary
 	};
 
 	void changeState(buffer_state_t new_state); // ״̬ת
 	const char* stateAsString(buffer_state_t state);
 
+	// secondaryһϢprimary, ط߳. bytesط͵Ϣֽ
+	replay_result_t replayStep(struct tm* now, unsigned long& bytes);
+	replay_result_t replayFrames(struct tm* now, unsigned long& bytes); // secondaryֱ֡ӷprimary, 
+	bool backlogEmpty(struct tm* now);
+	void primaryFailed(); // ýMEMORY_BUFFERINGDISCONNECTED
+	bool bufferInMemory(boost::shared_ptr<logentry_vector_t> messages);
+	bool flushMemoryBuffer(); // ڴϢprimary
+	void spillMemoryBuffer(); // ڴϢдsecondary, ߱secondaryMutex
+	void startReplayThread();
+	void stopReplayThread();
+	void scheduleReplay(struct tm* now); // лѹʱǼǵg_replayScheduler
+	bool probePrimary(); // ̽primary
+	void scheduleProbe(); // ǰ˱ܼһ̽, Ѽ
+
 	time_t getNewRetryInterval(); // interval
 
 	// 
@@ -244,12 +426,37 @@ protected:
 	unsigned long bufferSendRate; // ÿperiodicCheckʱԷ͵bufferļ
 	time_t avgRetryInterval; // in seconds, for retrying primary store open
 	time_t retryIntervalRange; // in seconds
+	bool concurrentReplay; // replay_mode=concurrentscheduled
+	bool scheduledReplay; // replay_mode=scheduled
+	int replayPriority;
+	RateLimiter replayLimiter; // replay_bytes_per_sec
+	unsigned long memoryBufferBytes; // ڴ滺Ϣֽ, 0ʾڴ滺
+	time_t memoryBufferMaxOutage; // in seconds
+	unsigned long probeInitialMs; // 0ʾ̽, retry_intervalopen
+	unsigned long probeMaxMs;
 
 	// ״̬
 	buffer_state_t state;
 	time_t lastWriteTime;
 	time_t lastOpenAttempt;
 	time_t retryInterval;
+	boost::shared_ptr<logentry_vector_t> memoryBuffer;
+	unsigned long memoryBufferSize; // memoryBufferϢֽ
+	time_t outageStart; // MEMORY_BUFFERINGʱ
+	time_t backlogSince; // ʼsecondaryѹʱ, ѹ0
+	unsigned long probeIntervalMs; // ǰ˱ܼ
+	unsigned long long nextProbeTime; // һ̽ʱ, λΪ
+
+	// ط̺߳StoreQueue̻߳ͬʱõprimarysecondary, ͬʱ
+	pthread_mutex_t primaryMutex;
+	pthread_mutex_t secondaryMutex;
+	pthread_mutex_t replayMutex; // state(д)״̬
+	pthread_cond_t replayCond;
+	pthread_t replayThread;
+	bool replayThreadRunning;
+	bool stopReplay;
+	bool replayFailed; // ط̷߳ʧ, periodicCheckлDISCONNECTED
+	bool replayScheduled; // ѾǼǵg_replayScheduler
 
 private:
 	//ֵͿչ
@@ -258,36 +465,153 @@ private:
 	BufferStore& operator=(BufferStore& rhs);
 };
 
+/*
+ * NetworkStoreһοܱԳķ. g_primarySendTaskQueue, Գ巢g_sendTaskQueue, ˭ȳɹ˭Ľ,
+ * ûгɹʱһTRY_LATERTRY_LATER. store߳õһɹĽͷ, ǸûпʼͲ,
+ * Ѿڷճ, ʹ. ҲɹĻԱһ(if/forwarder.thrift), "hedge duplicates".
+ */
+class HedgedSend {
+public:
+	HedgedSend();
+	~HedgedSend();
+
+	void start(); // ֮ǰ
+	bool startHedge(); // Գ巢֮ǰ, Ѿн˾ͷfalse, ٷ
+	bool isDone();
+	// һѾɹ, Ҳɹʱtrue, ʱԱһ
+	bool finish(send_result_t send_result, bool hedge);
+	// ȵнߵdeadline_ms(0ʾһֱ), нʱtrue
+	bool wait(double deadline_ms);
+
+	// waittrue֮Ч
+	send_result_t result;
+	bool hedgeWon;
+	bool hedgeStarted;
+
+private:
+	pthread_mutex_t mutex;
+	pthread_cond_t doneCond;
+	unsigned pending;
+	bool done;
+	bool tryLater;
+};
+
+/*
+ * Գ巢õ, Ŀͻһµ. NetworkStoreͶԳ, storeر֮Ž.
+ */
+class HedgeConnection {
+public:
+	HedgeConnection(int timeout, bool credit_flow);
+	~HedgeConnection();
+
+	// host:port, ɵɻͷ. close֮󷵻ؿ
+	boost::shared_ptr<forwarderConn> get(const std::string& host, unsigned long port);
+	void close();
+
+private:
+	pthread_mutex_t mutex;
+	int timeout;
+	bool creditFlow;
+	bool closed;
+	boost::shared_ptr<forwarderConn> conn;
+	std::string host;
+	unsigned long port;
+
+	// ֵ
+	HedgeConnection(HedgeConnection& rhs);
+	HedgeConnection& operator=(HedgeConnection& rhs);
+};
+
 /*
  * NetworkStoreϢforwarder server. ֻȫӳg_connPoolһadapterɫ.
+ *
+ * Զ˷TRY_LATER()ʱϱʧ, ڴﰴtry_later_backoff_msʼָ˱ط,
+ * ۼƵȴtry_later_max_msŷʧ, ϲ(BufferStore)ȥдsecondary. ӳʧ.
+ *
+ * pipeline_windowֻùͬһӵĶstore(ͬһĿĲͬcategory)ͬʱڵȷ.
+ * һstoreֻһStoreQueue߳, handleMessagesҪȵĽŷ, Եstoreͬʱֻһ·,
+ * category»һRTT. Ҫߵcategory, target_write_sizeÿ.
  */
-class NetworkStore: public Store {
+class NetworkStore: public Store, public GroupListener {
 public:
 	NetworkStore(const std::string& category, bool multi_category);
 	~NetworkStore();
 
 	boost::shared_ptr<Store> copy(const std::string &category);
 	bool handleMessages(boost::shared_ptr<logentry_vector_t> messages);
+	bool handleBatch(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id);
+	bool usesBatchIds();
 	bool open();
 	bool isOpen();
 	void configure(pStoreConf configuration);
 	void close();
 	void flush();
+	bool probe(); // һʱӵgetStatus
+	bool canSendFrames();
+	bool sendFrames(const LogFrameRegion& region, unsigned long& sent);
+	// GroupServicezookeeper̻߳ص, ֻµĳԱб, ɷ߳Ϣ֮л
+	void membersChanged(const std::string &group, const std::vector<std::string> &memberList);
 
 protected:
 	static const long int DEFAULT_SOCKET_TIMEOUT_MS = 5000; // 5 sec timeout
+	static const long int DEFAULT_PROBE_TIMEOUT_MS = 1000;
+	static const unsigned long DEFAULT_TRY_LATER_BACKOFF_MS = 100;
+	static const unsigned long DEFAULT_TRY_LATER_MAX_MS = 2000;
+	static const unsigned long DEFAULT_HASH_LOAD_PERCENT = 125;
+	static const unsigned long DEFAULT_HEDGE_MAX_PERCENT = 10;
+	static const unsigned long HEDGE_LATENCY_SAMPLES = 200; // hedge_percentileôηͼ
+	static const unsigned long HEDGE_MIN_SAMPLES = 20;
+
+	bool getSmcServers(server_vector_t& _return);
+	send_result_t sendOnce(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id);
+	send_result_t sendHedged(boost::shared_ptr<logentry_vector_t> messages, int64_t batch_id, const std::string& sender_id);
+	double hedgeThresholdMs();
+	send_result_t sendFramesOnce(const LogFrameRegion& region, unsigned long& sent);
+	bool waitTryLater(unsigned long& waited, unsigned long& backoff); // Զ˷TRY_LATERʱ˱, ȹtry_later_max_msfalse
+	bool openTarget(const std::string& host, unsigned long port, boost::shared_ptr<forwarderConn>& conn); // ӳʱconn
+	void closeTarget(const std::string& host, unsigned long port, boost::shared_ptr<forwarderConn>& conn);
+	void applyMemberChange(); // ڷ߳ӦmembersChangedµĳԱб
 
 	// 
 	bool useConnPool;
 	bool smcBased;
 	long int timeout;
+	long int probeTimeout; // ̽StoreQueue߳, ʱҪ
 	std::string remoteHost;
 	unsigned long remotePort; // long because it works with config code
 	std::string smcService;
+	unsigned long tryLaterBackoffMs;
+	unsigned long tryLaterMaxMs; // 0ʾTRY_LATERʱֱӷʧ
+	unsigned long pipelineWindow; // ÿͬʱڵȷصLog, 1ʾͬ. storeԼͬʱֻһ, ע
+	unsigned long connPoolSize; // use_conn_poolʱÿĿ
+	bool connPoolLeastLoaded; // conn_pool_select=least_loaded, round_robin
+	bool hashRouting; // routing=consistent_hash, routing_keystore̶smc groupеһԱ(hash_ring.h)
+	bool latencyRouting; // routing=least_latency, smc groupӳٵ, ûĳԱ(latency_router.h)
+	std::string routingKey; // Ĭcategory
+	unsigned long hashVnodes;
+	unsigned long hashLoadPercent; // ÿԱֵƽֵô౶(ٷֱ), 0ʾ
+	bool watchMembers; // watch_members=yes, smc groupĳԱ仯, õеµĳԱ
+	unsigned long hedgeAfterMs; // ôûûзؾٷһݵgroupеһԱ, 0ʾù̶ֵ
+	unsigned long hedgePercentile; // ֵȡӳٵٷλ(hedge_after_ms), 0ʾ
+	unsigned long hedgeMaxPercent; // Գ巢ռİٷֱ
+	bool batchIds; // batch_ids=yes˶Գ巢ʱbatchId, dedup_windowõ
+	bool creditFlow; // flow_control=credit, ԶgetCreditĶȷ(forwarderConn)
 
 	// ״̬
 	bool opened;
 	boost::shared_ptr<forwarderConn> unpooledConn; // null if useConnPool
+	std::string routedHost; // hashRoutingʱopenѡеĳԱ
+	unsigned long routedPort;
+	bool watching; // ѾGroupServiceǼlistener
+	pthread_mutex_t memberMutex; // pendingMembersmembersDirty
+	std::vector<std::string> pendingMembers;
+	bool membersDirty;
+	server_vector_t groupServers; // smc groupĳԱ, Գ巢ʹѡĿ
+	boost::shared_ptr<HedgeConnection> hedgeConn; // һζԳʱ
+	std::vector<double> sendLatencies; // ͵ӳ(), ѭʹ
+	unsigned long nextLatency;
+	unsigned long batchesSent; // ƶԳı, ڼ
+	unsigned long batchesHedged;
 
 private:
 	//ֵͿչ
@@ -312,6 +636,7 @@ public:
 	void close();
 	void flush();
 	void periodicCheck();
+	unsigned long nextCheckMs();
 	std::string getStatus();
 
 protected:
@@ -382,6 +707,7 @@ public:
 
 	bool handleMessages(boost::shared_ptr<logentry_vector_t> messages);
 	void periodicCheck();
+	unsigned long nextCheckMs();
 	void flush();
 
 	// ûģΪжstore,Ǹ֪ӦôĸstoreжȡҲʺϰstoreϢù
@@ -425,6 +751,7 @@ public:
 
 	bool handleMessages(boost::shared_ptr<logentry_vector_t> messages);
 	void periodicCheck();
+	unsigned long nextCheckMs();
 	void flush();
 
 protected:
@@ -2,6 +2,7 @@
 #include "store_queue.h"
 
 #include "forwarder_server.h"
+#include "utils.h"
 #include "logger.h"
 
 
@@ -12,6 +13,7 @@ using namespace forwarder::thrift;
 
 #define DEFAULT_TARGET_WRITE_SIZE  16384
 #define DEFAULT_MAX_WRITE_INTERVAL 10
+#define DEFAULT_WAL_SEGMENT_BYTES  67108864
 
 void* threadStatic(void *this_ptr) {
 	StoreQueue *queue_ptr = (StoreQueue*) this_ptr;
@@ -20,9 +22,9 @@ void* threadStatic(void *this_ptr) {
 }
 
 StoreQueue::StoreQueue(const string& type, const string& category, unsigned check_period, bool is_model, bool multi_category) :
-	msgQueueSize(0), hasWork(false), stopping(false), isModel(is_model), multiCategory(multi_category), categoryHandled(category), checkPeriod(check_period),
+	msgQueueSize(0), msgQueueNewest(0), hasWork(false), stopping(false), isModel(is_model), multiCategory(multi_category), categoryHandled(category), checkPeriod(check_period),
 			targetWriteSize(DEFAULT_TARGET_WRITE_SIZE),
-			maxWriteInterval(DEFAULT_MAX_WRITE_INTERVAL) {
+			maxWriteInterval(DEFAULT_MAX_WRITE_INTERVAL), maxAge(0), forwardBatchIds(false), walEnabled(false), walSegmentBytes(DEFAULT_WAL_SEGMENT_BYTES) {
 
 	store = Store::createStore(type, category, false, multiCategory);
 	if (!store) {
@@ -32,14 +34,19 @@ StoreQueue::StoreQueue(const string& type, const string& category, unsigned chec
 }
 
 StoreQueue::StoreQueue(const shared_ptr<StoreQueue> example, const std::string &category) :
-	msgQueueSize(0), hasWork(false), stopping(false), isModel(false), multiCategory(example->multiCategory), categoryHandled(category), checkPeriod(example->checkPeriod), targetWriteSize(
-			example->targetWriteSize), maxWriteInterval(example->maxWriteInterval) {
+	msgQueueSize(0), msgQueueNewest(0), hasWork(false), stopping(false), isModel(false), multiCategory(example->multiCategory), categoryHandled(category), checkPeriod(example->checkPeriod), targetWriteSize(
+			example->targetWriteSize), maxWriteInterval(example->maxWriteInterval), maxAge(example->maxAge), forwardBatchIds(false), walEnabled(example->walEnabled), walPath(example->walPath),
+			walSegmentBytes(example->walSegmentBytes) {
 
 	store = example->copyStore(category);
 	if (!store) {
 		throw std::runtime_error("createStore failed copying model store");
 	}
+	forwardBatchIds = store->usesBatchIds();
 	storeInitCommon();
+	if (walEnabled) {
+		openWal();
+	}
 }
 
 StoreQueue::~StoreQueue() {
@@ -60,12 +67,32 @@ unsigned long StoreQueue::getSize() {
 }
 
 void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
+	addMessages(logentry_vector_t(1, entry));
+}
+
+void StoreQueue::addMessages(const logentry_vector_t& entries, const WalRange* wal_range, int64_t batch_id, const string& sender_id) {
 	if (isModel) {
 		LOG_OPER("ERROR: called addMessage on model store");
 	} else {
 		pthread_mutex_lock(&msgMutex);
-		msgQueue->push_back(entry);
-		msgQueueSize += entry->message.size();
+		if (wal_range) {
+			msgQueueWalRanges.push_back(*wal_range);
+		}
+		if (batch_id && forwardBatchIds && !entries.empty()) {
+			QueuedBatch batch;
+			batch.start = msgQueue->size();
+			batch.end = batch.start + entries.size();
+			batch.batchId = batch_id;
+			batch.senderId = sender_id;
+			msgQueueBatches.push_back(batch);
+		}
+		for (logentry_vector_t::const_iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+			msgQueue->push_back(*iter);
+			msgQueueSize += (*iter)->message.size();
+		}
+		if (maxAge) {
+			time(&msgQueueNewest);
+		}
 		pthread_mutex_unlock(&msgMutex);
 
 		// Ϣ嵽һ,ͻѴ洢߳
@@ -81,7 +108,33 @@ void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
 	}
 }
 
+bool StoreQueue::usesWal() {
+	return wal;
+}
+
+bool StoreQueue::walConfigured() {
+	return walEnabled;
+}
+
+WalRange StoreQueue::appendWal(const logentry_vector_t& entries) {
+	return wal->append(entries);
+}
+
+bool StoreQueue::waitDurable(const WalRange& range) {
+	return wal->waitDurable(range);
+}
+
+void StoreQueue::abandonWal(const WalRange& range) {
+	wal->consumed(range);
+}
+
 void StoreQueue::configureAndOpen(pStoreConf configuration) {
+	// WALҪڵһϢ֮ǰ, Բŵstore߳
+	configureWal(configuration);
+	if (!isModel && walEnabled && !wal) {
+		openWal();
+	}
+
 	// model,޸model
 	if (isModel) {
 		configureInline(configuration);
@@ -120,6 +173,9 @@ void StoreQueue::stop() {
 		}
 
 		pthread_join(storeThread, NULL);
+		if (wal) {
+			wal->close();
+		}
 	}
 }
 
@@ -173,6 +229,7 @@ void StoreQueue::threadMember() {
 
 	// ±,״̬ĳʼ
 	time_t last_periodic_check = 0;
+	unsigned long long next_fast_check = 0; // storeҪǰperiodicCheckʱ, λΪ
 
 	time_t last_handle_messages;
 	time(&last_handle_messages);
@@ -211,9 +268,13 @@ void StoreQueue::threadMember() {
 		// 
 		time_t this_loop;
 		time(&this_loop);
-		if (!stop && open && this_loop - last_periodic_check > checkPeriod) {
+		bool fast_check = next_fast_check && currentTimeMs() >= next_fast_check;
+		if (!stop && open && (this_loop - last_periodic_check > checkPeriod || fast_check)) {
 			store->periodicCheck();
 			last_periodic_check = this_loop;
+
+			unsigned long check_ms = store->nextCheckMs();
+			next_fast_check = check_ms ? currentTimeMs() + check_ms : 0;
 		}
 
 		pthread_mutex_lock(&msgMutex);
@@ -225,15 +286,35 @@ void StoreQueue::threadMember() {
 				boost::shared_ptr<logentry_vector_t> messages = msgQueue;
 				msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
 				msgQueueSize = 0;
+				std::vector<WalRange> wal_ranges;
+				wal_ranges.swap(msgQueueWalRanges);
+				std::vector<QueuedBatch> batches;
+				batches.swap(msgQueueBatches);
+				time_t newest = msgQueueNewest;
 
 				pthread_mutex_unlock(&msgMutex);
 
-				if (!store->handleMessages(messages)) {
-					// Ϣ, ֻñʧ
-					LOG_OPER("[%s] WARNING: Lost %u messages!", categoryHandled.c_str(), messages->size());
-					g_Handler->incrementCounter("lost", messages->size());
+				if (maxAge && newest && this_loop - newest > maxAge) {
+					// store̱߳ס̫, ϢѾҪ
+					LOG_OPER("[%s] Dropping %u messages older than <%ld> seconds", categoryHandled.c_str(), (unsigned) messages->size(), (long) maxAge);
+					g_Handler->incrementCounter("expired", messages->size());
+					for (std::vector<WalRange>::iterator iter = wal_ranges.begin(); iter != wal_ranges.end(); ++iter) {
+						wal->consumed(*iter);
+					}
+				} else {
+					unsigned long lost = handleQueued(messages, batches);
+					store->flush();
+					if (lost) {
+						// Ϣ, ֻñʧ
+						LOG_OPER("[%s] WARNING: Lost %lu messages!", categoryHandled.c_str(), lost);
+						g_Handler->incrementCounter("lost", lost);
+					}
+					// store֮WALЩϢͲҪ. ʧҲҪѵ: consumedֻǰ,
+					// һWALҲض, ʱϢȫطһ
+					for (std::vector<WalRange>::iterator iter = wal_ranges.begin(); iter != wal_ranges.end(); ++iter) {
+						wal->consumed(*iter);
+					}
 				}
-				store->flush();
 			} else {
 				pthread_mutex_unlock(&msgMutex);
 			}
@@ -249,6 +330,11 @@ void StoreQueue::threadMember() {
 			abs_timeout.tv_sec = min(last_periodic_check + checkPeriod, last_handle_messages + maxWriteInterval);
 
 			++abs_timeout.tv_sec;
+			abs_timeout.tv_nsec = 0;
+			if (next_fast_check && next_fast_check < (unsigned long long) abs_timeout.tv_sec * 1000) {
+				abs_timeout.tv_sec = next_fast_check / 1000;
+				abs_timeout.tv_nsec = (next_fast_check % 1000) * 1000000;
+			}
 
 			// ʱ
 			pthread_mutex_lock(&hasWorkMutex);
@@ -264,6 +350,30 @@ void StoreQueue::threadMember() {
 	store->close();
 }
 
+// ԭתεstore, Ϣһ
+unsigned long StoreQueue::handleQueued(boost::shared_ptr<logentry_vector_t> messages, const std::vector<QueuedBatch>& batches) {
+	if (batches.empty()) {
+		return store->handleMessages(messages) ? 0 : messages->size();
+	}
+
+	unsigned long lost = 0;
+	unsigned long pos = 0;
+	boost::shared_ptr<logentry_vector_t> others(new logentry_vector_t);
+	for (std::vector<QueuedBatch>::const_iterator iter = batches.begin(); iter != batches.end(); ++iter) {
+		others->insert(others->end(), messages->begin() + pos, messages->begin() + iter->start);
+		boost::shared_ptr<logentry_vector_t> batch(new logentry_vector_t(messages->begin() + iter->start, messages->begin() + iter->end));
+		if (!store->handleBatch(batch, iter->batchId, iter->senderId)) {
+			lost += batch->size();
+		}
+		pos = iter->end;
+	}
+	others->insert(others->end(), messages->begin() + pos, messages->end());
+	if (!others->empty() && !store->handleMessages(others)) {
+		lost += others->size();
+	}
+	return lost;
+}
+
 void StoreQueue::storeInitCommon() {
 	if (!isModel) {//Ҫԭmodel, ԭmodelֻ ԭģʽ¡.
 		msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
@@ -279,8 +389,53 @@ void StoreQueue::storeInitCommon() {
 void StoreQueue::configureInline(pStoreConf configuration) {
 	configuration->getUnsigned("target_write_size", (unsigned long&) targetWriteSize);
 	configuration->getUnsigned("max_write_interval", (unsigned long&) maxWriteInterval);
+	configuration->getUnsigned("max_age", (unsigned long&) maxAge);
 
 	store->configure(configuration);
+	forwardBatchIds = store->usesBatchIds();
+}
+
+void StoreQueue::configureWal(pStoreConf configuration) {
+	string tmp;
+	if (configuration->getString("wal", tmp)) {
+		walEnabled = (0 == tmp.compare("yes"));
+	}
+	configuration->getString("wal_path", walPath);
+	configuration->getUnsigned("wal_segment_bytes", walSegmentBytes);
+	if (!walSegmentBytes) {
+		walSegmentBytes = DEFAULT_WAL_SEGMENT_BYTES;
+	}
+	// WALҪڵĴ, ûкʵĬĿ¼
+	if (walEnabled && walPath.empty()) {
+		LOG_OPER("[%s] Bad config - wal=yes requires wal_path, wal disabled", categoryHandled.c_str());
+		walEnabled = false;
+	}
+}
+
+void StoreQueue::openWal() {
+	logentry_vector_t recovered;
+	WalRange recovered_range;
+	shared_ptr<WriteAheadLog> new_wal(new WriteAheadLog(walPath, categoryHandled, walSegmentBytes));
+	if (!new_wal->open(recovered, recovered_range)) {
+		LOG_OPER("[%s] Failed to open wal in <%s>, messages are only queued in memory", categoryHandled.c_str(), walPath.c_str());
+		return;
+	}
+
+	// ָϢϢǰ
+	pthread_mutex_lock(&msgMutex);
+	msgQueue->insert(msgQueue->begin(), recovered.begin(), recovered.end());
+	for (std::vector<QueuedBatch>::iterator iter = msgQueueBatches.begin(); iter != msgQueueBatches.end(); ++iter) {
+		iter->start += recovered.size();
+		iter->end += recovered.size();
+	}
+	for (logentry_vector_t::iterator iter = recovered.begin(); iter != recovered.end(); ++iter) {
+		msgQueueSize += (*iter)->message.size();
+	}
+	if (!recovered.empty()) {
+		msgQueueWalRanges.insert(msgQueueWalRanges.begin(), recovered_range);
+	}
+	wal = new_wal;
+	pthread_mutex_unlock(&msgMutex);
 }
 
 void StoreQueue::openInline() {
@@ -11,10 +11,20 @@
 
 #include "gen-cpp/forwarder.h"
 #include "store.h"
+#include "wal.h"
 
 /*
  * ʵһкһ߳ڷַ¼store. ACETaskʵ
  * ָstore.
+ *
+ * wal=yeswal_pathʱ, Log()ȰϢ׷ӵwal_pathµWriteAheadLog, ֮ӲOK,
+ * ʧܵĲ, TRY_LATER. ÿϢԼWALеķΧ, store(lost)߹֮űΪ.
+ * WALֻڶϢ; store֮ʧĺͲWALʱһֻ"lost".
+ *
+ * Log()batchIdһϢֻһʱ, storeʱһ, εbatchIdsenderId.
+ * Գ嵽ͬԱݸλϵͬһʱϳ. Ϣһ𽻸store.
+ *
+ * max_age()ʱ, ȡһϢstore֮ǰ, µϢѾmax_age, expired.
  */
 class StoreQueue {
 public:
@@ -23,6 +33,16 @@ public:
 	virtual ~StoreQueue();
 
 	void addMessage(logentry_ptr_t entry);
+	// wal_rangeЩϢѾ̵WALΧ, ûWALʱΪNULL.
+	// batch_idΪ0ʱentriesLog()һ, sender_idεsenderId
+	void addMessages(const logentry_vector_t& entries, const WalRange* wal_range = NULL, int64_t batch_id = 0, const std::string& sender_id = "");
+
+	// WALʱLog()appendWal, waitDurableɹ֮ٴŷΧaddMessages, ʧܵabandonWal
+	bool usesWal();
+	bool walConfigured(); // wal=yes, modelҲ
+	WalRange appendWal(const logentry_vector_t& entries);
+	bool waitDurable(const WalRange& range);
+	void abandonWal(const WalRange& range);
 
 	void configureAndOpen(pStoreConf configuration); // closes first if already open
 
@@ -47,6 +67,18 @@ private:
 	void storeInitCommon();
 	void configureInline(pStoreConf configuration);
 	void openInline();
+	void configureWal(pStoreConf configuration);
+	void openWal(); // ָϢŵ
+
+	// ԭתmsgQueueеλ[start, end)
+	struct QueuedBatch {
+		unsigned long start;
+		unsigned long end;
+		int64_t batchId;
+		std::string senderId;
+	};
+
+	unsigned long handleQueued(boost::shared_ptr<logentry_vector_t> messages, const std::vector<QueuedBatch>& batches); // ضʧϢ
 
 	enum store_command_t {
 		CMD_CONFIGURE, CMD_OPEN, CMD_STOP
@@ -68,6 +100,9 @@ private:
 	cmd_queue_t cmdQueue;
 	boost::shared_ptr<logentry_vector_t> msgQueue;
 	unsigned long msgQueueSize;
+	std::vector<WalRange> msgQueueWalRanges; // msgQueueеϢWALеķΧ
+	std::vector<QueuedBatch> msgQueueBatches;
+	time_t msgQueueNewest; // msgQueueһϢӵʱ
 	pthread_t storeThread;
 
 	// Mutexes
@@ -88,6 +123,12 @@ private:
 	time_t checkPeriod; // periodicCheck(ʱ䵥λΪsecond)
 	unsigned long targetWriteSize; // λΪbyte
 	time_t maxWriteInterval; // λΪsecond
+	time_t maxAge; // λΪsecond, 0ʾ
+	bool forwardBatchIds; // storebatchIdʱŰεηֿhandleBatch, ϲһ
+	bool walEnabled;
+	std::string walPath;
+	unsigned long walSegmentBytes;
+	boost::shared_ptr<WriteAheadLog> wal; // ֻstore߳ǰһ, ֮󲻻
 
 	// StoreϢľ洢.
 	boost::shared_ptr<Store> store;
@@ -0,0 +1,94 @@
+#include "task_queue.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <stdexcept>
+
+#include "logger.h"
+
+using boost::shared_ptr;
+
+TaskQueue g_fileTaskQueue;
+TaskQueue g_compressTaskQueue;
+TaskQueue g_sendTaskQueue(DEFAULT_SEND_TASK_THREADS);
+TaskQueue g_primarySendTaskQueue(DEFAULT_SEND_TASK_THREADS);
+
+static void* taskThreadStatic(void *this_ptr) {
+	TaskQueue *queue_ptr = (TaskQueue*) this_ptr;
+	queue_ptr->threadMember();
+	return NULL;
+}
+
+TaskQueue::TaskQueue(unsigned num_threads) :
+	numThreads(num_threads), started(false) {
+	pthread_mutex_init(&taskMutex, NULL);
+	pthread_cond_init(&hasTaskCond, NULL);
+}
+
+TaskQueue::~TaskQueue() {
+	// ȫֶڽ˳ʱ, ̲߳join.
+	// ̻߳hasTaskCondϵ, ʱdestroyһֱ, ߳Ͳdestroy
+	if (!started) {
+		pthread_mutex_destroy(&taskMutex);
+		pthread_cond_destroy(&hasTaskCond);
+	}
+}
+
+void TaskQueue::setNumThreads(unsigned num_threads) {
+	pthread_mutex_lock(&taskMutex);
+	if (started) {
+		LOG_OPER("WARNING: task queue already started with <%u> threads, ignoring <%u>", numThreads, num_threads);
+	} else if (num_threads > 0) {
+		numThreads = num_threads;
+	}
+	pthread_mutex_unlock(&taskMutex);
+}
+
+unsigned long TaskQueue::getSize() {
+	pthread_mutex_lock(&taskMutex);
+	unsigned long size = tasks.size();
+	pthread_mutex_unlock(&taskMutex);
+	return size;
+}
+
+void TaskQueue::addTask(shared_ptr<Task> task) {
+	pthread_mutex_lock(&taskMutex);
+	if (!started) {
+		startThreads();
+	}
+	tasks.push(task);
+	pthread_cond_signal(&hasTaskCond);
+	pthread_mutex_unlock(&taskMutex);
+}
+
+// ߱taskMutex
+void TaskQueue::startThreads() {
+	for (unsigned i = 0; i < numThreads; ++i) {
+		pthread_t thread;
+		if (0 != pthread_create(&thread, NULL, taskThreadStatic, (void*) this)) {
+			throw std::runtime_error("pthread_create failed in TaskQueue");
+		}
+		threads.push_back(thread);
+	}
+	started = true;
+	LOG_OPER("task queue started <%u> threads", numThreads);
+}
+
+void TaskQueue::threadMember() {
+	while (true) {
+		pthread_mutex_lock(&taskMutex);
+		while (tasks.empty()) {
+			pthread_cond_wait(&hasTaskCond, &taskMutex);
+		}
+		shared_ptr<Task> task = tasks.front();
+		tasks.pop();
+		pthread_mutex_unlock(&taskMutex);
+
+		try {
+			task->run();
+		} catch (std::exception const& e) {
+			LOG_OPER("Exception < %s > running background task", e.what());
+		}
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef FORWARDER_TASK_QUEUE_H
+#define FORWARDER_TASK_QUEUE_H
+
+#include <queue>
+#include <vector>
+#include <pthread.h>
+
+#include <boost/shared_ptr.hpp>
+
+#define DEFAULT_SEND_TASK_THREADS 16
+
+/*
+ * ̨, TaskQueueĹִ߳.
+ */
+class Task {
+public:
+	virtual ~Task() {
+	}
+	virtual void run() = 0;
+};
+
+/*
+ * ̨. ѱȽϺʱļ(رļ,дͳϢ,ӵ)StoreQueue߳óȥ.
+ * ߳ڵһaddTaskʱ.
+ */
+class TaskQueue {
+public:
+	TaskQueue(unsigned num_threads = 1);
+	virtual ~TaskQueue();
+
+	void addTask(boost::shared_ptr<Task> task);
+
+	// ֻ֮߳ǰòЧ
+	void setNumThreads(unsigned num_threads);
+
+	// ֻ״̬鿴.
+	unsigned long getSize();
+
+	// ̵߳ѭ
+	void threadMember();
+
+private:
+	void startThreads();
+
+	std::queue<boost::shared_ptr<Task> > tasks;
+	std::vector<pthread_t> threads;
+	unsigned numThreads;
+	bool started;
+
+	pthread_mutex_t taskMutex; // ƶtasksread/modify
+	pthread_cond_t hasTaskCond;
+
+	// ֵ
+	TaskQueue(TaskQueue& rhs);
+	TaskQueue& operator=(TaskQueue& rhs);
+};
+
+// ļصĺ̨񶼷
+extern TaskQueue g_fileTaskQueue;
+// ѹblock, ļֿѹrotate
+extern TaskQueue g_compressTaskQueue;
+// ˶Գ巢͵NetworkStoreĶԳ, ÿڵֵͷڼռһ߳. Ͳ
+extern TaskQueue g_sendTaskQueue;
+// ҪԳε, ͶԳֿ, ڵֵĶԳ
+extern TaskQueue g_primarySendTaskQueue;
+
+#endif // !defined FORWARDER_TASK_QUEUE_H
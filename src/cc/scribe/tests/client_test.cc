@@ -69,7 +69,7 @@ int main(int argc, char **argv) {
 
                 gettimeofday(&bwstart, NULL);
 
-		ResultCode Log(const std::vector<LogEntry> & messages);
+		ResultCode Log(const std::vector<LogEntry> & messages, const int64_t batchId, const std::string& senderId);
                 for(int idx=0;idx<2048;++idx) {
                         vector<LogEntry> messages;
                         for(int i=0;i<200;++i) {
@@ -78,7 +78,7 @@ int main(int argc, char **argv) {
 				message.message = "1234567890123456789012345678901234567890123456789012345678901234567890";
 				messages.push_back(message);
                         }
-                        ResultCode rc = client.Log(messages);
+                        ResultCode rc = client.Log(messages, 0, "");
 //			printf("rcode: %d\n", rc);
                 }
 
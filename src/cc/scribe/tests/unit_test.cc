@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "scribe/crc32c.h"
+#include "scribe/dedup_window.h"
+#include "scribe/hash_ring.h"
+#include "scribe/log_frame.h"
+
+using namespace std;
+using namespace forwarder::thrift;
+
+/*
+ * crc32c, Log()֡, DedupWindowHashRingĵԪ, Ҫ.
+ * ʧʱӡ1.
+ */
+
+static int failures = 0;
+
+#define CHECK(cond)                                                             \
+{                                                                               \
+        if (!(cond)) {                                                          \
+                fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+                ++failures;                                                     \
+        }                                                                       \
+}
+
+// λCRC32C, crc32c.ccʵֶ
+static unsigned crc32cReference(const string& data) {
+	unsigned crc = 0xFFFFFFFF;
+	for (string::size_type i = 0; i < data.length(); ++i) {
+		crc ^= (unsigned char) data[i];
+		for (int j = 0; j < 8; ++j) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+static void testCrc32c() {
+	// RFC 3720 B.4
+	string zeros(32, '\0');
+	string ones(32, '\xff');
+	string ascending;
+	for (int i = 0; i < 32; ++i) {
+		ascending += (char) i;
+	}
+	CHECK(crc32c(0, "123456789", 9) == 0xE3069283);
+	CHECK(crc32c(0, zeros.data(), zeros.length()) == 0x8A9136AA);
+	CHECK(crc32c(0, ones.data(), ones.length()) == 0x62A8AB43);
+	CHECK(crc32c(0, ascending.data(), ascending.length()) == 0x46DD794E);
+	CHECK(crc32c(0, "", 0) == 0);
+
+	// ͳ, ֶμ
+	string data;
+	for (int i = 0; i < 1000; ++i) {
+		data += (char) (i * 7 + 3);
+	}
+	for (string::size_type start = 0; start < 9; ++start) {
+		string part = data.substr(start);
+		CHECK(crc32c(0, part.data(), part.length()) == crc32cReference(part));
+	}
+	unsigned whole = crc32c(0, data.data(), data.length());
+	unsigned split = crc32c(crc32c(0, data.data(), 333), data.data() + 333, data.length() - 333);
+	CHECK(whole == split);
+	printf("crc32c: %s\n", crc32cHardware() ? "hardware" : "software");
+}
+
+static logentry_ptr_t makeEntry(const string& category, const string& message) {
+	logentry_ptr_t entry(new LogEntry);
+	entry->category = category;
+	entry->message = message;
+	return entry;
+}
+
+static void testLogFrame() {
+	logentry_vector_t messages;
+	messages.push_back(makeEntry("cat", "first"));
+	messages.push_back(makeEntry("cat", string(1000, 'x')));
+	messages.push_back(makeEntry("other", ""));
+
+	for (int with_id = 0; with_id < 2; ++with_id) {
+		string frame;
+		encodeLogFrame(messages, frame, with_id ? 0x123456789LL : 0, with_id ? "sender" : "");
+
+		unsigned long frame_bytes = 0;
+		unsigned num_messages = 0;
+		CHECK(parseLogFrameHeader(frame.data(), frame_bytes, num_messages));
+		CHECK(frame_bytes == frame.length());
+		CHECK(num_messages == messages.size());
+
+		logentry_vector_t decoded;
+		CHECK(decodeLogFrame(frame, decoded));
+		CHECK(decoded.size() == messages.size());
+		for (unsigned i = 0; i < decoded.size() && i < messages.size(); ++i) {
+			CHECK(decoded[i]->category == messages[i]->category);
+			CHECK(decoded[i]->message == messages[i]->message);
+		}
+
+		// ضϵ֡: ȶԲ
+		for (string::size_type cut = 1; cut < frame.length(); cut += 97) {
+			logentry_vector_t partial;
+			CHECK(!decodeLogFrame(frame.substr(0, frame.length() - cut), partial));
+		}
+
+		// ֶαĻ
+		string bad_length(frame);
+		bad_length[0] ^= 0x10;
+		logentry_vector_t ignored;
+		CHECK(!decodeLogFrame(bad_length, ignored));
+
+		// Log()֡ͷ
+		string bad_name(frame);
+		bad_name[8] = 'X';
+		CHECK(!parseLogFrameHeader(bad_name.data(), frame_bytes, num_messages));
+		CHECK(!decodeLogFrame(bad_name, ignored));
+
+		// ԪͱĻ, طʱ֡ͷ
+		string bad_type(frame);
+		bad_type[19] = 0x7f;
+		CHECK(!parseLogFrameHeader(bad_type.data(), frame_bytes, num_messages));
+	}
+
+	// ׷ӵͬһbuffer֡һһؽ
+	string frames;
+	appendLogFrame(messages, 1, frames);
+	string::size_type first_end = frames.length();
+	appendLogFrame(logentry_vector_t(1, messages[0]), 2, frames, 42, "sender");
+	unsigned long frame_bytes = 0;
+	unsigned num_messages = 0;
+	CHECK(parseLogFrameHeader(frames.data(), frame_bytes, num_messages));
+	CHECK(frame_bytes == first_end && num_messages == 3);
+	CHECK(parseLogFrameHeader(frames.data() + first_end, frame_bytes, num_messages));
+	CHECK(first_end + frame_bytes == frames.length() && num_messages == 1);
+	logentry_vector_t second;
+	CHECK(decodeLogFrame(frames.substr(first_end), second));
+	CHECK(second.size() == 1 && second[0]->message == "first");
+}
+
+static void testDedupWindow() {
+	DedupWindow dedup(64, 2);
+	CHECK(dedup.enabled());
+
+	CHECK(dedup.check("a", 1) == DedupWindow::BATCH_NEW);
+	CHECK(dedup.check("a", 1) == DedupWindow::BATCH_IN_PROGRESS);
+	dedup.finish("a", 1, true);
+	CHECK(dedup.check("a", 1) == DedupWindow::BATCH_DUPLICATE);
+
+	// ûдɹطʱҪ
+	CHECK(dedup.check("a", 2) == DedupWindow::BATCH_NEW);
+	dedup.finish("a", 2, false);
+	CHECK(dedup.check("a", 2) == DedupWindow::BATCH_NEW);
+	dedup.finish("a", 2, true);
+	CHECK(dedup.check("a", 3) == DedupWindow::BATCH_NEW);
+	dedup.finish("a", 3, true);
+
+	// ǰƵ66֮, ֻϵó64id
+	CHECK(dedup.check("a", 66) == DedupWindow::BATCH_NEW);
+	dedup.finish("a", 66, true);
+	CHECK(dedup.check("a", 3) == DedupWindow::BATCH_DUPLICATE);
+	CHECK(dedup.check("a", 2) == DedupWindow::BATCH_NEW);
+	dedup.finish("a", 2, false);
+
+	// max_sendersʱûùķͷ
+	CHECK(dedup.check("b", 1) == DedupWindow::BATCH_NEW);
+	dedup.finish("b", 1, true);
+	CHECK(dedup.check("a", 66) == DedupWindow::BATCH_DUPLICATE);
+	CHECK(dedup.check("c", 1) == DedupWindow::BATCH_NEW);
+	dedup.finish("c", 1, true);
+	CHECK(dedup.check("b", 1) == DedupWindow::BATCH_NEW);
+	dedup.finish("b", 1, false);
+
+	// ڴķͷᱻ
+	DedupWindow busy(64, 1);
+	CHECK(busy.check("a", 5) == DedupWindow::BATCH_NEW);
+	CHECK(busy.check("b", 5) == DedupWindow::BATCH_NEW);
+	CHECK(busy.check("a", 5) == DedupWindow::BATCH_IN_PROGRESS);
+	busy.finish("a", 5, true);
+	busy.finish("b", 5, true);
+
+	dedup.configure(0, 2);
+	CHECK(!dedup.enabled());
+	CHECK(dedup.check("a", 66) == DedupWindow::BATCH_NEW);
+}
+
+static void testHashRing() {
+	vector<string> members;
+	members.push_back("host1:1463");
+	members.push_back("host2:1463");
+	members.push_back("host3:1463");
+	HashRing ring(100);
+	ring.setMembers(members, 100);
+	vector<unsigned long> loads(members.size(), 0);
+
+	HashRing empty;
+	CHECK(empty.lookup("key", vector<unsigned long> (), 0) == -1);
+
+	// ȥһԱʱ, ֻԭֵkeyỻԱ
+	vector<string> fewer(members.begin(), members.end() - 1);
+	HashRing smaller(100);
+	smaller.setMembers(fewer, 100);
+	map<int, int> counts;
+	for (int i = 0; i < 1000; ++i) {
+		char key[32];
+		snprintf(key, sizeof(key), "category%d", i);
+		int index = ring.lookup(key, loads, 0);
+		CHECK(index >= 0 && index < (int) members.size());
+		CHECK(index == ring.lookup(key, loads, 0));
+		++counts[index];
+		if (index < (int) fewer.size()) {
+			CHECK(smaller.lookup(key, vector<unsigned long> (fewer.size(), 0), 0) == index);
+		}
+	}
+	for (unsigned i = 0; i < members.size(); ++i) {
+		CHECK(counts[i] > 200);
+	}
+
+	// ˵ĳԱ
+	int index = ring.lookup("category0", loads, 0);
+	loads[index] = 5;
+	int other = ring.lookup("category0", loads, 5);
+	CHECK(other >= 0 && other != index);
+}
+
+int main(int argc, char **argv) {
+	testCrc32c();
+	testLogFrame();
+	testDedupWindow();
+	testHashRing();
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -4,6 +4,7 @@
 
 
 #include <string>
+#include <sys/time.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/split.hpp>
@@ -45,5 +46,18 @@ class strhash {
                 }
 };
 
+// ǰʱ, λΪ
+inline unsigned long long currentTimeMs() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// ǰʱ, λΪ, С
+inline double currentTimeSec() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
 
 #endif /* CLOUDSCRIBE_UTILS_H */
@@ -0,0 +1,436 @@
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "crc32c.h"
+#include "logger.h"
+
+#define WAL_RECORD_HEADER_SIZE 8
+#define WAL_MAX_RECORD_SIZE    (64 * 1024 * 1024)
+
+using namespace std;
+using namespace forwarder::thrift;
+
+static void* walCommitThreadStatic(void *this_ptr) {
+	WriteAheadLog *wal_ptr = (WriteAheadLog*) this_ptr;
+	wal_ptr->commitThreadMember();
+	return NULL;
+}
+
+static void serializeWalUInt(unsigned data, char* buffer) {
+	for (int i = 0; i < 4; ++i) {
+		buffer[i] = (char) ((data >> (8 * i)) & 0xff);
+	}
+}
+
+static unsigned unserializeWalUInt(const char* buffer) {
+	unsigned data = 0;
+	for (int i = 3; i >= 0; --i) {
+		data = (data << 8) | (unsigned char) buffer[i];
+	}
+	return data;
+}
+
+// һ¼׷ӵ_return
+static void serializeWalRecord(const LogEntry& entry, string& _return) {
+	char buffer[4];
+	string::size_type start = _return.length();
+	_return.append(WAL_RECORD_HEADER_SIZE, '\0');
+	serializeWalUInt(entry.category.length(), buffer);
+	_return.append(buffer, 4);
+	_return.append(entry.category);
+	_return.append(entry.message);
+
+	unsigned length = _return.length() - start - WAL_RECORD_HEADER_SIZE;
+	const char* payload = _return.data() + start + WAL_RECORD_HEADER_SIZE;
+	serializeWalUInt(length, &_return[start]);
+	serializeWalUInt(crc32c(0, payload, length), &_return[start + 4]);
+}
+
+static bool writeAll(int fd, const char* data, size_t length) {
+	while (length > 0) {
+		ssize_t written = ::write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		length -= written;
+	}
+	return true;
+}
+
+WriteAheadLog::WriteAheadLog(const string& path_, const string& name_, unsigned long segment_bytes) :
+	path(path_), name(name_), segmentBytes(segment_bytes), fd(-1), segmentSize(0), writtenConsumedOffset(0), appendOffset(0), durableOffset(0), consumedOffset(0),
+			stopping(false), threadRunning(false) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_mutex_init(&consumedFileMutex, NULL);
+	pthread_cond_init(&pendingCond, NULL);
+	pthread_cond_init(&durableCond, NULL);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+	close();
+	pthread_mutex_destroy(&consumedFileMutex);
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&pendingCond);
+	pthread_cond_destroy(&durableCond);
+}
+
+string WriteAheadLog::makeSegmentFilename(unsigned long long start) {
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "%020llu", start);
+	return path + "/" + name + ".wal." + suffix;
+}
+
+string WriteAheadLog::makeConsumedFilename() {
+	return path + "/" + name + ".wal.consumed";
+}
+
+// ûļʱ0
+unsigned long long WriteAheadLog::readConsumed() {
+	unsigned long long offset = 0;
+	ifstream in(makeConsumedFilename().c_str());
+	if (in.good()) {
+		in >> offset;
+		if (in.fail()) {
+			offset = 0;
+		}
+	}
+	return offset;
+}
+
+// дʱļrename, дһ
+bool WriteAheadLog::writeConsumed(unsigned long long offset) {
+	string consumed_filename = makeConsumedFilename();
+	string tmp_filename = consumed_filename + ".tmp";
+	{
+		ofstream out(tmp_filename.c_str(), ios_base::out | ios_base::trunc);
+		out << offset << endl;
+		if (out.fail()) {
+			LOG_OPER("[%s] Failed to write wal consumed offset <%s>", name.c_str(), tmp_filename.c_str());
+			return false;
+		}
+	}
+	if (0 != rename(tmp_filename.c_str(), consumed_filename.c_str())) {
+		LOG_OPER("[%s] Failed to rename wal consumed offset <%s>", name.c_str(), consumed_filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool WriteAheadLog::openSegment(unsigned long long start) {
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+	string filename = makeSegmentFilename(start);
+	fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		LOG_OPER("[%s] Failed to open wal segment <%s>: %s", name.c_str(), filename.c_str(), strerror(errno));
+		return false;
+	}
+	segmentSize = lseek(fd, 0, SEEK_END);
+
+	pthread_mutex_lock(&mutex);
+	if (segments.empty() || segments.back() != start) {
+		segments.push_back(start);
+	}
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+// segmentconsumed_offset֮Ϣ, ضĩβ𻵵ļ¼. falseʾsegmentĩβض
+bool WriteAheadLog::recoverSegment(unsigned long long start, unsigned long long consumed_offset, logentry_vector_t& recovered) {
+	string filename = makeSegmentFilename(start);
+	ifstream in(filename.c_str(), ios_base::in | ios_base::binary);
+	if (!in.good()) {
+		LOG_OPER("[%s] Failed to read wal segment <%s>", name.c_str(), filename.c_str());
+		return false;
+	}
+
+	unsigned long long pos = 0;
+	string payload;
+	char header[WAL_RECORD_HEADER_SIZE];
+	bool intact = true;
+	while (true) {
+		in.read(header, WAL_RECORD_HEADER_SIZE);
+		if (in.gcount() == 0) {
+			break;
+		}
+		if (in.gcount() != WAL_RECORD_HEADER_SIZE) {
+			intact = false;
+			break;
+		}
+		unsigned length = unserializeWalUInt(header);
+		if (length < 4 || length > WAL_MAX_RECORD_SIZE) {
+			intact = false;
+			break;
+		}
+		payload.resize(length);
+		in.read(&payload[0], length);
+		if ((unsigned) in.gcount() != length || crc32c(0, payload.data(), length) != unserializeWalUInt(header + 4)) {
+			intact = false;
+			break;
+		}
+		unsigned category_length = unserializeWalUInt(payload.data());
+		if (category_length > length - 4) {
+			intact = false;
+			break;
+		}
+
+		pos += WAL_RECORD_HEADER_SIZE + length;
+		if (start + pos > consumed_offset) {
+			logentry_ptr_t entry(new LogEntry);
+			entry->category = payload.substr(4, category_length);
+			entry->message = payload.substr(4 + category_length);
+			recovered.push_back(entry);
+		}
+	}
+	in.close();
+
+	if (!intact) {
+		LOG_OPER("[%s] Truncating wal segment <%s> at <%llu> after a partial record", name.c_str(), filename.c_str(), pos);
+		if (0 != truncate(filename.c_str(), pos)) {
+			LOG_OPER("[%s] Failed to truncate wal segment <%s>: %s", name.c_str(), filename.c_str(), strerror(errno));
+		}
+	}
+	durableOffset = start + pos;
+	return intact;
+}
+
+bool WriteAheadLog::open(logentry_vector_t& recovered, WalRange& recovered_range) {
+	try {
+		boost::filesystem::create_directories(path);
+	} catch (const std::exception& e) {
+		LOG_OPER("[%s] Failed to create wal directory <%s>: %s", name.c_str(), path.c_str(), e.what());
+		return false;
+	}
+
+	// ҳеsegment
+	string prefix = name + ".wal.";
+	vector<unsigned long long> starts;
+	DIR* dir = opendir(path.c_str());
+	if (!dir) {
+		LOG_OPER("[%s] Failed to list wal directory <%s>: %s", name.c_str(), path.c_str(), strerror(errno));
+		return false;
+	}
+	struct dirent* ent;
+	while ((ent = readdir(dir)) != NULL) {
+		string filename(ent->d_name);
+		if (filename.length() > prefix.length() && 0 == filename.compare(0, prefix.length(), prefix)) {
+			string suffix = filename.substr(prefix.length());
+			if (suffix.find_first_not_of("0123456789") == string::npos) {
+				starts.push_back(strtoull(suffix.c_str(), NULL, 10));
+			}
+		}
+	}
+	closedir(dir);
+	sort(starts.begin(), starts.end());
+
+	consumedOffset = readConsumed();
+	writtenConsumedOffset = consumedOffset;
+	durableOffset = consumedOffset;
+	segments.clear();
+	outstanding.clear();
+	failedRanges.clear();
+	for (vector<unsigned long long>::iterator iter = starts.begin(); iter != starts.end(); ++iter) {
+		// һsegmentʼƫƲconsumed, segmentѾȫ
+		if (iter + 1 != starts.end() && *(iter + 1) <= consumedOffset) {
+			unlink(makeSegmentFilename(*iter).c_str());
+			continue;
+		}
+		segments.push_back(*iter);
+		// ÿsegmentļԼʼƫ, мsegmentض(дʧʱûܽضϻȥ)ҲӰ
+		recoverSegment(*iter, consumedOffset, recovered);
+	}
+	if (durableOffset < consumedOffset) {
+		durableOffset = consumedOffset;
+	}
+	appendOffset = durableOffset;
+	recovered_range.start = consumedOffset;
+	recovered_range.end = appendOffset;
+	if (!recovered.empty()) {
+		outstanding[recovered_range.start] = recovered_range.end;
+	}
+
+	if (!segments.empty() && durableOffset >= segments.back()) {
+		if (!openSegment(segments.back())) {
+			return false;
+		}
+	} else if (!openSegment(durableOffset)) {
+		return false;
+	}
+
+	if (!recovered.empty()) {
+		LOG_OPER("[%s] Recovered <%u> messages from wal", name.c_str(), (unsigned) recovered.size());
+	}
+
+	stopping = false;
+	if (0 != pthread_create(&commitThread, NULL, walCommitThreadStatic, (void*) this)) {
+		LOG_OPER("[%s] Failed to start wal commit thread", name.c_str());
+		return false;
+	}
+	threadRunning = true;
+	return true;
+}
+
+void WriteAheadLog::close() {
+	if (threadRunning) {
+		pthread_mutex_lock(&mutex);
+		stopping = true;
+		pthread_cond_signal(&pendingCond);
+		pthread_mutex_unlock(&mutex);
+		pthread_join(commitThread, NULL);
+		threadRunning = false;
+	}
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+WalRange WriteAheadLog::append(const logentry_vector_t& entries) {
+	WalRange range;
+	pthread_mutex_lock(&mutex);
+	range.start = appendOffset;
+	string::size_type before = pending.length();
+	for (logentry_vector_t::const_iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+		serializeWalRecord(**iter, pending);
+	}
+	appendOffset += pending.length() - before;
+	range.end = appendOffset;
+	if (range.end > range.start) {
+		outstanding[range.start] = range.end;
+		pthread_cond_signal(&pendingCond);
+	}
+	pthread_mutex_unlock(&mutex);
+	return range;
+}
+
+// ߱mutex
+bool WriteAheadLog::isFailed(const WalRange& range) {
+	map<unsigned long long, unsigned long long>::iterator iter = failedRanges.upper_bound(range.start);
+	if (iter == failedRanges.begin()) {
+		return false;
+	}
+	--iter;
+	return range.start < iter->second;
+}
+
+bool WriteAheadLog::waitDurable(const WalRange& range) {
+	pthread_mutex_lock(&mutex);
+	while (durableOffset < range.end && !isFailed(range)) {
+		pthread_cond_wait(&durableCond, &mutex);
+	}
+	bool durable = !isFailed(range);
+	pthread_mutex_unlock(&mutex);
+	return durable;
+}
+
+void WriteAheadLog::consumed(const WalRange& range) {
+	pthread_mutex_lock(&mutex);
+	map<unsigned long long, unsigned long long>::iterator found = outstanding.find(range.start);
+	if (found != outstanding.end() && found->second == range.end) {
+		outstanding.erase(found);
+	}
+	// Сδƫ, û̵Ĳ
+	unsigned long long offset = outstanding.empty() ? appendOffset : outstanding.begin()->first;
+	if (offset > durableOffset) {
+		offset = durableOffset;
+	}
+	if (offset <= consumedOffset) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	consumedOffset = offset;
+	// ֮ǰķΧconsumed, ˵ǵĽ
+	while (!failedRanges.empty() && failedRanges.begin()->second <= offset) {
+		failedRanges.erase(failedRanges.begin());
+	}
+	pthread_mutex_unlock(&mutex);
+
+	// store̺߳Log(), ˳дļ, þɵƫƸµ
+	vector<unsigned long long> obsolete;
+	pthread_mutex_lock(&consumedFileMutex);
+	pthread_mutex_lock(&mutex);
+	offset = consumedOffset;
+	// һsegmentд, ɾ
+	while (segments.size() > 1 && segments[1] <= offset) {
+		obsolete.push_back(segments.front());
+		segments.erase(segments.begin());
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (offset > writtenConsumedOffset && writeConsumed(offset)) {
+		writtenConsumedOffset = offset;
+	}
+	for (vector<unsigned long long>::iterator iter = obsolete.begin(); iter != obsolete.end(); ++iter) {
+		unlink(makeSegmentFilename(*iter).c_str());
+	}
+	pthread_mutex_unlock(&consumedFileMutex);
+}
+
+// дһύļ¼fdatasync.
+// ʧʱضϻд֮ǰĳȲصsegment, һύµsegmentʼ, һֱʧȥ
+bool WriteAheadLog::commit(const string& data, unsigned long long start) {
+	// segmentд, ϴдʧ, ʹӵǰλÿһµ. ¼segment
+	if ((fd < 0 || segmentSize >= segmentBytes) && !openSegment(start)) {
+		return false;
+	}
+	if (writeAll(fd, data.data(), data.length()) && 0 == fdatasync(fd)) {
+		segmentSize += data.length();
+		return true;
+	}
+
+	LOG_OPER("[%s] Failed to write wal segment: %s", name.c_str(), strerror(errno));
+	if (0 != ftruncate(fd, segmentSize)) {
+		LOG_OPER("[%s] Failed to truncate wal segment after a failed write: %s", name.c_str(), strerror(errno));
+	}
+	::close(fd);
+	fd = -1;
+	return false;
+}
+
+void WriteAheadLog::commitThreadMember() {
+	string data;
+	while (true) {
+		pthread_mutex_lock(&mutex);
+		while (pending.empty() && !stopping) {
+			pthread_cond_wait(&pendingCond, &mutex);
+		}
+		if (pending.empty()) {
+			pthread_mutex_unlock(&mutex);
+			break;
+		}
+		data.clear();
+		data.swap(pending);
+		unsigned long long end = appendOffset;
+		pthread_mutex_unlock(&mutex);
+
+		unsigned long long start = end - data.length();
+		bool success = commit(data, start);
+
+		pthread_mutex_lock(&mutex);
+		if (success) {
+			durableOffset = end;
+		} else {
+			failedRanges[start] = end;
+		}
+		pthread_cond_broadcast(&durableCond);
+		pthread_mutex_unlock(&mutex);
+	}
+}
@@ -0,0 +1,94 @@
+#ifndef FORWARDER_WAL_H
+#define FORWARDER_WAL_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "common.h"
+
+// һappendļ¼־еķΧ[start, end)
+struct WalRange {
+	WalRange() :
+		start(0), end(0) {
+	}
+
+	unsigned long long start;
+	unsigned long long end;
+};
+
+/*
+ * һStoreQueuewrite-ahead log, Log()OK֮ǰϢ, ̱ʱָ.
+ *
+ * ־segment_bytesֳɶsegmentļ: <path>/<name>.wal.<ʼƫ>, ƫ־е߼ֽ.
+ * ÿ¼: (4) CRC32C(4) category(4) category message, ȺCRCֻĲ.
+ *
+ * ÿappendķΧconsumed֮ǰδ. Сδƫ(Ѿ̵ƫ)<path>/<name>.wal.consumed,
+ * segmentλ֮ǰʱɾ. ʱλÿʼָ, ֮ѾѹķΧҲһ.
+ *
+ * group commit: appendֻѼ¼Žڴύ, ɵύ߳һдfdatasync,
+ * ڼ׷ӵļ¼ܵһ. ˶߳(num_thrift_server_threads)ʱLog()һfdatasync.
+ * дʧʱһεķΧʧ, ļضϻд֮ǰĳ, һύµsegmentʼ, мһοյƫ.
+ * ָʱȻCRCԵļ¼(дһͱ)ͽضϵ.
+ */
+class WriteAheadLog {
+public:
+	WriteAheadLog(const std::string& path, const std::string& name, unsigned long segment_bytes);
+	virtual ~WriteAheadLog();
+
+	// ־, recoveredϴûбѵϢ, recovered_rangeǵķΧ, ֮ҲҪconsumed
+	bool open(logentry_vector_t& recovered, WalRange& recovered_range);
+	void close();
+
+	// Žύ, Щ¼ķΧ
+	WalRange append(const logentry_vector_t& entries);
+	// ȵrangeļ¼, дʧʱfalse
+	bool waitDurable(const WalRange& range);
+	// rangeϢѾҪ(store, , дʧܺû)
+	void consumed(const WalRange& range);
+
+	// ύ̵߳ѭ
+	void commitThreadMember();
+
+private:
+	std::string makeSegmentFilename(unsigned long long start);
+	std::string makeConsumedFilename();
+	unsigned long long readConsumed();
+	bool writeConsumed(unsigned long long offset);
+	bool openSegment(unsigned long long start); // ֻύ̻߳openе
+	bool recoverSegment(unsigned long long start, unsigned long long consumed_offset, logentry_vector_t& recovered);
+	bool commit(const std::string& data, unsigned long long start); // ֻύ߳е
+	bool isFailed(const WalRange& range); // ߱mutex
+
+	std::string path;
+	std::string name;
+	unsigned long segmentBytes;
+
+	// ֻύ̻߳
+	int fd; // дʧ֮Ϊ-1, һύʱµsegment
+	unsigned long segmentSize; // ǰsegmentѾд˵ֽ
+
+	pthread_mutex_t consumedFileMutex; // ˳дconsumedļ, ɾsegment. Ҫmutex֮ǰ
+	unsigned long long writtenConsumedOffset; // consumedFileMutex
+
+	pthread_mutex_t mutex; // ״̬
+	pthread_cond_t pendingCond; // ύ
+	pthread_cond_t durableCond; // durableOffset
+	std::string pending; // ûдļ¼
+	unsigned long long appendOffset; // pendingĩβƫ
+	unsigned long long durableOffset; // Ѿ̵ƫ
+	unsigned long long consumedOffset;
+	std::map<unsigned long long, unsigned long long> outstanding; // ûconsumedķΧ, start -> end
+	std::map<unsigned long long, unsigned long long> failedRanges; // дʧܵύ, start -> end
+	std::vector<unsigned long long> segments; // segmentʼƫ, С
+	bool stopping;
+	bool threadRunning;
+	pthread_t commitThread;
+
+	// ֵ
+	WriteAheadLog(WriteAheadLog& rhs);
+	WriteAheadLog& operator=(WriteAheadLog& rhs);
+};
+
+#endif // !defined FORWARDER_WAL_H